@@ -0,0 +1,201 @@
+#include "admin.h"
+#include "cache.h"
+#include "stats.h"
+
+extern struct cache_block* head;
+
+/*
+ * Requests for the proxy itself rather than for a server:
+ *   PURGE http://host/path        drop one object
+ *   PURGE PREFIX*                 drop every object under PREFIX,
+ *                                 a * matches any string
+ *   GET /purge?uri=URI            the same, URI may contain *
+ *   GET /purge?prefix=PREFIX      drop every object under PREFIX
+ *   GET /purge?host=HOST[:PORT]   drop every object of a server
+ *   GET /purge?tag=KEY[,KEY...]   drop every object tagged with a key
+ *                                 by Surrogate-Key or Cache-Tag
+ *   GET /stats                    hit ratios, per server and overall
+ * They are only accepted from the loopback interface.
+ */
+
+/**
+ * whether a request is for the admin API
+ * @param method
+ * @param uri: as in the request line
+ */
+int is_admin_request(char* method, char* uri) {
+    return strcasecmp(method, "PURGE") == 0 || uri[0] == '/';
+}
+
+/**
+ * whether the client of a connection is on this host
+ * @param fd
+ */
+static int is_local_client(int fd) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    if (getpeername(fd, (SA*) &addr, &len) < 0)
+        return 0;
+    if (addr.ss_family == AF_INET) {
+        struct sockaddr_in* in = (struct sockaddr_in*) &addr;
+        return (ntohl(in->sin_addr.s_addr) >> 24) == 127;
+    }
+    if (addr.ss_family == AF_INET6) {
+        struct in6_addr* in6 = &((struct sockaddr_in6*) &addr)->sin6_addr;
+        if (IN6_IS_ADDR_V4MAPPED(in6))
+            return in6->s6_addr[12] == 127;
+        return IN6_IS_ADDR_LOOPBACK(in6);
+    }
+    return addr.ss_family == AF_UNIX;
+}
+
+/**
+ * send a short plain text response
+ * @param fd
+ * @param keep_alive: whether the client keeps the connection
+ * @param status: e.g. "200 OK"
+ * @param body
+ */
+static void admin_reply(int fd, int keep_alive, char* status, char* body) {
+    char buf[MAXLINE];
+    int len = snprintf(buf, MAXLINE, "HTTP/1.0 %s\r\n"
+                       "Content-Type: text/plain\r\n"
+                       "Cache-Control: no-store\r\n"
+                       "Content-Length: %d\r\n%s", status, (int) strlen(body),
+                       connection_end(keep_alive));
+    struct iovec iov[2];
+    iov[0].iov_base = buf;
+    iov[0].iov_len = len;
+    iov[1].iov_base = body;
+    iov[1].iov_len = strlen(body);
+    Rio_writev(fd, iov, 2);
+}
+
+/**
+ * find a parameter of a query string and %-decode its value
+ * @param query: after the ?
+ * @param name
+ * @param value: at least MAXLINE bytes
+ * @return 1 if found, 0 otherwise
+ */
+static int query_param(char* query, char* name, char* value) {
+    int len = strlen(name);
+    char* p = query;
+    while (p && *p) {
+        if (strncmp(p, name, len) == 0 && p[len] == '=') {
+            char* s = p + len + 1;
+            int n = 0;
+            while (*s && *s != '&' && n < MAXLINE - 1) {
+                unsigned hex;
+                if (*s == '%' && sscanf(s + 1, "%2x", &hex) == 1 &&
+                    isxdigit((unsigned char) s[1]) &&
+                    isxdigit((unsigned char) s[2])) {
+                    value[n++] = hex;
+                    s += 3;
+                }
+                else if (*s == '+') {
+                    value[n++] = ' ';
+                    s++;
+                }
+                else
+                    value[n++] = *s++;
+            }
+            value[n] = '\0';
+            return 1;
+        }
+        p = strchr(p, '&');
+        if (p)
+            p++;
+    }
+    return 0;
+}
+
+/**
+ * drop every object of a server
+ * @param host: hostname, with a port to only drop that one
+ * @return number of dropped objects
+ */
+static int purge_host(char* host) {
+    char pattern[MAXLINE + 16];
+    int n;
+    snprintf(pattern, sizeof(pattern), "http://%s", host);
+    n = purge_cache(head, pattern);
+    snprintf(pattern, sizeof(pattern), "http://%s/*", host);
+    n += purge_cache(head, pattern);
+    if (!strchr(host, ':')) {
+        snprintf(pattern, sizeof(pattern), "http://%s:*", host);
+        n += purge_cache(head, pattern);
+    }
+    return n;
+}
+
+/**
+ * answer a request for the admin API
+ * @param fd: client
+ * @param rio: the client's request, after the request line
+ * @param method
+ * @param uri
+ * @param keep_alive: whether the client keeps the connection
+ */
+void serve_admin(int fd, rio_t* rio, char* method, char* uri, int keep_alive) {
+    char buf[MAXLINE], value[MAXLINE], *line;
+    int n = -1;
+
+    // the headers are not used
+    while (Rio_nextlineb(rio, &line) > 0 && strcmp(line, "\r\n") != 0)
+        ;
+    if (!is_local_client(fd)) {
+        admin_reply(fd, keep_alive, "403 Forbidden", "Admin requests are only "
+                    "accepted from this host\n");
+        return;
+    }
+
+    if (strcasecmp(method, "PURGE") == 0)
+        n = purge_cache(head, uri);
+    else if (strcasecmp(method, "GET") != 0) {
+        admin_reply(fd, keep_alive, "405 Method Not Allowed",
+                    "Unsupported method\n");
+        return;
+    }
+    else if (strcmp(uri, "/stats") == 0) {
+        char* body;
+        size_t len;
+        FILE* out = open_memstream(&body, &len);
+        if (!out)
+            unix_error("open_memstream error");
+        print_stats(out);
+        fclose(out);
+        admin_reply(fd, keep_alive, "200 OK", body);
+        free(body);
+        return;
+    }
+    else if (strncmp(uri, "/purge?", 7) == 0) {
+        char* query = uri + 7;
+        if (query_param(query, "uri", value))
+            n = purge_cache(head, value);
+        else if (query_param(query, "prefix", value)) {
+            if (strlen(value) < MAXLINE - 1)
+                strcat(value, "*");
+            n = purge_cache(head, value);
+        }
+        else if (query_param(query, "host", value))
+            n = purge_host(value);
+        else if (query_param(query, "tag", value))
+            n = purge_tags(head, value);
+        else {
+            admin_reply(fd, keep_alive, "400 Bad Request",
+                        "Expected uri=, prefix=, host= or tag=\n");
+            return;
+        }
+    }
+    else {
+        admin_reply(fd, keep_alive, "404 Not Found", "Unknown admin request\n");
+        return;
+    }
+
+    snprintf(buf, MAXLINE, "Purged %d\n", n);
+    if (n == 0 && strcasecmp(method, "PURGE") == 0)
+        admin_reply(fd, keep_alive, "404 Not Found", buf);
+    else
+        admin_reply(fd, keep_alive, "200 OK", buf);
+}
@@ -0,0 +1,9 @@
+#ifndef __ADMIN_H__
+#define __ADMIN_H__
+
+#include "csapp.h"
+
+int is_admin_request(char* method, char* uri);
+void serve_admin(int fd, rio_t* rio, char* method, char* uri, int keep_alive);
+
+#endif /* __ADMIN_H__ */
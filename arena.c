@@ -0,0 +1,764 @@
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <poll.h>
+#include <linux/memfd.h>
+#include <linux/sockios.h>
+#include <linux/errqueue.h>
+#include <linux/tcp.h>
+#include "arena.h"
+#include "cache.h"
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+/* tcpi_state of a closed connection, TCP_CLOSE in the kernel */
+#define TCP_STATE_CLOSE 7
+
+/*
+ * Cache payloads live in one arena reserved up front, backed by huge
+ * pages if possible, so that a large cache takes few TLB entries and
+ * no page faults on the request path once it is pre-faulted.
+ *
+ * The allocator uses segregated explicit free lists with boundary
+ * tags, as in malloclab. A block is a 16-byte header holding its size
+ * and whether it is in use, the payload, and an 8-byte footer copy of
+ * the header; a free block keeps its list links in the payload.
+ * Without an arena, or when it is full, cache_alloc() falls back to
+ * malloc; cache_free() tells the two apart by address.
+ *
+ * A memfd-backed arena lets hits go out with sendfile(), straight
+ * from the page cache. The socket holds on to those pages until the
+ * client acknowledged them. Other large payloads may go out with
+ * MSG_ZEROCOPY, which lends the payload's pages to the socket in the
+ * same way; the kernel reports on the socket's error queue when it
+ * is done with each send.
+ *
+ * Rather than wait for that, send_payload() returns at once and the
+ * block keeps a pin of a loan until the socket is done with its pages,
+ * so that they are not freed and reused meanwhile. A timer polls the
+ * loans: a sendfile() loan ends once the client acknowledged the bytes
+ * queued up to its payload, a zerocopy one once the notifications of
+ * its sends arrived. A loan holds a dup of the socket, which stays the
+ * same socket however the client's thread closes its own descriptor.
+ * A client that acknowledges nothing for SENDFILE_DRAIN_MS has its
+ * connection aborted, which drops the queued pages; the loan ends
+ * after that, never while the pages may still be sent.
+ */
+
+#define HDR 16
+#define FTR 8
+#define MIN_BLOCK 48
+
+#define SIZE(p) (*(size_t*) (p) & ~(size_t) 0xf)
+#define USED(p) (*(size_t*) (p) & 1)
+#define NEXT_BLK(p) ((p) + SIZE(p))
+#define PREV_FTR(p) ((p) - FTR)
+#define NEXT_FREE(p) (*(char**) ((p) + HDR))
+#define PREV_FREE(p) (*(char**) ((p) + HDR + sizeof(char*)))
+
+static char* base = NULL;
+static size_t arena_len = 0;
+static int memfd = -1;
+// this lock protects the free lists, the block tags and stats
+static sem_t arena_lock;
+static char* free_lists[ARENA_CLASSES];
+static struct arena_stats stats;
+static int zerocopy = 0;
+// this lock protects the zerocopy and loan counters of stats
+static sem_t zerocopy_lock;
+
+/* pages of a payload lent to a client socket */
+struct loan {
+    // pinned until the loan ends
+    struct cache_block* owner;
+    // a dup of the socket, and its inode, which tells sockets apart
+    int fd;
+    ino_t ino;
+    // zerocopy: sends made, and those the kernel is done with;
+    // otherwise bytes the client acknowledged once it took the payload
+    int zerocopy;
+    unsigned sent;
+    unsigned done;
+    unsigned long long acked_at;
+    // still sending, the loan must not end yet
+    int sending;
+    // bytes the client acknowledged, and coarse_msec() when that grew
+    unsigned long long acked;
+    long since;
+    struct loan* next;
+};
+
+// loans, oldest first; this lock protects them
+static struct loan* loans = NULL;
+static sem_t loan_lock;
+static struct timer loan_timer;
+static int loans_ready = 0;
+
+/**
+ * write the header and footer of a block
+ */
+static void set_block(char* p, size_t size, int used) {
+    *(size_t*) p = size | used;
+    *(size_t*) (p + size - FTR) = size | used;
+}
+
+/**
+ * free list of a block size
+ */
+static int size_class(size_t size) {
+    int c = 0;
+    while (size > MIN_BLOCK && c < ARENA_CLASSES - 1) {
+        size >>= 1;
+        c++;
+    }
+    return c;
+}
+
+static void insert_free(char* p) {
+    int c = size_class(SIZE(p));
+    NEXT_FREE(p) = free_lists[c];
+    PREV_FREE(p) = NULL;
+    if (free_lists[c])
+        PREV_FREE(free_lists[c]) = p;
+    free_lists[c] = p;
+}
+
+static void remove_free(char* p) {
+    if (PREV_FREE(p))
+        NEXT_FREE(PREV_FREE(p)) = NEXT_FREE(p);
+    else
+        free_lists[size_class(SIZE(p))] = NEXT_FREE(p);
+    if (NEXT_FREE(p))
+        PREV_FREE(NEXT_FREE(p)) = PREV_FREE(p);
+}
+
+/**
+ * merge a free block, not in a list, with its free neighbours
+ * and put the result into its list
+ */
+static void coalesce(char* p) {
+    size_t size = SIZE(p);
+    char* next = NEXT_BLK(p);
+    if (!USED(next)) {
+        remove_free(next);
+        size += SIZE(next);
+    }
+    if (!USED(PREV_FTR(p))) {
+        char* prev = p - SIZE(PREV_FTR(p));
+        remove_free(prev);
+        size += SIZE(prev);
+        p = prev;
+    }
+    set_block(p, size, 0);
+    insert_free(p);
+}
+
+/**
+ * mark the first asize bytes of a block used, freeing the rest
+ * if it is large enough to be a block
+ */
+static void place(char* p, size_t asize) {
+    size_t size = SIZE(p);
+    if (size - asize >= MIN_BLOCK) {
+        set_block(p, asize, 1);
+        set_block(p + asize, size - asize, 0);
+        coalesce(p + asize);
+    }
+    else
+        set_block(p, size, 1);
+}
+
+/**
+ * block size for a payload
+ */
+static size_t block_size(size_t size) {
+    size_t asize = (size + HDR + FTR + 15) & ~(size_t) 15;
+    return asize < MIN_BLOCK ? MIN_BLOCK : asize;
+}
+
+/**
+ * take a block for a payload out of the free lists, first fit
+ * notice: need to acquire arena_lock
+ * @return the block, NULL if none is large enough
+ */
+static char* find_fit(size_t asize) {
+    int c;
+    for (c = size_class(asize); c < ARENA_CLASSES; c++) {
+        char* p;
+        for (p = free_lists[c]; p; p = NEXT_FREE(p)) {
+            if (SIZE(p) >= asize) {
+                remove_free(p);
+                place(p, asize);
+                stats.used += SIZE(p);
+                return p;
+            }
+        }
+    }
+    return NULL;
+}
+
+static int in_arena(void* ptr) {
+    return base && (char*) ptr >= base && (char*) ptr < base + arena_len;
+}
+
+static void reap_loans(void* arg);
+
+/**
+ * prepare the list of loans, once
+ * notice: call before starting other threads, after timer_init()
+ */
+static void init_loans(void) {
+    if (loans_ready)
+        return;
+    Sem_init(&loan_lock, 0, 1);
+    Sem_init(&zerocopy_lock, 0, 1);
+    timer_setup(&loan_timer, reap_loans, NULL);
+    loans_ready = 1;
+}
+
+/**
+ * reserve the arena for a cache budget
+ * @param budget: cache size in bytes
+ * @param prefault: touch every page now rather than on first use
+ * @param lock: keep the arena in memory with mlock()
+ * @param use_memfd: map it from a memfd, for send_payload()
+ */
+void arena_init(long budget, int prefault, int lock, int use_memfd) {
+    size_t len = budget + budget / 100 * ARENA_SLACK + 2 * HDR;
+    len = (len + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    int populate = prefault ? MAP_POPULATE : 0;
+
+    Sem_init(&arena_lock, 0, 1);
+    // a memfd gives shmem pages for sendfile(), else explicit huge pages
+    // need pages reserved in vm.nr_hugepages
+    if (use_memfd) {
+        if ((memfd = syscall(SYS_memfd_create, "proxy-cache", MFD_CLOEXEC)) < 0 ||
+            ftruncate(memfd, len) < 0 ||
+            (base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | populate,
+                         memfd, 0)) == MAP_FAILED) {
+            fprintf(stderr, "arena: memfd: %s, using malloc\n", strerror(errno));
+            if (memfd >= 0)
+                close(memfd);
+            memfd = -1;
+            base = NULL;
+            return;
+        }
+        stats.memfd = 1;
+        init_loans();
+    } else
+        base = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | populate, -1, 0);
+    if (base != MAP_FAILED && !use_memfd)
+        stats.hugetlb = 1;
+    else {
+        // else ask for transparent huge pages
+        if (base == MAP_FAILED)
+            base = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED) {
+            fprintf(stderr, "arena: mmap: %s, using malloc\n", strerror(errno));
+            base = NULL;
+            return;
+        }
+        if (madvise(base, len, MADV_HUGEPAGE) < 0)
+            fprintf(stderr, "arena: madvise: %s\n", strerror(errno));
+        // touch the pages after madvise so they come as huge pages
+        if (prefault && !use_memfd) {
+            size_t i;
+            for (i = 0; i < len; i += getpagesize())
+                base[i] = 0;
+        }
+    }
+    if (lock && mlock(base, len) < 0)
+        fprintf(stderr, "arena: mlock: %s\n", strerror(errno));
+    arena_len = len;
+    stats.size = len;
+
+    // a used footer and a used, empty header frame the blocks
+    *(size_t*) (base + HDR - FTR) = 1;
+    *(size_t*) (base + len - HDR) = 1;
+    set_block(base + HDR, len - 2 * HDR, 0);
+    insert_free(base + HDR);
+    printf("arena: %ld bytes of %s pages%s\n", (long) len,
+           stats.hugetlb ? "huge" : "transparent huge",
+           memfd >= 0 ? " in a memfd" : "");
+}
+
+/**
+ * send large payloads with MSG_ZEROCOPY, with or without an arena
+ * notice: call before starting other threads
+ * @param enable
+ */
+void arena_zerocopy(int enable) {
+    init_loans();
+    zerocopy = enable;
+}
+
+/**
+ * allocate memory for a cache payload
+ * @param size
+ */
+void* cache_alloc(size_t size) {
+    if (base) {
+        P(&arena_lock);
+        char* p = find_fit(block_size(size));
+        if (!p)
+            stats.fallbacks++;
+        V(&arena_lock);
+        if (p)
+            return p + HDR;
+    }
+    return Malloc(size);
+}
+
+/**
+ * resize a cache payload, in place if possible
+ * @param ptr: from cache_alloc(), or NULL
+ * @param size
+ */
+void* cache_realloc(void* ptr, size_t size) {
+    if (!ptr)
+        return cache_alloc(size);
+    if (!in_arena(ptr))
+        return Realloc(ptr, size);
+
+    char* p = (char*) ptr - HDR;
+    size_t asize = block_size(size);
+    P(&arena_lock);
+    size_t old = SIZE(p);
+    char* next = NEXT_BLK(p);
+    // grow into a free neighbour
+    if (asize > old && !USED(next) && old + SIZE(next) >= asize) {
+        remove_free(next);
+        set_block(p, old + SIZE(next), 0);
+    }
+    if (asize <= SIZE(p)) {
+        place(p, asize);
+        stats.used += SIZE(p) - old;
+        V(&arena_lock);
+        return ptr;
+    }
+    V(&arena_lock);
+
+    void* copy = cache_alloc(size);
+    memcpy(copy, ptr, old - HDR - FTR);
+    cache_free(ptr);
+    return copy;
+}
+
+/**
+ * free a cache payload
+ * @param ptr: from cache_alloc(), or NULL
+ */
+void cache_free(void* ptr) {
+    if (!ptr)
+        return;
+    if (!in_arena(ptr)) {
+        Free(ptr);
+        return;
+    }
+    char* p = (char*) ptr - HDR;
+    P(&arena_lock);
+    stats.used -= SIZE(p);
+    set_block(p, SIZE(p), 0);
+    coalesce(p);
+    V(&arena_lock);
+}
+
+/**
+ * read the zerocopy notifications of a socket
+ * @param fd
+ * @param done: sends completed so far, updated
+ * @param copied: of those, the ones the kernel copied, updated
+ * @return 0, -1 on error
+ */
+static int reap_zerocopy(int fd, unsigned* done, long* copied) {
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+    struct msghdr msg;
+    struct cmsghdr* cm;
+
+    while (1) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+            return errno == EAGAIN || errno == EINTR ? 0 : -1;
+        for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            struct sock_extended_err* ee =
+                (struct sock_extended_err*) CMSG_DATA(cm);
+            if (ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+            // sends [ee_info, ee_data] are done
+            *done += ee->ee_data - ee->ee_info + 1;
+            if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                *copied += ee->ee_data - ee->ee_info + 1;
+        }
+    }
+}
+
+/**
+ * read the zerocopy notifications of a loan's socket, and credit them
+ * to its loans oldest first, as TCP completes sends in order
+ * notice: need to acquire loan_lock
+ * @param l: a zerocopy loan
+ */
+static void reap_socket(struct loan* l) {
+    unsigned done = 0;
+    long copied = 0;
+    struct loan* m;
+    reap_zerocopy(l->fd, &done, &copied);
+    for (m = loans; m && done > 0; m = m->next) {
+        if (m->zerocopy && m->ino == l->ino && m->done < m->sent) {
+            unsigned n = m->sent - m->done < done ? m->sent - m->done : done;
+            m->done += n;
+            done -= n;
+        }
+    }
+    if (copied) {
+        P(&zerocopy_lock);
+        stats.zerocopy_copied += copied;
+        V(&zerocopy_lock);
+    }
+}
+
+/**
+ * bytes a client acknowledged on a socket so far
+ * @param fd
+ * @param acked: filled in
+ * @return 1 if the connection is closed, and its queue dropped,
+ *         0 otherwise, -1 on error
+ */
+static int get_acked(int fd, unsigned long long* acked) {
+    struct tcp_info ti;
+    socklen_t len = sizeof(ti);
+    memset(&ti, 0, sizeof(ti));
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &len) < 0)
+        return -1;
+    *acked = ti.tcpi_bytes_acked;
+    return ti.tcpi_state == TCP_STATE_CLOSE;
+}
+
+/**
+ * start a loan of a block's pages to a client socket, pinning it
+ * @param fd: client
+ * @param owner: block the pages belong to
+ * @param zc: lent with MSG_ZEROCOPY rather than sendfile()
+ * @return the loan, not listed yet, NULL if the socket could not be kept
+ */
+static struct loan* new_loan(int fd, struct cache_block* owner, int zc) {
+    struct loan* l;
+    struct stat st;
+    int dupfd = dup(fd);
+    if (dupfd < 0)
+        return NULL;
+    if (fstat(dupfd, &st) < 0) {
+        close(dupfd);
+        return NULL;
+    }
+    l = (struct loan*) Malloc(sizeof(struct loan));
+    memset(l, 0, sizeof(struct loan));
+    l->owner = owner;
+    l->fd = dupfd;
+    l->ino = st.st_ino;
+    l->zerocopy = zc;
+    l->since = coarse_msec();
+    get_acked(dupfd, &l->acked);
+    add_reading_cnt(owner);
+    return l;
+}
+
+/**
+ * put a loan at the end of the list, and poll the list
+ * @param l
+ */
+static void list_loan(struct loan* l) {
+    struct loan** pp;
+    P(&loan_lock);
+    for (pp = &loans; *pp; pp = &(*pp)->next)
+        ;
+    *pp = l;
+    if (pp == &loans)
+        timer_add(&loan_timer, TIMER_TICK_MS);
+    P(&zerocopy_lock);
+    stats.loans++;
+    V(&zerocopy_lock);
+    V(&loan_lock);
+}
+
+/**
+ * end a loan that is not listed, releasing the block's pin
+ * @param l
+ */
+static void end_loan(struct loan* l) {
+    close(l->fd);
+    sub_reading_cnt(l->owner);
+    Free(l);
+}
+
+/**
+ * abort a loan's connection, which drops what its socket queued, so
+ * that a client that stopped reading does not keep the pages forever
+ * notice: need to acquire loan_lock
+ * @param l
+ */
+static void abort_loan(struct loan* l) {
+    struct sockaddr sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_family = AF_UNSPEC;
+    if (connect(l->fd, &sa, sizeof(sa)) < 0)
+        return;
+    P(&zerocopy_lock);
+    stats.loans_aborted++;
+    V(&zerocopy_lock);
+}
+
+/**
+ * whether the socket of a loan is done with its pages, aborting the
+ * connection if the client stalled
+ * notice: need to acquire loan_lock
+ * @param l
+ * @param now: coarse_msec()
+ */
+static int loan_done(struct loan* l, long now) {
+    unsigned long long acked;
+    int pending, closed;
+    if (l->zerocopy) {
+        reap_socket(l);
+        if (l->done >= l->sent)
+            return 1;
+    }
+    else if (ioctl(l->fd, SIOCOUTQ, &pending) == 0 && pending == 0)
+        return 1;
+    if ((closed = get_acked(l->fd, &acked)) < 0)
+        return 0;
+    // a reset or an abort dropped the queue; zerocopy sends of it
+    // still get their notifications
+    if (closed)
+        return !l->zerocopy;
+    if (!l->zerocopy && acked >= l->acked_at)
+        return 1;
+    if (acked != l->acked) {
+        l->acked = acked;
+        l->since = now;
+    }
+    else if (now - l->since >= SENDFILE_DRAIN_MS)
+        abort_loan(l);
+    return 0;
+}
+
+/**
+ * end the loans whose sockets are done with their pages, and poll
+ * again later while there are others
+ * the wheel's thread runs this
+ */
+static void reap_loans(void* arg) {
+    struct loan *l, **pp, *ended = NULL;
+    long now = coarse_msec();
+    P(&loan_lock);
+    for (pp = &loans; (l = *pp); ) {
+        if (!l->sending && loan_done(l, now)) {
+            *pp = l->next;
+            l->next = ended;
+            ended = l;
+        }
+        else
+            pp = &l->next;
+    }
+    if (loans)
+        timer_add(&loan_timer, TIMER_TICK_MS);
+    V(&loan_lock);
+    // the last pin frees the block, which takes other locks
+    while ((l = ended)) {
+        ended = l->next;
+        P(&zerocopy_lock);
+        stats.loans--;
+        V(&zerocopy_lock);
+        end_loan(l);
+    }
+}
+
+/**
+ * send a payload with MSG_ZEROCOPY, lending its pages until the
+ * kernel is done with them
+ * @param fd: client, with SO_ZEROCOPY set
+ * @param ptr
+ * @param len
+ * @param owner: block of the payload
+ */
+static void send_zerocopy(int fd, char* ptr, size_t len,
+                          struct cache_block* owner) {
+    struct loan* l = new_loan(fd, owner, 1);
+    long lent = 0;
+    size_t left = len;
+    int done;
+
+    if (!l) {
+        Rio_writen(fd, ptr, len);
+        return;
+    }
+    // listed before the first send, to be credited its notifications
+    l->sending = 1;
+    list_loan(l);
+    while (left > 0) {
+        ssize_t n = send(fd, ptr, left, MSG_ZEROCOPY);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == ENOBUFS) {
+            P(&loan_lock);
+            reap_socket(l);
+            int in_flight = l->sent > l->done;
+            V(&loan_lock);
+            if (in_flight) {
+                // too many sends in flight: wait for some to complete
+                struct pollfd pfd = { fd, 0, 0 };
+                poll(&pfd, 1, 10);
+                continue;
+            }
+            // no room for even one send in flight: copy the rest
+            if (rio_writen(fd, ptr, left) == left)
+                left = 0;
+            break;
+        }
+        if (n < 0)
+            break;
+        P(&loan_lock);
+        l->sent++;
+        V(&loan_lock);
+        lent += n;
+        ptr += n;
+        left -= n;
+    }
+    P(&loan_lock);
+    reap_socket(l);
+    l->sending = 0;
+    P(&zerocopy_lock);
+    stats.zerocopy_bytes += lent;
+    stats.zerocopy_sends += l->sent;
+    V(&zerocopy_lock);
+    // usually the client acknowledges it later, and the timer ends it
+    done = l->done >= l->sent;
+    if (done) {
+        struct loan** pp;
+        for (pp = &loans; *pp != l; pp = &(*pp)->next)
+            ;
+        *pp = l->next;
+        P(&zerocopy_lock);
+        stats.loans--;
+        V(&zerocopy_lock);
+    }
+    V(&loan_lock);
+    if (done)
+        end_loan(l);
+    if (left > 0)
+        unix_error("send_zerocopy error");
+}
+
+/**
+ * send a payload from the memfd with sendfile(), lending its pages
+ * until the client acknowledged them
+ * @param fd: client
+ * @param ptr: in the arena
+ * @param len
+ * @param owner: block of the payload
+ */
+static void send_lent(int fd, char* ptr, size_t len,
+                      struct cache_block* owner) {
+    struct sockaddr sa;
+    unsigned long long acked;
+    int pending;
+    struct loan* l;
+
+    Rio_sendfile(fd, memfd, ptr - base, len);
+    P(&arena_lock);
+    stats.sendfile_bytes += len;
+    V(&arena_lock);
+    if (ioctl(fd, SIOCOUTQ, &pending) < 0 || pending == 0 ||
+        get_acked(fd, &acked) < 0)
+        return;
+    if ((l = new_loan(fd, owner, 0))) {
+        // everything queued so far, the payload last
+        l->acked_at = acked + pending;
+        list_loan(l);
+        return;
+    }
+    // without a loan the pages must not stay queued
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_family = AF_UNSPEC;
+    connect(fd, &sa, sizeof(sa));
+    P(&zerocopy_lock);
+    stats.loans_aborted++;
+    V(&zerocopy_lock);
+}
+
+/**
+ * send a head and a payload to a client, the payload with sendfile()
+ * if it is in a memfd-backed arena, with MSG_ZEROCOPY if it is large
+ * and that is enabled, and with writev() otherwise
+ * notice: the caller must keep the payload until this returns; the
+ *         pages it lends to the socket keep a pin of their own
+ * @param fd: client
+ * @param head: sent before the payload, may be NULL
+ * @param head_len
+ * @param conn: ends the head, see connection_end(); NULL if head is
+ * @param ptr: payload from cache_alloc()
+ * @param len: bytes of the payload to send
+ * @param owner: block of the payload, pinned by the caller
+ */
+void send_payload(int fd, char* head, size_t head_len, char* conn,
+                  char* ptr, size_t len, struct cache_block* owner) {
+    int one = 1;
+    if ((memfd < 0 || !in_arena(ptr)) && zerocopy && len >= ZEROCOPY_MIN &&
+        setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0) {
+        if (head) {
+            Rio_sendn(fd, head, head_len, MSG_MORE);
+            Rio_sendn(fd, conn, strlen(conn), MSG_MORE);
+        }
+        send_zerocopy(fd, ptr, len, owner);
+        return;
+    }
+    if (memfd < 0 || len == 0 || !in_arena(ptr)) {
+        struct iovec iov[3];
+        iov[0].iov_base = head;
+        iov[0].iov_len = head ? head_len : 0;
+        iov[1].iov_base = conn;
+        iov[1].iov_len = head ? strlen(conn) : 0;
+        iov[2].iov_base = ptr;
+        iov[2].iov_len = len;
+        Rio_writev(fd, iov, 3);
+        return;
+    }
+    // the head waits for the payload to fill the first packet
+    if (head) {
+        Rio_sendn(fd, head, head_len, MSG_MORE);
+        Rio_sendn(fd, conn, strlen(conn), MSG_MORE);
+    }
+    send_lent(fd, ptr, len, owner);
+}
+
+/**
+ * copy the arena counters
+ * @param out
+ */
+void get_arena_stats(struct arena_stats* out) {
+    if (!base)
+        memset(out, 0, sizeof(*out));
+    else {
+        P(&arena_lock);
+        *out = stats;
+        V(&arena_lock);
+    }
+    if (loans_ready) {
+        P(&zerocopy_lock);
+        out->zerocopy_bytes = stats.zerocopy_bytes;
+        out->zerocopy_sends = stats.zerocopy_sends;
+        out->zerocopy_copied = stats.zerocopy_copied;
+        out->loans = stats.loans;
+        out->loans_aborted = stats.loans_aborted;
+        V(&zerocopy_lock);
+    }
+}
@@ -0,0 +1,52 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include "csapp.h"
+
+/* the arena is reserved in whole huge pages */
+#define HUGE_PAGE_SIZE (2L << 20)
+/* longest a client may acknowledge none of the pages sendfile() or
+   MSG_ZEROCOPY lent it before its connection is aborted, in ms */
+#define SENDFILE_DRAIN_MS 5000
+/* smallest payload sent with MSG_ZEROCOPY, smaller ones are copied
+   for less than waiting for the notifications costs */
+#define ZEROCOPY_MIN (32L << 10)
+/* room for allocator overhead and fragmentation, % of the budget */
+#define ARENA_SLACK 12
+/* segregated free lists, by power of two sizes */
+#define ARENA_CLASSES 32
+
+/* state of the cache arena */
+struct arena_stats {
+    long size;
+    long used;
+    // allocations that did not fit and went to malloc
+    long fallbacks;
+    // backed by MAP_HUGETLB pages, or only advised to use THP
+    int hugetlb;
+    // backed by a memfd, hits are sent with sendfile()
+    int memfd;
+    long sendfile_bytes;
+    // payloads sent with MSG_ZEROCOPY, and the sends the kernel
+    // copied anyway, e.g. on loopback
+    long zerocopy_bytes;
+    long zerocopy_sends;
+    long zerocopy_copied;
+    // payloads whose pages a client has not taken yet, and
+    // connections aborted because their client stopped taking them
+    long loans;
+    long loans_aborted;
+};
+
+struct cache_block;
+
+void arena_init(long budget, int prefault, int lock, int use_memfd);
+void arena_zerocopy(int enable);
+void* cache_alloc(size_t size);
+void* cache_realloc(void* ptr, size_t size);
+void cache_free(void* ptr);
+void send_payload(int fd, char* head, size_t head_len, char* conn,
+                  char* ptr, size_t len, struct cache_block* owner);
+void get_arena_stats(struct arena_stats* stats);
+
+#endif /* __ARENA_H__ */
@@ -1,24 +1,27 @@
 #include "cache.h"
+#include "index.h"
+#include "arena.h"
+#include "stats.h"
 
-extern int cache_size;
+extern long cache_size;
 extern sem_t list_lock;
+extern struct cache_block* head;
+
+static void expire_block(void* arg);
 
 /**
  * search for a cache block whose uri is the same
+ * the block is pinned, release it with sub_reading_cnt()
  * @param  head: list head
  * @param  uri
  * @return block ptr
  */
 struct cache_block* search_cache(struct cache_block* head, char* uri) {
-    struct cache_block* ptr = head->next;
-    while (ptr) {
-        if (strcmp(ptr->uri, uri) == 0) {
-            return ptr;
-        }
-        else
-            ptr = ptr->next;
-    }
-    return NULL;
+    P(&list_lock);
+    struct cache_block* ptr = index_find(uri, NULL);
+    add_reading_cnt(ptr);
+    V(&list_lock);
+    return ptr;
 }
 
 /**
@@ -27,10 +30,35 @@ struct cache_block* search_cache(struct cache_block* head, char* uri) {
  */
 void init_cache(struct cache_block* blk) {
     blk->size = 0;
-    blk->timestamp = clock();
+    blk->timestamp = coarse_msec();
     blk->next = NULL;
+    blk->prev = NULL;
+    blk->hash_next = NULL;
     blk->file = NULL;
+    blk->partial = 0;
+    blk->frags = NULL;
+    blk->total_size = 0;
+    blk->body_owner = NULL;
+    blk->segmented = 0;
+    blk->version = 0;
+    blk->segment = 0;
+    blk->head_size = 0;
+    blk->head = NULL;
+    blk->plain_head_size = 0;
+    blk->plain_head = NULL;
+    blk->raw_size = 0;
+    blk->expires = 0;
+    blk->stale_until = 0;
+    blk->stale_error_until = 0;
+    timer_setup(&blk->expiry, expire_block, blk);
+    blk->negative = 0;
+    blk->etag = NULL;
+    blk->last_modified = NULL;
+    blk->tags = NULL;
+    blk->tag_refs = NULL;
     blk->reading_cnt = 0;
+    blk->refreshing = 0;
+    blk->deleted = 0;
     Sem_init(&(blk->lock), 0, 1);
     return;
 }
@@ -45,42 +73,150 @@ void add_reading_cnt(struct cache_block* blk) {
 }
 
 // notice: need to acquire the block's lock
+// the last reader of a deleted block frees it
 void sub_reading_cnt(struct cache_block* blk) {
     if (blk) {
         P(&(blk->lock));
         blk->reading_cnt --;
+        int last = blk->deleted && blk->reading_cnt == 0;
         V(&(blk->lock));
+        if (last)
+            free_cache_node(blk);
     }
 }
 
 /**
- * free a cache block to prevent memory leakage
+ * mark a block that was taken out of the list as deleted
+ * it is freed now, or by its last reader
  * notice: need to acquire the block's lock
  */
+static void retire_cache_node(struct cache_block* blk) {
+    P(&(blk->lock));
+    blk->deleted = 1;
+    int unread = blk->reading_cnt == 0;
+    V(&(blk->lock));
+    if (unread)
+        free_cache_node(blk);
+}
+
+/**
+ * free a cache block to prevent memory leakage
+ */
 void free_cache_node(struct cache_block* blk) {
     if (blk) {
-        P(&(blk->lock));
+        // a shared body is freed with the block that owns it
+        if (blk->body_owner) {
+            sub_reading_cnt(blk->body_owner);
+            blk->file = NULL;
+            blk->frags = NULL;
+        }
         if (blk->file)
-            Free(blk->file);
+            cache_free(blk->file);
+        while (blk->frags) {
+            struct range_frag* next = blk->frags->next;
+            cache_free(blk->frags->data);
+            Free(blk->frags);
+            blk->frags = next;
+        }
+        if (blk->head)
+            Free(blk->head);
+        if (blk->plain_head)
+            Free(blk->plain_head);
+        if (blk->etag)
+            Free(blk->etag);
+        if (blk->last_modified)
+            Free(blk->last_modified);
+        if (blk->tags)
+            Free(blk->tags);
         Free(blk);
-        V(&(blk->lock));
     }
 }
 
+/**
+ * take a block out of the list
+ * notice: need to acquire list_lock
+ * @return 1 if blk was in the list, 0 otherwise
+ */
+static int unlink_block(struct cache_block* head, struct cache_block* blk) {
+    if (!blk->prev)
+        return 0;
+    blk->prev->next = blk->next;
+    if (blk->next)
+        blk->next->prev = blk->prev;
+    else
+        head->prev = blk->prev == head ? NULL : blk->prev;
+    blk->next = blk->prev = NULL;
+    cache_size -= BLOCK_BYTES(blk);
+    return 1;
+}
+
+/**
+ * put a block at the end of the list
+ * notice: need to acquire list_lock
+ */
+static void append_block(struct cache_block* head, struct cache_block* blk) {
+    struct cache_block* last = head->prev ? head->prev : head;
+    blk->next = NULL;
+    blk->prev = last;
+    last->next = blk;
+    head->prev = blk;
+    cache_size += BLOCK_BYTES(blk);
+}
+
+/**
+ * set a timer that removes a block once it can be neither served
+ * nor revalidated, rather than leaving it to LRU
+ * notice: need to acquire list_lock
+ */
+static void arm_expiry(struct cache_block* blk) {
+    if (blk->segment || !blk->expires || blk->etag || blk->last_modified)
+        return;
+    time_t until = blk->stale_until > blk->stale_error_until ?
+                   blk->stale_until : blk->stale_error_until;
+    long ms = (until - coarse_time()) * 1000L;
+    // the timer keeps the block alive until it fired or was cancelled
+    add_reading_cnt(blk);
+    timer_add(&blk->expiry, ms > 0 ? ms : 0);
+}
+
+/**
+ * add a block to the list and the uri index
+ * notice: need to acquire list_lock
+ */
+static void link_block(struct cache_block* head, struct cache_block* blk) {
+    append_block(head, blk);
+    index_add(blk);
+    arm_expiry(blk);
+}
+
+/**
+ * take a block out of the list and the uri index
+ * notice: need to acquire list_lock
+ * @return 1 if blk was in the list, 0 otherwise
+ */
+static int drop_block(struct cache_block* head, struct cache_block* blk) {
+    if (!unlink_block(head, blk))
+        return 0;
+    index_remove(blk);
+    // not retired yet, so this does not free it
+    if (timer_cancel(&blk->expiry))
+        sub_reading_cnt(blk);
+    return 1;
+}
+
 /**
  * update a block's timestamp
- * first delete it from list
- * then add it to the end of list
- * notice: need to acquire the block's lock
+ * move it to the end of list
+ * a block that was deleted meanwhile stays deleted
  */
 void update_timestamp(struct cache_block* head, struct cache_block* blk) {
     if (blk) {
-        clock_t ts = clock();
-        delete_cache(head, blk);
-        P(&(blk->lock));
-        blk->timestamp = ts;
-        V(&(blk->lock));
-        add_cache(head, blk);
+        P(&list_lock);
+        if (unlink_block(head, blk)) {
+            blk->timestamp = coarse_msec();
+            append_block(head, blk);
+        }
+        V(&list_lock);
     }
 }
 
@@ -91,15 +227,7 @@ void update_timestamp(struct cache_block* head, struct cache_block* blk) {
  */
 void add_cache(struct cache_block* head, struct cache_block* blk) {
     P(&list_lock);
-    struct cache_block* pre = head;
-    struct cache_block* ptr = head->next;
-    while (ptr) {
-        ptr = ptr->next;
-        pre = pre->next;
-    }
-    blk->next = pre->next;
-    pre->next = blk;
-    cache_size += blk->size;
+    link_block(head, blk);
     V(&list_lock);
     return;
 }
@@ -109,56 +237,599 @@ void add_cache(struct cache_block* head, struct cache_block* blk) {
  * but do not free it
  * @param head: list head
  * @param blk: the block to be deleted
+ * @return 1 if blk was in the list, 0 otherwise
  */
-void delete_cache(struct cache_block* head, struct cache_block* blk) {
+int delete_cache(struct cache_block* head, struct cache_block* blk) {
     P(&list_lock);
-    struct cache_block* ptr = head->next;
-    struct cache_block* pre = head;
-    while (ptr) {
-        if (ptr == blk) {
-            pre->next = ptr->next;
-            cache_size -= blk->size;
-            break;
+    int found = drop_block(head, blk);
+    V(&list_lock);
+    return found;
+}
+
+/**
+ * take the blocks of a set out of the list, with the segments of
+ * the large objects among them; the set keeps the blocks that must
+ * be retired
+ * notice: need to acquire list_lock
+ * @param head: list head
+ * @param set
+ * @param keep: version whose segments stay listed, 0 for none
+ * @return number of objects in the set, not counting segments
+ */
+static int drop_set(struct cache_block* head, struct block_set* set,
+                    int keep) {
+    char key[MAXLINE];
+    int i, n = 0, matched = set->n, dropped = 0;
+    for (i = 0; i < matched; i++) {
+        struct cache_block* blk = set->blks[i];
+        // segments are keyed #seg<version>.<index>#<uri>
+        if (blk->segmented && !blk->segment && blk->version != keep) {
+            snprintf(key, MAXLINE, "#seg%d.*", blk->version);
+            index_match(key, set);
         }
-        else {
-            ptr = ptr->next;
-            pre = pre->next;
+    }
+    // a block may have been matched twice
+    for (i = 0; i < set->n; i++) {
+        struct cache_block* blk = set->blks[i];
+        if (drop_block(head, blk)) {
+            set->blks[dropped++] = blk;
+            n += !blk->segment;
         }
     }
+    set->n = dropped;
+    return n;
+}
+
+/**
+ * retire the blocks drop_set() left in a set and free the set
+ * @param set
+ */
+static void retire_set(struct block_set* set) {
+    int i;
+    for (i = 0; i < set->n; i++)
+        retire_cache_node(set->blks[i]);
+    if (set->blks)
+        Free(set->blks);
+}
+
+/**
+ * add a block, atomically replacing all blocks of the same uri
+ * readers of a replaced block keep it until they are done
+ * @param head: list head
+ * @param blk: the new block
+ */
+void replace_cache(struct cache_block* head, struct cache_block* blk) {
+    struct block_set set = { NULL, 0, 0 };
+    struct cache_block* ptr;
+    P(&list_lock);
+    for (ptr = index_find(blk->uri, NULL); ptr != NULL;
+         ptr = index_find(blk->uri, ptr))
+        add_to_set(&set, ptr);
+    // a 304 clone keeps the version, and with it the segments
+    drop_set(head, &set, blk->segmented ? blk->version : 0);
+    link_block(head, blk);
     V(&list_lock);
-    return;
+    // they are retired outside the list lock
+    retire_set(&set);
 }
 
 /**
- * evict a cache block using LRU from the front
- * if size not enough
- * evict another recursively
+ * evict cache blocks using LRU from the front
+ * until at least size bytes are released
  * @param head: list head
  * @param size: least size of cache to be evicted
  */
-void evict_cache(struct cache_block* head, int size) {
+void evict_cache(struct cache_block* head, long size) {
+    P(&list_lock);
+    struct cache_block* ptr;
+    while (size > 0 && (ptr = head->next) != NULL) {
+        struct block_set set = { NULL, 0, 0 };
+        int i;
+        // a large object goes with its segments
+        add_to_set(&set, ptr);
+        drop_set(head, &set, 0);
+        for (i = 0; i < set.n; i++)
+            size -= BLOCK_BYTES(set.blks[i]);
+        count_stat(STAT_EVICTIONS, set.n);
+        // threads reading them free them when they are done
+        retire_set(&set);
+    }
+    V(&list_lock);
+}
+
+/**
+ * add a block, atomically replacing all blocks of the same uri,
+ * after evicting enough blocks to stay within max_size
+ * @param head: list head
+ * @param blk: the new block
+ * @param max_size: cache budget
+ */
+void store_cache(struct cache_block* head, struct cache_block* blk,
+                 long max_size) {
+    // size overflow, need to evict using LRU
+    if (BLOCK_BYTES(blk) + cache_size > max_size)
+        evict_cache(head, BLOCK_BYTES(blk) + cache_size - max_size);
+    replace_cache(head, blk);
+}
+
+/**
+ * remove a block that can no longer be served, with its segments
+ * if it is a large object
+ * the wheel's thread runs this when the block's expiry timer fires
+ */
+static void expire_block(void* arg) {
+    struct cache_block* blk = (struct cache_block*) arg;
+    struct block_set set = { NULL, 0, 0 };
+    P(&list_lock);
+    add_to_set(&set, blk);
+    drop_set(head, &set, 0);
+    V(&list_lock);
+    retire_set(&set);
+    count_stat(STAT_EXPIRED, 1);
+    // the pin of the timer
+    sub_reading_cnt(blk);
+}
+
+/**
+ * delete the blocks whose uri matches a pattern, in which * stands
+ * for any string, with the segments of the large objects among them
+ * readers of a deleted block keep it until they are done
+ * @param head: list head
+ * @param pattern: a uri, or a uri prefix followed by *
+ * @return number of deleted objects, not counting segments
+ */
+int purge_cache(struct cache_block* head, char* pattern) {
+    struct block_set set = { NULL, 0, 0 };
+    P(&list_lock);
+    index_match(pattern, &set);
+    int n = drop_set(head, &set, 0);
+    V(&list_lock);
+    retire_set(&set);
+    return n;
+}
+
+/**
+ * delete the blocks tagged with any of some surrogate keys
+ * readers of a deleted block keep it until they are done
+ * @param head: list head
+ * @param tags: separated by spaces or commas
+ * @return number of deleted objects, not counting segments
+ */
+int purge_tags(struct cache_block* head, char* tags) {
+    struct block_set set = { NULL, 0, 0 };
+    char* list = strdup(tags);
+    char* save;
+    char* tag;
     P(&list_lock);
-    struct cache_block* ptr = head->next;
-    struct cache_block* pre = head;
-    while (ptr) {
-        if (ptr->size < size) {
-            pre->next = ptr->next;
-            cache_size -= ptr->size;
-            size -= ptr->size;
-            // ensure no thread is reading from ptr
-            while (ptr->reading_cnt != 0)
-                sleep(0);
-            free_cache_node(ptr);
-            ptr = pre->next;
+    for (tag = strtok_r(list, " \t,", &save); tag;
+         tag = strtok_r(NULL, " \t,", &save))
+        index_tag(tag, &set);
+    int n = drop_set(head, &set, 0);
+    V(&list_lock);
+    retire_set(&set);
+    Free(list);
+    return n;
+}
+
+/**
+ * try to become the single thread refreshing a stale block
+ * @param blk
+ * @return 1 if the caller must refresh it, 0 if a refresh is running
+ */
+int start_refresh(struct cache_block* blk) {
+    P(&(blk->lock));
+    int first = !blk->refreshing;
+    blk->refreshing = 1;
+    V(&(blk->lock));
+    return first;
+}
+
+/**
+ * allow another refresh once one is over, unless a new version
+ * replaced the block: the refresh failed, or its response was not
+ * stored
+ * @param blk
+ */
+void end_refresh(struct cache_block* blk) {
+    P(&(blk->lock));
+    if (!blk->deleted)
+        blk->refreshing = 0;
+    V(&(blk->lock));
+}
+
+/**
+ * append one response header line to a block's stored head
+ * @param blk: the block being filled
+ * @param line: header line including its CRLF
+ * @param len: length of line
+ * @param max_size: upper bound of the stored head
+ * @return 0 on success, -1 if the head would grow beyond max_size
+ */
+int append_head(struct cache_block* blk, char* line, int len, int max_size) {
+    if (blk->head_size + len > max_size)
+        return -1;
+    // keep the head NUL terminated for parsing
+    blk->head = (char*) Realloc(blk->head, blk->head_size + len + 1);
+    memcpy(blk->head + blk->head_size, line, len);
+    blk->head_size += len;
+    blk->head[blk->head_size] = '\0';
+    return 0;
+}
+
+/**
+ * terminate a block's stored head with the Content-Length
+ * of its body, so that a hit is served without reformatting;
+ * the Connection header is the client's and is sent before
+ * the blank line, see connection_end()
+ * notice: call it after blk->size is final
+ */
+void finish_head(struct cache_block* blk) {
+    char buf[MAXLINE];
+    int len = snprintf(buf, MAXLINE, "Content-Length: %ld\r\n\r\n",
+                       object_length(blk));
+    append_head(blk, buf, len, blk->head_size + len);
+}
+
+/**
+ * replace the header with the same field name as line in a
+ * finished head, or insert line if there is none
+ * @param head: NUL terminated head, reallocated
+ * @param head_size
+ * @param line: header line including its CRLF
+ * @param len: length of line
+ */
+static void replace_field(char** head, int* head_size, char* line, int len) {
+    char* colon = memchr(line, ':', len);
+    if (!colon)
+        return;
+    int name_len = colon - line + 1;
+    // skip the status line
+    char* start = strstr(*head, "\r\n") + 2;
+    char* end = *head + *head_size - 2;
+    int old_len = 0;
+    while (start < end) {
+        char* eol = strstr(start, "\r\n") + 2;
+        if (strncasecmp(start, line, name_len) == 0) {
+            old_len = eol - start;
+            break;
         }
-        else {
-            pre->next = ptr->next;
-            cache_size -= ptr->size;
-            // ensure no thread is reading from ptr
-            while (ptr->reading_cnt != 0)
-                sleep(0);
-            free_cache_node(ptr);
+        start = eol;
+    }
+    int offset = start - *head;
+    char* new_head = (char*) Malloc(*head_size - old_len + len + 1);
+    memcpy(new_head, *head, offset);
+    memcpy(new_head + offset, line, len);
+    memcpy(new_head + offset + len, start + old_len,
+           *head_size - offset - old_len);
+    *head_size += len - old_len;
+    new_head[*head_size] = '\0';
+    Free(*head);
+    *head = new_head;
+}
+
+/**
+ * replace the stored header with the same field name as line,
+ * or insert line if there is none, e.g. for the headers of a 304
+ * notice: blk must not be visible to other threads
+ * @param blk: a block whose head is finished
+ * @param line: header line including its CRLF
+ * @param len: length of line
+ */
+void replace_head_field(struct cache_block* blk, char* line, int len) {
+    replace_field(&blk->head, &blk->head_size, line, len);
+    if (blk->plain_head)
+        replace_field(&blk->plain_head, &blk->plain_head_size, line, len);
+}
+
+/**
+ * replace a header of the stored head only, not of the head kept
+ * for sending a compressed body decompressed
+ * notice: blk must not be visible to other threads
+ * @param blk: a block whose head is finished
+ * @param line: header line including its CRLF
+ * @param len: length of line
+ */
+void replace_encoded_field(struct cache_block* blk, char* line, int len) {
+    replace_field(&blk->head, &blk->head_size, line, len);
+}
+
+/**
+ * copy the value of a header of a block's stored head
+ * @param blk
+ * @param name: field name with its colon, e.g. "Vary:"
+ * @param value: MAXLINE bytes, filled without the blanks around it
+ * @return 1 if the head has the header, 0 otherwise
+ */
+int get_head_field(struct cache_block* blk, char* name, char* value) {
+    int name_len = strlen(name);
+    char* start = strstr(blk->head, "\r\n") + 2;
+    char* end = blk->head + blk->head_size - 2;
+    while (start < end) {
+        char* eol = strstr(start, "\r\n");
+        if (strncasecmp(start, name, name_len) == 0) {
+            int len = eol - start - name_len;
+            if (len > MAXLINE - 1)
+                len = MAXLINE - 1;
+            start += name_len;
+            while (len > 0 && (*start == ' ' || *start == '\t')) {
+                start++;
+                len--;
+            }
+            while (len > 0 && (start[len - 1] == ' ' || start[len - 1] == '\t'))
+                len--;
+            memcpy(value, start, len);
+            value[len] = '\0';
+            return 1;
         }
+        start = eol + 2;
     }
-    V(&list_lock);
+    return 0;
+}
+
+/**
+ * compute a block's expiry and keep its validators
+ * @param blk
+ * @param meta: parsed response head
+ * @param now: time the response was received
+ */
+void set_freshness(struct cache_block* blk, struct http_meta* meta, time_t now) {
+    blk->expires = now + freshness_lifetime(meta, now);
+    blk->stale_until = blk->expires;
+    blk->stale_error_until = blk->expires;
+    if (!meta->must_revalidate) {
+        blk->stale_until += meta->stale_while_revalidate;
+        blk->stale_error_until += meta->stale_if_error;
+    }
+    if (blk->etag)
+        Free(blk->etag);
+    if (blk->last_modified)
+        Free(blk->last_modified);
+    blk->etag = meta->etag[0] ? strdup(meta->etag) : NULL;
+    blk->last_modified = meta->last_modified_str[0] ?
+                         strdup(meta->last_modified_str) : NULL;
+}
+
+/**
+ * recompute a block's freshness from its stored head,
+ * e.g. after the head was updated by a 304
+ * @param blk: a block whose head is finished
+ * @param now: time the 304 was received
+ */
+void refresh_freshness(struct cache_block* blk, time_t now) {
+    struct http_meta meta;
+    char line[MAXLINE];
+    // the identity head of a compressed block has the server's ETag
+    char* head = blk->plain_head ? blk->plain_head : blk->head;
+    int head_size = blk->plain_head ? blk->plain_head_size : blk->head_size;
+    init_meta(&meta);
+    char* start = strstr(head, "\r\n") + 2;
+    char* end = head + head_size - 2;
+    while (start < end) {
+        char* eol = strstr(start, "\r\n") + 2;
+        int len = eol - start < MAXLINE ? eol - start : MAXLINE - 1;
+        memcpy(line, start, len);
+        line[len] = '\0';
+        parse_header(&meta, line);
+        start = eol;
+    }
+    set_freshness(blk, &meta, now);
+}
+
+/**
+ * turn a block into a negative one, which caches an error response
+ * for ttl seconds unless the server gave it an explicit lifetime
+ * negative blocks are never served stale
+ * @param blk
+ * @param meta: parsed response head
+ * @param ttl: configured lifetime of errors
+ * @param now: time the response was received
+ */
+void set_negative(struct cache_block* blk, struct http_meta* meta,
+                  int ttl, time_t now) {
+    blk->negative = 1;
+    if (meta->max_age < 0 && !meta->has_expires)
+        blk->expires = now + ttl;
+    blk->stale_until = blk->expires;
+    blk->stale_error_until = blk->expires;
+}
+
+/**
+ * whether an error response may be cached negatively
+ * @param status
+ */
+int is_negative_status(int status) {
+    switch (status) {
+    case 404: case 410:
+    case 500: case 502: case 503: case 504:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/**
+ * whether a block may be served without asking the server
+ * @param blk
+ */
+int is_fresh(struct cache_block* blk) {
+    return coarse_time() < blk->expires;
+}
+
+/**
+ * whether a stale block may be served while it is
+ * refreshed in the background (stale-while-revalidate)
+ * @param blk
+ */
+int can_serve_stale(struct cache_block* blk) {
+    return coarse_time() < blk->stale_until;
+}
+
+/**
+ * whether a stale block may be served because the
+ * server could not be reached or failed (stale-if-error)
+ * @param blk
+ */
+int can_serve_stale_on_error(struct cache_block* blk) {
+    return coarse_time() < blk->stale_error_until;
+}
+
+/**
+ * copy a block, e.g. to update its head without disturbing threads
+ * that are reading the original; the body is not copied but shared
+ * with the block that owns it, which the copy keeps pinned
+ * notice: the caller must have pinned blk
+ * @param blk
+ * @return the copy, not yet in the list
+ */
+struct cache_block* clone_cache(struct cache_block* blk) {
+    struct cache_block* copy = (struct cache_block*)
+                               Malloc(sizeof(struct cache_block));
+    init_cache(copy);
+    strncpy(copy->uri, blk->uri, MAXLINE);
+    copy->size = blk->size;
+    copy->head_size = blk->head_size;
+    copy->expires = blk->expires;
+    copy->stale_until = blk->stale_until;
+    copy->stale_error_until = blk->stale_error_until;
+    copy->negative = blk->negative;
+    if (blk->file || blk->frags) {
+        copy->body_owner = blk->body_owner ? blk->body_owner : blk;
+        add_reading_cnt(copy->body_owner);
+        copy->file = blk->file;
+        copy->frags = blk->frags;
+    }
+    copy->head = (char*) Malloc(blk->head_size + 1);
+    memcpy(copy->head, blk->head, blk->head_size + 1);
+    if (blk->plain_head) {
+        copy->plain_head_size = blk->plain_head_size;
+        copy->plain_head = (char*) Malloc(blk->plain_head_size + 1);
+        memcpy(copy->plain_head, blk->plain_head, blk->plain_head_size + 1);
+        copy->raw_size = blk->raw_size;
+    }
+    copy->partial = blk->partial;
+    copy->total_size = blk->total_size;
+    copy->segmented = blk->segmented;
+    copy->version = blk->version;
+    copy->etag = blk->etag ? strdup(blk->etag) : NULL;
+    copy->last_modified = blk->last_modified ? strdup(blk->last_modified) : NULL;
+    copy->tags = blk->tags ? strdup(blk->tags) : NULL;
+    return copy;
+}
+
+/**
+ * length of the object a block stands for, which is not
+ * what it stores if it is compressed, partial or segmented
+ * @param blk
+ */
+long object_length(struct cache_block* blk) {
+    if (blk->partial || blk->segmented)
+        return blk->total_size;
+    if (blk->plain_head)
+        return blk->raw_size;
+    return blk->size;
+}
+
+/**
+ * merge a part of the object into a partial block, coalescing
+ * it with the parts it overlaps or touches
+ * notice: blk must not be visible to other threads
+ * @param blk: a partial block
+ * @param first: offset of data in the object
+ * @param data: from cache_alloc(), owned by blk afterwards
+ * @param len: length of data
+ */
+void add_fragment(struct cache_block* blk, long first, char* data, long len) {
+    struct range_frag** pp = &blk->frags;
+    // skip the parts that end before the new one starts
+    while (*pp && (*pp)->first + (*pp)->len < first)
+        pp = &(*pp)->next;
+
+    long start = first, end = first + len;
+    struct range_frag* ptr = *pp;
+    struct range_frag* last = ptr;
+    // the new part swallows all parts up to the first one after it
+    while (last && last->first <= end) {
+        if (last->first < start)
+            start = last->first;
+        if (last->first + last->len > end)
+            end = last->first + last->len;
+        last = last->next;
+    }
+
+    char* merged = data;
+    if (start != first || end != first + len) {
+        merged = (char*) cache_alloc(end - start);
+        while (ptr != last) {
+            memcpy(merged + ptr->first - start, ptr->data, ptr->len);
+            ptr = ptr->next;
+        }
+        // the new data wins where it overlaps older parts
+        memcpy(merged + first - start, data, len);
+        cache_free(data);
+    }
+
+    // drop the swallowed parts
+    ptr = *pp;
+    while (ptr != last) {
+        struct range_frag* next = ptr->next;
+        blk->size -= ptr->len;
+        cache_free(ptr->data);
+        Free(ptr);
+        ptr = next;
+    }
+    struct range_frag* frag = (struct range_frag*) Malloc(sizeof(struct range_frag));
+    frag->first = start;
+    frag->len = end - start;
+    frag->data = merged;
+    frag->next = last;
+    *pp = frag;
+    blk->size += frag->len;
+}
+
+/**
+ * copy all parts of a partial block into another one
+ * @param dst: a partial block, not visible to other threads
+ * @param src
+ */
+void copy_fragments(struct cache_block* dst, struct cache_block* src) {
+    struct range_frag* ptr;
+    for (ptr = src->frags; ptr; ptr = ptr->next) {
+        char* data = (char*) cache_alloc(ptr->len);
+        memcpy(data, ptr->data, ptr->len);
+        add_fragment(dst, ptr->first, data, ptr->len);
+    }
+}
+
+/**
+ * find the bytes first..last of a partial block
+ * @param blk
+ * @param first
+ * @param last: inclusive
+ * @return pointer to byte first, NULL if not all of them are known
+ */
+char* fragment_data(struct cache_block* blk, long first, long last) {
+    struct range_frag* ptr;
+    for (ptr = blk->frags; ptr; ptr = ptr->next)
+        if (ptr->first <= first && last < ptr->first + ptr->len)
+            return ptr->data + first - ptr->first;
+    return NULL;
+}
+
+/**
+ * turn a partial block whose parts cover the whole object
+ * into a complete one
+ * notice: blk must not be visible to other threads
+ * @param blk: a partial block
+ * @return 1 if it is complete now
+ */
+int complete_fragments(struct cache_block* blk) {
+    struct range_frag* frag = blk->frags;
+    if (!frag || frag->first != 0 || frag->len != blk->total_size)
+        return 0;
+    blk->file = frag->data;
+    blk->size = frag->len;
+    blk->frags = NULL;
+    blk->partial = 0;
+    Free(frag);
+    return 1;
 }
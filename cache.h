@@ -1,22 +1,121 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
 #include "csapp.h"
+#include "http.h"
+#include "timer.h"
+
+/* a known part of an object, from a 206 response */
+struct range_frag {
+    long first;
+    long len;
+    char* data;
+    struct range_frag* next;
+};
+
+struct tag_ref;
 
 struct cache_block {
     char uri[MAXLINE];
-    clock_t timestamp;
-    // this lock protects vars: reading_cnt, timestamp
+    // last use, in coarse_msec()
+    long timestamp;
+    // this lock protects vars: reading_cnt, refreshing, deleted
     sem_t lock;
     int reading_cnt;
-    int size;
+    // a background refresh of this block is running
+    int refreshing;
+    // taken out of the list, the last reader frees it
+    int deleted;
+    // body of the response
+    long size;
     char* file;
+    // a partial block has no file but the known parts of the object,
+    // sorted and coalesced; total_size is the length of the object
+    int partial;
+    struct range_frag* frags;
+    long total_size;
+    // the block whose file or frags this one shares, pinned by it;
+    // NULL if the body is its own
+    struct cache_block* body_owner;
+    // a large object is a descriptor with the head, whose body is in
+    // segment blocks of its version, see segment.c; total_size is
+    // the length of the object
+    int segmented;
+    int version;
+    // a segment block, only found through its descriptor
+    int segment;
+    // status line and headers, pre-serialised with Content-Length
+    // but without Connection, which goes before the blank line
+    int head_size;
+    char* head;
+    // a compressed body keeps the head for sending it decompressed,
+    // NULL if the body is stored as received
+    int plain_head_size;
+    char* plain_head;
+    long raw_size;
+    // the block may be served without revalidation until expires
+    time_t expires;
+    // a stale block may still be served while it is refreshed
+    // until stale_until, or if the server fails until stale_error_until
+    time_t stale_until;
+    time_t stale_error_until;
+    // removes the block once it can no longer be served, see
+    // arm_expiry(); a pending timer holds a reading_cnt
+    struct timer expiry;
+    // an error response or a failed server, cached briefly
+    int negative;
+    // validators for conditional requests, NULL if absent
+    char* etag;
+    char* last_modified;
+    // surrogate keys separated by spaces, NULL if none, and their
+    // entries in the tag index
+    char* tags;
+    struct tag_ref* tag_refs;
+    // LRU list, the list head's prev is the last block; prev is
+    // NULL while the block is not listed
     struct cache_block* next;
+    struct cache_block* prev;
+    // next block in the same bucket of the uri index, see index.c
+    struct cache_block* hash_next;
 };
 
+/* bytes a block takes from the cache budget */
+#define BLOCK_BYTES(blk) ((blk)->size + (blk)->head_size + (blk)->plain_head_size)
+
 struct cache_block* search_cache(struct cache_block* head, char* uri);
 void update_timestamp(struct cache_block* head, struct cache_block* blk);
 void add_cache(struct cache_block* head, struct cache_block* blk);
-void delete_cache(struct cache_block* head, struct cache_block* blk);
-void evict_cache(struct cache_block* head, int size);
+int delete_cache(struct cache_block* head, struct cache_block* blk);
+void evict_cache(struct cache_block* head, long size);
+void store_cache(struct cache_block* head, struct cache_block* blk,
+                 long max_size);
+int purge_cache(struct cache_block* head, char* pattern);
+int purge_tags(struct cache_block* head, char* tags);
 void init_cache(struct cache_block* blk);
 void free_cache_node(struct cache_block* blk);
 void add_reading_cnt(struct cache_block* blk);
-void sub_reading_cnt(struct cache_block* blk);
\ No newline at end of file
+void sub_reading_cnt(struct cache_block* blk);
+int append_head(struct cache_block* blk, char* line, int len, int max_size);
+void finish_head(struct cache_block* blk);
+void replace_head_field(struct cache_block* blk, char* line, int len);
+void replace_encoded_field(struct cache_block* blk, char* line, int len);
+int get_head_field(struct cache_block* blk, char* name, char* value);
+void set_freshness(struct cache_block* blk, struct http_meta* meta, time_t now);
+void refresh_freshness(struct cache_block* blk, time_t now);
+void set_negative(struct cache_block* blk, struct http_meta* meta,
+                  int ttl, time_t now);
+int is_negative_status(int status);
+int is_fresh(struct cache_block* blk);
+int can_serve_stale(struct cache_block* blk);
+int can_serve_stale_on_error(struct cache_block* blk);
+int start_refresh(struct cache_block* blk);
+void end_refresh(struct cache_block* blk);
+struct cache_block* clone_cache(struct cache_block* blk);
+void replace_cache(struct cache_block* head, struct cache_block* blk);
+long object_length(struct cache_block* blk);
+void add_fragment(struct cache_block* blk, long first, char* data, long len);
+void copy_fragments(struct cache_block* dst, struct cache_block* src);
+char* fragment_data(struct cache_block* blk, long first, long last);
+int complete_fragments(struct cache_block* blk);
+
+#endif /* __CACHE_H__ */
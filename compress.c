@@ -0,0 +1,262 @@
+#include <zlib.h>
+#include "compress.h"
+#include "arena.h"
+
+static struct compress_stats stats;
+// this lock protects stats
+static sem_t stats_lock;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+
+static void init_stats(void) {
+    Sem_init(&stats_lock, 0, 1);
+}
+
+/**
+ * deflate a buffer in gzip format
+ * @param in
+ * @param len
+ * @param level: zlib level 1-9
+ * @param out_len: size of the compressed data
+ * @return compressed data from cache_alloc(), NULL on error or if it does
+ *         not fit into max_out bytes
+ */
+static char* gzip_buf(char* in, int len, int level, int max_out, int* out_len) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    // 16 + MAX_WBITS asks for a gzip header and trailer
+    if (deflateInit2(&zs, level, Z_DEFLATED, 16 + MAX_WBITS, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+        return NULL;
+    char* out = (char*) cache_alloc(max_out);
+    zs.next_in = (Bytef*) in;
+    zs.avail_in = len;
+    zs.next_out = (Bytef*) out;
+    zs.avail_out = max_out;
+    int rc = deflate(&zs, Z_FINISH);
+    *out_len = zs.total_out;
+    deflateEnd(&zs);
+    if (rc != Z_STREAM_END) {
+        cache_free(out);
+        return NULL;
+    }
+    return out;
+}
+
+/**
+ * cheap check whether a body is worth compressing: media and
+ * archives are skipped by type, anything else by deflating a
+ * sample of it at the fastest level
+ * @param content_type: Content-Type value, may be empty
+ * @param body
+ * @param len
+ */
+static int is_compressible(char* content_type, char* body, int len) {
+    static const char* skip_types[] = {
+        "image/", "video/", "audio/", "font/woff",
+        "application/zip", "application/gzip", "application/x-gzip",
+        "application/zstd", "application/x-bzip2", "application/x-xz",
+        "application/pdf",
+    };
+    int i;
+    if (len < MIN_COMPRESS_SIZE)
+        return 0;
+    for (i = 0; i < sizeof(skip_types) / sizeof(skip_types[0]); i++)
+        if (strncasecmp(content_type, skip_types[i], strlen(skip_types[i])) == 0)
+            return 0;
+
+    int sample = len < PROBE_SIZE ? len : PROBE_SIZE;
+    int out_len;
+    char* out = gzip_buf(body, sample, 1, sample * MAX_COMPRESS_RATIO / 100,
+                         &out_len);
+    if (!out)
+        return 0;
+    cache_free(out);
+    return 1;
+}
+
+/**
+ * mark the heads of a compressed block as those of one variant of
+ * two cached under one uri: both list Accept-Encoding in Vary, with
+ * what the server listed, and the gzip one gets an ETag of its own,
+ * since its bytes differ, so that a validator of one variant never
+ * matches the other; blk->etag keeps the server's for revalidation
+ * notice: blk must not be visible to other threads
+ * @param blk: a block with a compressed body
+ */
+void mark_gzip_variant(struct cache_block* blk) {
+    char value[MAXLINE], line[MAXLINE];
+    int len;
+
+    if (!get_head_field(blk, "Vary:", value) || !value[0])
+        replace_head_field(blk, "Vary: Accept-Encoding\r\n", 23);
+    else if (!has_token(value, "Accept-Encoding") && !has_token(value, "*")) {
+        len = snprintf(line, MAXLINE, "Vary: %s, Accept-Encoding\r\n", value);
+        replace_head_field(blk, line, len);
+    }
+    if (blk->etag) {
+        // "tag" becomes "tag-gzip", W/"tag" W/"tag-gzip"
+        char* quote = strrchr(blk->etag, '"');
+        int at = quote && quote != blk->etag && quote[-1] != '/' ?
+            quote - blk->etag : strlen(blk->etag);
+        len = snprintf(line, MAXLINE, "ETag: %.*s-gzip%s\r\n", at,
+                       blk->etag, blk->etag + at);
+        replace_encoded_field(blk, line, len);
+    }
+}
+
+/**
+ * store a block's body gzip-compressed if it pays off
+ * the block keeps a head for sending it decompressed
+ * notice: blk must not be visible to other threads
+ * @param blk: a block whose head is finished
+ * @param content_type: Content-Type value of the response
+ * @param level: zlib level 1-9
+ * @return 1 if the body was compressed, 0 otherwise
+ */
+int compress_block(struct cache_block* blk, char* content_type, int level) {
+    char line[MAXLINE];
+    int out_len;
+    char* out = NULL;
+
+    pthread_once(&stats_once, init_stats);
+    if (is_compressible(content_type, blk->file, blk->size))
+        out = gzip_buf(blk->file, blk->size, level,
+                       (long) blk->size * MAX_COMPRESS_RATIO / 100, &out_len);
+    if (!out) {
+        P(&stats_lock);
+        stats.skipped++;
+        V(&stats_lock);
+        return 0;
+    }
+
+    // the head as received describes the decompressed body
+    int plain_head_size = blk->head_size;
+    char* plain_head = (char*) Malloc(blk->head_size + 1);
+    memcpy(plain_head, blk->head, blk->head_size + 1);
+    int len = snprintf(line, MAXLINE, "Content-Length: %d\r\n", out_len);
+    replace_head_field(blk, line, len);
+    replace_head_field(blk, "Content-Encoding: gzip\r\n", 24);
+    blk->plain_head = plain_head;
+    blk->plain_head_size = plain_head_size;
+    mark_gzip_variant(blk);
+
+    P(&stats_lock);
+    stats.objects++;
+    stats.raw_bytes += blk->size;
+    stats.stored_bytes += out_len;
+    V(&stats_lock);
+
+    blk->raw_size = blk->size;
+    cache_free(blk->file);
+    blk->file = (char*) cache_realloc(out, out_len > 0 ? out_len : 1);
+    blk->size = out_len;
+    return 1;
+}
+
+/**
+ * send a compressed block to a client that does not take gzip,
+ * inflating it chunk by chunk
+ * notice: the caller must have pinned blk
+ * @param fd: client
+ * @param blk: a block with a compressed body
+ * @param keep_alive: whether the client keeps the connection
+ * @return 0, or -1 if the body was cut short
+ */
+int serve_decompressed(int fd, struct cache_block* blk, int keep_alive) {
+    char out[MAXBUF];
+    struct timeval start, end;
+    struct iovec iov[2];
+    z_stream zs;
+    int rc;
+
+    pthread_once(&stats_once, init_stats);
+    // the stored head without its blank line, then the Connection
+    iov[0].iov_base = blk->plain_head;
+    iov[0].iov_len = blk->plain_head_size - 2;
+    iov[1].iov_base = connection_end(keep_alive);
+    iov[1].iov_len = strlen(iov[1].iov_base);
+    Rio_writev(fd, iov, 2);
+
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, 16 + MAX_WBITS) != Z_OK)
+        return -1;
+    gettimeofday(&start, NULL);
+    long decode_usec = 0;
+    zs.next_in = (Bytef*) blk->file;
+    zs.avail_in = blk->size;
+    do {
+        zs.next_out = (Bytef*) out;
+        zs.avail_out = MAXBUF;
+        rc = inflate(&zs, Z_NO_FLUSH);
+        if (rc != Z_OK && rc != Z_STREAM_END)
+            break;
+        // only the inflating is decode cost, not the socket
+        gettimeofday(&end, NULL);
+        decode_usec += (end.tv_sec - start.tv_sec) * 1000000L +
+                       end.tv_usec - start.tv_usec;
+        if (rio_writen(fd, out, MAXBUF - zs.avail_out) < 0) {
+            rc = Z_ERRNO;
+            break;
+        }
+        gettimeofday(&start, NULL);
+    } while (rc != Z_STREAM_END);
+    inflateEnd(&zs);
+
+    P(&stats_lock);
+    stats.decodes++;
+    stats.decode_bytes += zs.total_out;
+    stats.decode_usec += decode_usec;
+    V(&stats_lock);
+    return rc == Z_STREAM_END ? 0 : -1;
+}
+
+/**
+ * copy the compression counters
+ * @param out
+ */
+void get_compress_stats(struct compress_stats* out) {
+    pthread_once(&stats_once, init_stats);
+    P(&stats_lock);
+    *out = stats;
+    V(&stats_lock);
+}
+
+/**
+ * print the capacity gain and decode cost of compression
+ * @param out
+ */
+void print_compress_stats(FILE* out) {
+    struct compress_stats cs;
+    get_compress_stats(&cs);
+    fprintf(out, "compression: %ld objects, %ld -> %ld bytes (%.2fx), "
+            "%ld skipped, %ld decodes of %ld bytes in %ld us (%.1f MB/s)\n",
+            cs.objects, cs.raw_bytes, cs.stored_bytes,
+            cs.stored_bytes ? (double) cs.raw_bytes / cs.stored_bytes : 1.0,
+            cs.skipped, cs.decodes, cs.decode_bytes, cs.decode_usec,
+            cs.decode_usec ? (double) cs.decode_bytes / cs.decode_usec : 0.0);
+}
+
+/**
+ * inflate a compressed block's whole body, e.g. to cut ranges
+ * notice: the caller must have pinned blk
+ * @param blk: a block with a compressed body
+ * @return Malloc'ed body of blk->raw_size bytes, NULL on error
+ */
+char* inflate_block(struct cache_block* blk) {
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (inflateInit2(&zs, 16 + MAX_WBITS) != Z_OK)
+        return NULL;
+    char* out = (char*) Malloc(blk->raw_size > 0 ? blk->raw_size : 1);
+    zs.next_in = (Bytef*) blk->file;
+    zs.avail_in = blk->size;
+    zs.next_out = (Bytef*) out;
+    zs.avail_out = blk->raw_size;
+    int rc = inflate(&zs, Z_FINISH);
+    inflateEnd(&zs);
+    if (rc != Z_STREAM_END) {
+        Free(out);
+        return NULL;
+    }
+    return out;
+}
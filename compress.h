@@ -0,0 +1,31 @@
+#ifndef __COMPRESS_H__
+#define __COMPRESS_H__
+
+#include "cache.h"
+
+/* bytes of the body that are test-compressed before the whole of it */
+#define PROBE_SIZE 4096
+/* bodies smaller than this are not worth compressing */
+#define MIN_COMPRESS_SIZE 256
+/* keep the compressed body only if it is at most this % of the original */
+#define MAX_COMPRESS_RATIO 90
+
+/* effective capacity gain and decode cost, all time */
+struct compress_stats {
+    long objects;
+    long raw_bytes;
+    long stored_bytes;
+    long skipped;
+    long decodes;
+    long decode_bytes;
+    long decode_usec;
+};
+
+int compress_block(struct cache_block* blk, char* content_type, int level);
+void mark_gzip_variant(struct cache_block* blk);
+int serve_decompressed(int fd, struct cache_block* blk, int keep_alive);
+char* inflate_block(struct cache_block* blk);
+void get_compress_stats(struct compress_stats* stats);
+void print_compress_stats(FILE* out);
+
+#endif /* __COMPRESS_H__ */
@@ -0,0 +1,320 @@
+#include <getopt.h>
+#include <limits.h>
+#include "config.h"
+
+struct proxy_config config = {
+    .port = NULL,
+    .negative_ttl = 5,
+    .negative_connect_ttl = 2,
+    .compress = 0,
+    .compress_level = 6,
+    .max_cache_size = MAX_CACHE_SIZE,
+    .segment_size = SEGMENT_SIZE,
+    .max_object_size = MAX_OBJECT_SIZE,
+    .nsize_rules = 0,
+    .prefetch = 0,
+    .prefetch_budget = 8,
+    .arena = 0,
+    .arena_prefault = 0,
+    .arena_mlock = 0,
+    .sendfile = 0,
+    .splice = 0,
+    .zerocopy = 0,
+    .idle_timeout = 30,
+    .io_timeout = 60,
+    .tunnel_timeout = 300,
+    .keepalive_timeout = 15,
+    .keepalive_requests = 100,
+    .stats_interval = 0,
+    .defer_accept = 0,
+    .fastopen = 0,
+    .fastopen_connect = 0,
+    .sndbuf = 0,
+    .rcvbuf = 0,
+    .nodelay = 0,
+    .pool_size = 4,
+    .pool_idle_timeout = 15,
+    .dns_ttl = 60,
+    .dns_negative_ttl = 5,
+    .resolve_file = NULL,
+};
+
+/**
+ * print the command line help and exit
+ * @param prog: argv[0]
+ */
+static void usage(char* prog) {
+    fprintf(stderr, "usage: %s [options] <port>\n", prog);
+    fprintf(stderr,
+        "  --negative-ttl=SEC          cache error responses (default %d)\n"
+        "  --negative-connect-ttl=SEC  cache DNS/connect failures (default %d)\n"
+        "  --compress[=LEVEL]          store text bodies gzip-compressed (level 1-9, default %d)\n"
+        "  --max-cache-size=BYTES      cache budget (default %ld)\n"
+        "  --segment-size=BYTES        larger objects are cached in segments (default %d)\n"
+        "  --max-object-size=BYTES     largest object cached (default %ld)\n"
+        "  --size-limit=PREFIX=BYTES   largest object cached for uris under PREFIX,\n"
+        "                              first match wins, may be repeated\n"
+        "                              (no object takes more than 1/%d of the cache)\n"
+        "  --prefetch[=THREADS]        prefetch the links of HTML pages (default 2 threads)\n"
+        "  --prefetch-budget=N         most links prefetched per page (default %d)\n"
+        "  --arena                     keep cached bodies in a huge-page arena\n"
+        "  --arena-prefault            fault the arena in at startup, implies --arena\n"
+        "  --arena-mlock               lock the arena in memory, implies --arena\n"
+        "  --sendfile                  send cache hits with sendfile() from a memfd arena,\n"
+        "                              implies --arena\n"
+        "  --splice                    relay bodies that are not cached with splice()\n"
+        "  --zerocopy                  send large cached bodies with MSG_ZEROCOPY\n"
+        "  --idle-timeout=SEC          time for a client to send its request (default %d)\n"
+        "  --io-timeout=SEC            time without progress on a connection (default %d)\n"
+        "  --tunnel-timeout=SEC        time without traffic in a CONNECT tunnel (default %d)\n"
+        "  --keepalive-timeout=SEC     time for a client to send its next request (default %d)\n"
+        "  --keepalive-requests=N      most requests per client connection (default %d)\n"
+        "  --stats-interval=SEC        print statistics every SEC seconds\n"
+        "  --defer-accept=SEC          accept clients once they sent data (TCP_DEFER_ACCEPT)\n"
+        "  --fastopen=QLEN             take TCP Fast Open requests from clients\n"
+        "  --fastopen-connect          connect to servers with TCP Fast Open\n"
+        "  --sndbuf=BYTES              send buffer of server connections\n"
+        "  --rcvbuf=BYTES              receive buffer of server connections\n"
+        "  --nodelay                   set TCP_NODELAY on client and server connections\n"
+        "  --pool-size=N               idle connections kept per server, 0 for none (default %d)\n"
+        "  --pool-idle-timeout=SEC     time an idle server connection is kept (default %d)\n"
+        "  --dns-ttl=SEC               cache server addresses, 0 for none (default %d)\n"
+        "  --dns-negative-ttl=SEC      cache names that do not resolve (default %d)\n"
+        "  --resolve-file=PATH         resolve names from lines of a name and its\n"
+        "                              addresses, before the resolver\n",
+        config.negative_ttl, config.negative_connect_ttl, config.compress_level,
+        config.max_cache_size, config.segment_size, config.max_object_size,
+        MAX_OBJECT_SHARE, config.prefetch_budget, config.idle_timeout, config.io_timeout,
+        config.tunnel_timeout, config.keepalive_timeout,
+        config.keepalive_requests, config.pool_size, config.pool_idle_timeout,
+        config.dns_ttl, config.dns_negative_ttl);
+    exit(1);
+}
+
+/**
+ * parse a non-negative integer option
+ * @param prog: argv[0], for usage()
+ * @param arg: option argument
+ */
+static int parse_num(char* prog, char* arg) {
+    char* end;
+    long val = strtol(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0' || val < 0 || val > INT_MAX)
+        usage(prog);
+    return (int) val;
+}
+
+/**
+ * parse a non-negative size option
+ * @param prog: argv[0], for usage()
+ * @param arg: option argument
+ */
+static long parse_size(char* prog, char* arg) {
+    char* end;
+    long val = strtol(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0' || val < 0 || val == LONG_MAX)
+        usage(prog);
+    return val;
+}
+
+/**
+ * add a size rule from PREFIX=BYTES
+ * @param prog: argv[0], for usage()
+ * @param arg: option argument
+ */
+static void add_size_rule(char* prog, char* arg) {
+    char* eq = strrchr(arg, '=');
+    if (!eq || eq == arg || config.nsize_rules == MAX_SIZE_RULES)
+        usage(prog);
+    struct size_rule* rule = &config.size_rules[config.nsize_rules++];
+    rule->prefix = strndup(arg, eq - arg);
+    rule->limit = parse_size(prog, eq + 1);
+}
+
+/**
+ * largest object the cache takes for a uri, never so large that
+ * storing it evicts most of the cache
+ * @param uri
+ */
+long object_size_limit(char* uri) {
+    long limit = config.max_object_size;
+    long share = config.max_cache_size / MAX_OBJECT_SHARE;
+    int i;
+    for (i = 0; i < config.nsize_rules; i++)
+        if (strncmp(uri, config.size_rules[i].prefix,
+                    strlen(config.size_rules[i].prefix)) == 0) {
+            limit = config.size_rules[i].limit;
+            break;
+        }
+    return limit < share ? limit : share;
+}
+
+/**
+ * fill config from the command line
+ * @param argc
+ * @param argv
+ */
+void parse_config(int argc, char** argv) {
+    enum { OPT_NEGATIVE_TTL = 256, OPT_NEGATIVE_CONNECT_TTL, OPT_COMPRESS,
+           OPT_MAX_CACHE_SIZE, OPT_SEGMENT_SIZE, OPT_MAX_OBJECT_SIZE,
+           OPT_SIZE_LIMIT, OPT_PREFETCH, OPT_PREFETCH_BUDGET,
+           OPT_ARENA, OPT_ARENA_PREFAULT, OPT_ARENA_MLOCK,
+           OPT_SENDFILE, OPT_SPLICE, OPT_ZEROCOPY,
+           OPT_IDLE_TIMEOUT, OPT_IO_TIMEOUT, OPT_TUNNEL_TIMEOUT,
+           OPT_KEEPALIVE_TIMEOUT, OPT_KEEPALIVE_REQUESTS,
+           OPT_STATS_INTERVAL, OPT_DEFER_ACCEPT, OPT_FASTOPEN,
+           OPT_FASTOPEN_CONNECT, OPT_SNDBUF, OPT_RCVBUF, OPT_NODELAY,
+           OPT_POOL_SIZE, OPT_POOL_IDLE_TIMEOUT, OPT_DNS_TTL,
+           OPT_DNS_NEGATIVE_TTL, OPT_RESOLVE_FILE };
+    static struct option options[] = {
+        { "negative-ttl", required_argument, NULL, OPT_NEGATIVE_TTL },
+        { "negative-connect-ttl", required_argument, NULL, OPT_NEGATIVE_CONNECT_TTL },
+        { "compress", optional_argument, NULL, OPT_COMPRESS },
+        { "max-cache-size", required_argument, NULL, OPT_MAX_CACHE_SIZE },
+        { "segment-size", required_argument, NULL, OPT_SEGMENT_SIZE },
+        { "max-object-size", required_argument, NULL, OPT_MAX_OBJECT_SIZE },
+        { "size-limit", required_argument, NULL, OPT_SIZE_LIMIT },
+        { "prefetch", optional_argument, NULL, OPT_PREFETCH },
+        { "prefetch-budget", required_argument, NULL, OPT_PREFETCH_BUDGET },
+        { "arena", no_argument, NULL, OPT_ARENA },
+        { "arena-prefault", no_argument, NULL, OPT_ARENA_PREFAULT },
+        { "arena-mlock", no_argument, NULL, OPT_ARENA_MLOCK },
+        { "sendfile", no_argument, NULL, OPT_SENDFILE },
+        { "splice", no_argument, NULL, OPT_SPLICE },
+        { "zerocopy", no_argument, NULL, OPT_ZEROCOPY },
+        { "idle-timeout", required_argument, NULL, OPT_IDLE_TIMEOUT },
+        { "io-timeout", required_argument, NULL, OPT_IO_TIMEOUT },
+        { "tunnel-timeout", required_argument, NULL, OPT_TUNNEL_TIMEOUT },
+        { "keepalive-timeout", required_argument, NULL, OPT_KEEPALIVE_TIMEOUT },
+        { "keepalive-requests", required_argument, NULL, OPT_KEEPALIVE_REQUESTS },
+        { "stats-interval", required_argument, NULL, OPT_STATS_INTERVAL },
+        { "defer-accept", required_argument, NULL, OPT_DEFER_ACCEPT },
+        { "fastopen", required_argument, NULL, OPT_FASTOPEN },
+        { "fastopen-connect", no_argument, NULL, OPT_FASTOPEN_CONNECT },
+        { "sndbuf", required_argument, NULL, OPT_SNDBUF },
+        { "rcvbuf", required_argument, NULL, OPT_RCVBUF },
+        { "nodelay", no_argument, NULL, OPT_NODELAY },
+        { "pool-size", required_argument, NULL, OPT_POOL_SIZE },
+        { "pool-idle-timeout", required_argument, NULL, OPT_POOL_IDLE_TIMEOUT },
+        { "dns-ttl", required_argument, NULL, OPT_DNS_TTL },
+        { "dns-negative-ttl", required_argument, NULL, OPT_DNS_NEGATIVE_TTL },
+        { "resolve-file", required_argument, NULL, OPT_RESOLVE_FILE },
+        { NULL, 0, NULL, 0 }
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (opt) {
+        case OPT_NEGATIVE_TTL:
+            config.negative_ttl = parse_num(argv[0], optarg);
+            break;
+        case OPT_NEGATIVE_CONNECT_TTL:
+            config.negative_connect_ttl = parse_num(argv[0], optarg);
+            break;
+        case OPT_COMPRESS:
+            config.compress = 1;
+            if (optarg)
+                config.compress_level = parse_num(argv[0], optarg);
+            if (config.compress_level < 1 || config.compress_level > 9)
+                usage(argv[0]);
+            break;
+        case OPT_MAX_CACHE_SIZE:
+            config.max_cache_size = parse_size(argv[0], optarg);
+            break;
+        case OPT_SEGMENT_SIZE:
+            config.segment_size = parse_num(argv[0], optarg);
+            if (config.segment_size < MAXBUF)
+                usage(argv[0]);
+            break;
+        case OPT_MAX_OBJECT_SIZE:
+            config.max_object_size = parse_size(argv[0], optarg);
+            break;
+        case OPT_SIZE_LIMIT:
+            add_size_rule(argv[0], optarg);
+            break;
+        case OPT_PREFETCH:
+            config.prefetch = optarg ? parse_num(argv[0], optarg) : 2;
+            break;
+        case OPT_PREFETCH_BUDGET:
+            config.prefetch_budget = parse_num(argv[0], optarg);
+            if (config.prefetch_budget > MAX_PREFETCH_BUDGET)
+                usage(argv[0]);
+            break;
+        case OPT_ARENA:
+            config.arena = 1;
+            break;
+        case OPT_ARENA_PREFAULT:
+            config.arena = config.arena_prefault = 1;
+            break;
+        case OPT_ARENA_MLOCK:
+            config.arena = config.arena_mlock = 1;
+            break;
+        case OPT_SENDFILE:
+            config.arena = config.sendfile = 1;
+            break;
+        case OPT_SPLICE:
+            config.splice = 1;
+            break;
+        case OPT_ZEROCOPY:
+            config.zerocopy = 1;
+            break;
+        case OPT_IDLE_TIMEOUT:
+            config.idle_timeout = parse_num(argv[0], optarg);
+            break;
+        case OPT_IO_TIMEOUT:
+            config.io_timeout = parse_num(argv[0], optarg);
+            break;
+        case OPT_TUNNEL_TIMEOUT:
+            config.tunnel_timeout = parse_num(argv[0], optarg);
+            break;
+        case OPT_KEEPALIVE_TIMEOUT:
+            config.keepalive_timeout = parse_num(argv[0], optarg);
+            break;
+        case OPT_KEEPALIVE_REQUESTS:
+            config.keepalive_requests = parse_num(argv[0], optarg);
+            if (config.keepalive_requests < 1)
+                usage(argv[0]);
+            break;
+        case OPT_STATS_INTERVAL:
+            config.stats_interval = parse_num(argv[0], optarg);
+            break;
+        case OPT_DEFER_ACCEPT:
+            config.defer_accept = parse_num(argv[0], optarg);
+            break;
+        case OPT_FASTOPEN:
+            config.fastopen = parse_num(argv[0], optarg);
+            break;
+        case OPT_FASTOPEN_CONNECT:
+            config.fastopen_connect = 1;
+            break;
+        case OPT_SNDBUF:
+            config.sndbuf = parse_num(argv[0], optarg);
+            break;
+        case OPT_RCVBUF:
+            config.rcvbuf = parse_num(argv[0], optarg);
+            break;
+        case OPT_NODELAY:
+            config.nodelay = 1;
+            break;
+        case OPT_POOL_SIZE:
+            config.pool_size = parse_num(argv[0], optarg);
+            break;
+        case OPT_POOL_IDLE_TIMEOUT:
+            config.pool_idle_timeout = parse_num(argv[0], optarg);
+            break;
+        case OPT_DNS_TTL:
+            config.dns_ttl = parse_num(argv[0], optarg);
+            break;
+        case OPT_DNS_NEGATIVE_TTL:
+            config.dns_negative_ttl = parse_num(argv[0], optarg);
+            break;
+        case OPT_RESOLVE_FILE:
+            config.resolve_file = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1)
+        usage(argv[0]);
+    config.port = argv[optind];
+}
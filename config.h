@@ -0,0 +1,96 @@
+#ifndef __CONFIG_H__
+#define __CONFIG_H__
+
+#include "csapp.h"
+
+/* Recommended max cache and object sizes */
+#define MAX_CACHE_SIZE 1049000
+#define MAX_OBJECT_SIZE (64L << 20)
+/* an object takes at most 1/MAX_OBJECT_SHARE of the cache budget */
+#define MAX_OBJECT_SHARE 4
+/* objects larger than a segment are cached in segments */
+#define SEGMENT_SIZE 102400
+/* most --size-limit rules */
+#define MAX_SIZE_RULES 32
+/* upper bound of --prefetch-budget */
+#define MAX_PREFETCH_BUDGET 64
+
+/* per-object size limit of the uris under a prefix */
+struct size_rule {
+    char* prefix;
+    long limit;
+};
+
+/* run-time settings of the proxy, see usage() in config.c */
+struct proxy_config {
+    char* port;
+    // seconds to cache error responses without explicit freshness
+    int negative_ttl;
+    // seconds to remember that a server could not be resolved or reached
+    int negative_connect_ttl;
+    // store compressible bodies gzip-compressed, and at which level
+    int compress;
+    int compress_level;
+    // cache budget, and size of the segments large objects are split in
+    long max_cache_size;
+    int segment_size;
+    // largest object cached, unless a size rule matches its uri
+    long max_object_size;
+    struct size_rule size_rules[MAX_SIZE_RULES];
+    int nsize_rules;
+    // threads prefetching the links of HTML pages, 0 if disabled,
+    // and most links prefetched per page
+    int prefetch;
+    int prefetch_budget;
+    // keep cache payloads in a huge-page arena of the cache budget,
+    // optionally pre-faulted and locked in memory
+    int arena;
+    int arena_prefault;
+    int arena_mlock;
+    // map the arena from a memfd and send hits with sendfile()
+    int sendfile;
+    // relay bodies that are not cached with splice()
+    int splice;
+    // send large cached payloads with MSG_ZEROCOPY
+    int zerocopy;
+    // seconds a client may take to send its request, and a
+    // connection may go without progress, 0 for no limit
+    int idle_timeout;
+    int io_timeout;
+    // seconds a CONNECT tunnel may go without traffic
+    int tunnel_timeout;
+    // seconds a kept-alive client may take to send its next request,
+    // and most requests per client connection, 1 to close after each
+    int keepalive_timeout;
+    int keepalive_requests;
+    // seconds between statistics dumps to stdout, 0 for none
+    int stats_interval;
+    // listener: seconds accept() waits for the request with
+    // TCP_DEFER_ACCEPT, and TCP_FASTOPEN queue length, 0 if off
+    int defer_accept;
+    int fastopen;
+    // connections to servers: TCP_FASTOPEN_CONNECT, and socket
+    // buffer sizes, 0 for the kernel's
+    int fastopen_connect;
+    int sndbuf;
+    int rcvbuf;
+    // TCP_NODELAY on client and server connections
+    int nodelay;
+    // idle connections kept per server, 0 to close each after its
+    // response, and seconds one may stay idle
+    int pool_size;
+    int pool_idle_timeout;
+    // seconds to cache the addresses of a server name, 0 to resolve
+    // it on each connect, and to cache that it does not resolve
+    int dns_ttl;
+    int dns_negative_ttl;
+    // names resolved from a file rather than by the resolver, or NULL
+    char* resolve_file;
+};
+
+extern struct proxy_config config;
+
+void parse_config(int argc, char** argv);
+long object_size_limit(char* uri);
+
+#endif /* __CONFIG_H__ */
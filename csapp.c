@@ -778,6 +778,86 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 }
 /* $end rio_writen */
 
+/*
+ * rio_sendn - Robustly send n bytes on a socket with send() flags,
+ *    e.g. MSG_MORE to hold them for what is sent next (unbuffered)
+ */
+ssize_t rio_sendn(int fd, void *usrbuf, size_t n, int flags) 
+{
+    size_t nleft = n;
+    ssize_t nsent;
+    char *bufp = usrbuf;
+
+    while (nleft > 0) {
+    if ((nsent = send(fd, bufp, nleft, flags)) <= 0) {
+        if (errno == EINTR)  /* Interrupted by sig handler return */
+        nsent = 0;       /* and call send() again */
+        else
+        return -1;       /* errno set by send() */
+    }
+    nleft -= nsent;
+    bufp += nsent;
+    }
+    return n;
+}
+
+/*
+ * rio_writev - Robustly write all bytes described by an iovec array
+ *    (unbuffered). Partially written segments are resumed, so the
+ *    iovec array is modified in place.
+ */
+ssize_t rio_writev(int fd, struct iovec *iov, int iovcnt) 
+{
+    size_t n = 0;
+    ssize_t nwritten;
+    int i;
+
+    for (i = 0; i < iovcnt; i++)
+        n += iov[i].iov_len;
+
+    nwritten = 0;
+    while (1) {
+    /* Skip the segments that were fully written */
+    while (iovcnt > 0 && nwritten >= iov->iov_len) {
+        nwritten -= iov->iov_len;
+        iov++;
+        iovcnt--;
+    }
+    if (iovcnt == 0)
+        break;
+    iov->iov_base = (char *)iov->iov_base + nwritten;
+    iov->iov_len -= nwritten;
+    if ((nwritten = writev(fd, iov, iovcnt)) <= 0) {
+        if (errno == EINTR)  /* Interrupted by sig handler return */
+        nwritten = 0;    /* and call writev() again */
+        else
+        return -1;       /* errno set by writev() */
+    }
+    }
+    return n;
+}
+
+/*
+ * rio_sendfile - Robustly send n bytes of a file from offset
+ *    with sendfile(2), which does not copy them through user space
+ */
+ssize_t rio_sendfile(int out_fd, int in_fd, off_t offset, size_t n) 
+{
+    size_t nleft = n;
+    ssize_t nsent;
+
+    while (nleft > 0) {
+    if ((nsent = sendfile(out_fd, in_fd, &offset, nleft)) <= 0) {
+        if (nsent < 0 && errno == EINTR)  /* Interrupted by sig handler return */
+        nsent = 0;    /* and call sendfile() again */
+        else
+        return -1;    /* errno set by sendfile(), or end of file */
+    }
+    nleft -= nsent;
+    }
+    return n;
+}
+
 
 /* 
  * rio_read - This is a wrapper for the Unix read() function that
@@ -788,13 +868,21 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
  *    read() if the internal buffer is empty.
  */
 /* $begin rio_read */
+static void rio_restore(rio_t *rp)
+{
+    if (rp->rio_nul) {  /* Undo the NUL of the last rio_nextlineb() */
+    *rp->rio_nul = rp->rio_saved;
+    rp->rio_nul = NULL;
+    }
+}
+
 static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
 {
     int cnt;
 
+    rio_restore(rp);
     while (rp->rio_cnt <= 0) {  /* Refill if buf is empty */
-    rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, 
-               sizeof(rp->rio_buf));
+    rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, RIO_BUFSIZE);
     if (rp->rio_cnt < 0) {
         if (errno != EINTR) /* Interrupted by sig handler return */
         return -1;
@@ -825,6 +913,7 @@ void rio_readinitb(rio_t *rp, int fd)
     rp->rio_fd = fd;  
     rp->rio_cnt = 0;  
     rp->rio_bufptr = rp->rio_buf;
+    rp->rio_nul = NULL;
 }
 /* $end rio_readinitb */
 
@@ -850,35 +939,153 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
 }
 /* $end rio_readnb */
 
+/*
+ * rio_readsomeb - Read up to n bytes, whatever one read returns:
+ *    from the internal buffer while it holds any, then straight from
+ *    the descriptor into usrbuf without going through the buffer
+ */
+ssize_t rio_readsomeb(rio_t *rp, void *usrbuf, size_t n) 
+{
+    ssize_t nread;
+
+    rio_restore(rp);
+    if (rp->rio_cnt > 0)
+    return rio_read(rp, usrbuf, n);
+    while ((nread = read(rp->rio_fd, usrbuf, n)) < 0)
+    if (errno != EINTR) /* Interrupted by sig handler return */
+        return -1;
+    return nread;
+}
+
 /* 
  * rio_readlineb - Robustly read a text line (buffered)
  */
 /* $begin rio_readlineb */
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) 
 {
-    int n, rc;
-    char c, *bufp = usrbuf;
-
-    for (n = 1; n < maxlen; n++) { 
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
-        *bufp++ = c;
-        if (c == '\n') {
-                n++;
-            break;
-            }
-    } else if (rc == 0) {
-        if (n == 1)
-        return 0; /* EOF, no data read */
-        else
-        break;    /* EOF, some data was read */
-    } else
+    size_t n = 0, cnt;
+    ssize_t rc;
+    char *bufp = usrbuf, *nl;
+
+    while (n + 1 < maxlen) {
+    if (rp->rio_cnt <= 0) {  /* Refill, one byte comes back */
+        if ((rc = rio_read(rp, bufp, 1)) < 0)
         return -1;    /* Error */
+        else if (rc == 0)
+        break;        /* EOF */
+        n++;
+        if (*bufp++ == '\n')
+        break;
+        continue;
+    }
+    rio_restore(rp);
+    /* Copy up to the newline, found with memchr(), at once */
+    cnt = maxlen - 1 - n;
+    if (rp->rio_cnt < cnt)
+        cnt = rp->rio_cnt;
+    if ((nl = memchr(rp->rio_bufptr, '\n', cnt)) != NULL)
+        cnt = nl - rp->rio_bufptr + 1;
+    memcpy(bufp, rp->rio_bufptr, cnt);
+    rp->rio_bufptr += cnt;
+    rp->rio_cnt -= cnt;
+    bufp += cnt;
+    n += cnt;
+    if (nl)
+        break;
     }
     *bufp = 0;
-    return n-1;
+    return n;
+}
+
+/*
+ * rio_nextlineb - Robustly read a text line (buffered) without copying it:
+ *    *linep points to the line in the internal buffer, NUL terminated
+ *    in place, until the next read from rp. A line longer than
+ *    RIO_BUFSIZE-1 bytes comes in pieces of that size, as from
+ *    rio_readlineb(). Returns its length, 0 on EOF, -1 on error.
+ */
+ssize_t rio_nextlineb(rio_t *rp, char **linep) 
+{
+    char *nl = NULL;
+    ssize_t rc;
+
+    rio_restore(rp);
+    while (rp->rio_cnt <= 0 ||
+           (nl = memchr(rp->rio_bufptr, '\n', rp->rio_cnt)) == NULL) {
+    if (rp->rio_cnt >= RIO_BUFSIZE - 1)
+        break;        /* A piece of the line is all there is room for */
+    /* Move the partial line to the front and read behind it */
+    if (rp->rio_cnt > 0)
+        memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+    else
+        rp->rio_cnt = 0;
+    rp->rio_bufptr = rp->rio_buf;
+    rc = read(rp->rio_fd, rp->rio_buf + rp->rio_cnt,
+              RIO_BUFSIZE - rp->rio_cnt);
+    if (rc < 0) {
+        if (errno != EINTR) /* Interrupted by sig handler return */
+        return -1;
+    }
+    else if (rc == 0)
+        break;        /* EOF */
+    else
+        rp->rio_cnt += rc;
+    }
+    rc = nl ? nl - rp->rio_bufptr + 1 : rp->rio_cnt;
+    if (rc > RIO_BUFSIZE - 1)
+        rc = RIO_BUFSIZE - 1;
+    *linep = rp->rio_bufptr;
+    rp->rio_bufptr += rc;
+    rp->rio_cnt -= rc;
+    /* The byte after the line is the next one, or the spare at the end */
+    rp->rio_nul = rp->rio_bufptr;
+    rp->rio_saved = *rp->rio_bufptr;
+    *rp->rio_bufptr = 0;
+    return rc;
 }
 /* $end rio_readlineb */
 
+/*
+ * rio_spliceb - Move up to n bytes from rp's descriptor to out_fd
+ *    through a pipe with splice(2), without copying them to user
+ *    space; bytes already in the internal buffer are written first.
+ *    Returns the number of bytes moved, 0 on EOF, -1 on error, after
+ *    which the pipe may hold unsent data.
+ */
+#ifndef SPLICE_F_MOVE
+#define SPLICE_F_MOVE 1
+#define SPLICE_F_MORE 4
+#endif
+ssize_t rio_spliceb(rio_t *rp, int out_fd, int *pipefd, size_t n) 
+{
+    ssize_t nin, nout;
+    size_t nleft;
+
+    rio_restore(rp);
+    if (rp->rio_cnt > 0) {
+    nin = rp->rio_cnt < n ? rp->rio_cnt : n;
+    if (rio_writen(out_fd, rp->rio_bufptr, nin) != nin)
+        return -1;
+    rp->rio_bufptr += nin;
+    rp->rio_cnt -= nin;
+    return nin;
+    }
+    while ((nin = syscall(SYS_splice, rp->rio_fd, NULL, pipefd[1], NULL, n,
+                          SPLICE_F_MOVE | SPLICE_F_MORE)) < 0)
+    if (errno != EINTR) /* Interrupted by sig handler return */
+        return -1;
+    for (nleft = nin; nleft > 0; nleft -= nout) {
+    if ((nout = syscall(SYS_splice, pipefd[0], NULL, out_fd, NULL, nleft,
+                        SPLICE_F_MOVE | SPLICE_F_MORE)) <= 0) {
+        if (nout < 0 && errno == EINTR)
+        nout = 0;
+        else
+        return -1;
+    }
+    }
+    return nin;
+}
+
 /**********************************
  * Wrappers for robust I/O routines
  **********************************/
@@ -897,6 +1104,24 @@ void Rio_writen(int fd, void *usrbuf, size_t n)
     unix_error("Rio_writen error");
 }
 
+void Rio_sendn(int fd, void *usrbuf, size_t n, int flags) 
+{
+    if (rio_sendn(fd, usrbuf, n, flags) != n)
+    unix_error("Rio_sendn error");
+}
+
+void Rio_writev(int fd, struct iovec *iov, int iovcnt) 
+{
+    if (rio_writev(fd, iov, iovcnt) < 0)
+    unix_error("Rio_writev error");
+}
+
+void Rio_sendfile(int out_fd, int in_fd, off_t offset, size_t n) 
+{
+    if (rio_sendfile(out_fd, in_fd, offset, n) < 0)
+    unix_error("Rio_sendfile error");
+}
+
 void Rio_readinitb(rio_t *rp, int fd)
 {
     rio_readinitb(rp, fd);
@@ -920,6 +1145,33 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
     return rc;
 } 
 
+ssize_t Rio_spliceb(rio_t *rp, int out_fd, int *pipefd, size_t n) 
+{
+    ssize_t rc;
+
+    if ((rc = rio_spliceb(rp, out_fd, pipefd, n)) < 0)
+    unix_error("Rio_spliceb error");
+    return rc;
+} 
+
+ssize_t Rio_readsomeb(rio_t *rp, void *usrbuf, size_t n) 
+{
+    ssize_t rc;
+
+    if ((rc = rio_readsomeb(rp, usrbuf, n)) < 0)
+    unix_error("Rio_readsomeb error");
+    return rc;
+} 
+
+ssize_t Rio_nextlineb(rio_t *rp, char **linep) 
+{
+    ssize_t rc;
+
+    if ((rc = rio_nextlineb(rp, linep)) < 0)
+    unix_error("Rio_nextlineb error");
+    return rc;
+} 
+
 /******************************** 
  * Client/server helper functions
  ********************************/
@@ -928,11 +1180,11 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
  *     return a socket descriptor ready for reading and writing. This
  *     function is reentrant and protocol-independent.
  * 
- *     On error, returns -1 and sets errno.  
+ *     Returns -2 for getaddrinfo error, -1 with errno set for other errors.
  */
 /* $begin open_clientfd */
 int open_clientfd(char *hostname, char *port) {
-    int clientfd;
+    int clientfd, rc;
     struct addrinfo hints, *listp, *p;
 
     /* Get a list of potential server addresses */
@@ -940,7 +1192,10 @@ int open_clientfd(char *hostname, char *port) {
     hints.ai_socktype = SOCK_STREAM;  /* Open a connection */
     hints.ai_flags = AI_NUMERICSERV;  /* ... using a numeric port arg. */
     hints.ai_flags |= AI_ADDRCONFIG;  /* Recommended for connections */
-    Getaddrinfo(hostname, port, &hints, &listp);
+    if ((rc = getaddrinfo(hostname, port, &hints, &listp)) != 0) {
+        fprintf(stderr, "getaddrinfo failed (%s:%s): %s\n", hostname, port, gai_strerror(rc));
+        return -2;
+    }
   
     /* Walk the list for one that we can successfully connect to */
     for (p = listp; p; p = p->ai_next) {
@@ -25,6 +25,9 @@
 #include <pthread.h>
 #include <semaphore.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -47,7 +50,9 @@ typedef struct {
     int rio_fd;                /* Descriptor for this internal buf */
     int rio_cnt;               /* Unread bytes in internal buf */
     char *rio_bufptr;          /* Next unread byte in internal buf */
-    char rio_buf[RIO_BUFSIZE]; /* Internal buffer */
+    char *rio_nul;             /* Byte rio_nextlineb() overwrote with NUL */
+    char rio_saved;            /* Its value */
+    char rio_buf[RIO_BUFSIZE + 1]; /* Internal buffer, and room for a NUL */
 } rio_t;
 /* $end rio_t */
 
@@ -175,16 +180,28 @@ void V(sem_t *sem);
 /* Rio (Robust I/O) package */
 ssize_t rio_readn(int fd, void *usrbuf, size_t n);
 ssize_t rio_writen(int fd, void *usrbuf, size_t n);
+ssize_t rio_sendn(int fd, void *usrbuf, size_t n, int flags);
+ssize_t rio_writev(int fd, struct iovec *iov, int iovcnt);
+ssize_t rio_sendfile(int out_fd, int in_fd, off_t offset, size_t n);
 void rio_readinitb(rio_t *rp, int fd); 
 ssize_t	rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t	rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+ssize_t	rio_nextlineb(rio_t *rp, char **linep);
+ssize_t	rio_readsomeb(rio_t *rp, void *usrbuf, size_t n);
+ssize_t	rio_spliceb(rio_t *rp, int out_fd, int *pipefd, size_t n);
 
 /* Wrappers for Rio package */
 ssize_t Rio_readn(int fd, void *usrbuf, size_t n);
 void Rio_writen(int fd, void *usrbuf, size_t n);
+void Rio_sendn(int fd, void *usrbuf, size_t n, int flags);
+void Rio_writev(int fd, struct iovec *iov, int iovcnt);
+void Rio_sendfile(int out_fd, int in_fd, off_t offset, size_t n);
 void Rio_readinitb(rio_t *rp, int fd); 
 ssize_t Rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+ssize_t Rio_nextlineb(rio_t *rp, char **linep);
+ssize_t Rio_readsomeb(rio_t *rp, void *usrbuf, size_t n);
+ssize_t Rio_spliceb(rio_t *rp, int out_fd, int *pipefd, size_t n);
 
 /* Reentrant protocol-independent client/server helpers */
 int open_clientfd(char *hostname, char *port);
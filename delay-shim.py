@@ -0,0 +1,75 @@
+#!/usr/bin/env python3
+
+# delay-shim.py - A TCP relay that adds latency on loopback, where
+#                 there is no netem. It delays the data of each
+#                 direction by DELAY ms, and charges a connection one
+#                 more round trip for its handshake unless its SYN
+#                 carried data (TCP Fast Open), as TCP_INFO tells.
+#                 Every second it writes "<connections> <fast opens>"
+#                 to STATSFILE, if given.
+#
+# usage: delay-shim.py <port> <target port> <delay ms> [statsfile]
+#
+import socket
+import sys
+import threading
+import time
+
+TCP_FASTOPEN = 23
+TCPI_OPT_SYN_DATA = 0x20
+
+port, target, delay = int(sys.argv[1]), int(sys.argv[2]), float(sys.argv[3]) / 1000
+statsfile = sys.argv[4] if len(sys.argv) > 4 else None
+stats = {"conns": 0, "fastopen": 0}
+
+def pump(src, dst):
+  try:
+    while 1:
+      data = src.recv(65536)
+      if not data:
+        break
+      time.sleep(delay)
+      dst.sendall(data)
+  except OSError:
+    pass
+  try:
+    dst.shutdown(socket.SHUT_WR)
+  except OSError:
+    pass
+
+def relay(client):
+  # tcpi_options is the sixth byte of struct tcp_info
+  info = client.getsockopt(socket.IPPROTO_TCP, socket.TCP_INFO, 104)
+  fastopen = info[5] & TCPI_OPT_SYN_DATA
+  stats["conns"] += 1
+  if fastopen:
+    stats["fastopen"] += 1
+  else:
+    time.sleep(2 * delay)
+  server = socket.create_connection(("127.0.0.1", target))
+  for s in (client, server):
+    s.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+  back = threading.Thread(target=pump, args=(server, client))
+  back.start()
+  pump(client, server)
+  back.join()
+  client.close()
+  server.close()
+
+def report():
+  while 1:
+    time.sleep(1)
+    with open(statsfile, "w") as f:
+      f.write("%d %d\n" % (stats["conns"], stats["fastopen"]))
+
+listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+listener.setsockopt(socket.IPPROTO_TCP, TCP_FASTOPEN, 64)
+listener.bind(("127.0.0.1", port))
+listener.listen(128)
+if statsfile:
+  threading.Thread(target=report, daemon=True).start()
+
+while 1:
+  client, details = listener.accept()
+  threading.Thread(target=relay, args=(client,), daemon=True).start()
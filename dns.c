@@ -0,0 +1,377 @@
+#include <sys/time.h>
+#include "dns.h"
+#include "config.h"
+#include "timer.h"
+
+/*
+ * Servers are resolved once per config.dns_ttl rather than on each
+ * connect. getaddrinfo() blocks and does not tell the TTL of its
+ * answer, so the cache keeps addresses for config.dns_ttl and
+ * failures for config.dns_negative_ttl, whatever the records said.
+ *
+ * A name being resolved is marked so; lookups of it meanwhile wait
+ * on the entry for that answer instead of asking too. Entries that
+ * are waited on or being resolved are never replaced.
+ *
+ * A name looked up since it was resolved is hot: once less than a
+ * quarter of its TTL, or two sweeps, is left, a sweep from the timer wheel queues it
+ * for the refresh thread, which resolves it again while lookups are
+ * still answered with the old addresses. A name nobody asked for
+ * during a TTL expires.
+ *
+ * With config.resolve_file, the names listed there resolve to the
+ * addresses given, and others with getaddrinfo(). The file is read
+ * on each resolve, so an edit shows once the entry expires.
+ */
+
+struct dns_entry {
+    char name[DNS_NAME_LEN];
+    // addresses, none if the name failed to resolve
+    struct dns_addr addrs[DNS_MAX_ADDRS];
+    int naddrs;
+    // coarse_msec() when it expires, and of the last lookup
+    long expires;
+    long used;
+    // lookups since it was resolved
+    long lookups;
+    // being resolved, and queued for the refresh thread
+    int resolving;
+    int refresh;
+    // lookups waiting for it to be resolved, on done
+    int waiters;
+    sem_t done;
+};
+
+static struct dns_entry names[DNS_MAX_NAMES];
+static int nnames = 0;
+static struct dns_stats stats;
+// this lock protects names, nnames and stats
+static sem_t dns_lock;
+// posted when names are queued for a refresh
+static sem_t refresh_due;
+static struct timer refresh_timer;
+
+/**
+ * parse a numeric address
+ * @param host
+ * @param a: filled in
+ * @return 1 if host is one
+ */
+static int parse_addr(char* host, struct dns_addr* a) {
+    struct sockaddr_in* in = (struct sockaddr_in*) &a->addr;
+    struct sockaddr_in6* in6 = (struct sockaddr_in6*) &a->addr;
+    memset(a, 0, sizeof(struct dns_addr));
+    a->socktype = SOCK_STREAM;
+    a->protocol = IPPROTO_TCP;
+    if (inet_pton(AF_INET, host, &in->sin_addr) == 1) {
+        a->family = in->sin_family = AF_INET;
+        a->addrlen = sizeof(struct sockaddr_in);
+        return 1;
+    }
+    if (inet_pton(AF_INET6, host, &in6->sin6_addr) == 1) {
+        a->family = in6->sin6_family = AF_INET6;
+        a->addrlen = sizeof(struct sockaddr_in6);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * look a name up in config.resolve_file, lines of a name and
+ * its addresses; a name listed without any fails to resolve
+ * @param name
+ * @param addrs: DNS_MAX_ADDRS of them
+ * @param error: set if it failed
+ * @return number of addresses, -1 if the name is not listed
+ */
+static int resolve_from_file(char* name, struct dns_addr* addrs, int* error) {
+    char line[MAXLINE], *save, *tok;
+    int n = -1;
+    FILE* f = fopen(config.resolve_file, "r");
+    if (!f) {
+        fprintf(stderr, "resolve file %s: %s\n", config.resolve_file,
+                strerror(errno));
+        return -1;
+    }
+    while (n < 0 && fgets(line, sizeof(line), f)) {
+        if (!(tok = strtok_r(line, " \t\r\n", &save)) || tok[0] == '#' ||
+            strcasecmp(tok, name) != 0)
+            continue;
+        n = 0;
+        while ((tok = strtok_r(NULL, " \t\r\n", &save)) && n < DNS_MAX_ADDRS)
+            if (parse_addr(tok, &addrs[n]))
+                n++;
+    }
+    fclose(f);
+    if (n == 0)
+        *error = EAI_NONAME;
+    return n;
+}
+
+/**
+ * resolve a name, which blocks
+ * @param name
+ * @param addrs: DNS_MAX_ADDRS of them
+ * @param error: set if it failed
+ * @return number of addresses, 0 if it failed
+ */
+static int resolve(char* name, struct dns_addr* addrs, int* error) {
+    struct addrinfo hints, *listp, *p;
+    struct timeval start, end;
+    int n = -1;
+
+    gettimeofday(&start, NULL);
+    if (config.resolve_file)
+        n = resolve_from_file(name, addrs, error);
+    if (n < 0) {
+        memset(&hints, 0, sizeof(struct addrinfo));
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_ADDRCONFIG;
+        n = 0;
+        if ((*error = getaddrinfo(name, NULL, &hints, &listp)) == 0) {
+            for (p = listp; p && n < DNS_MAX_ADDRS; p = p->ai_next) {
+                if (p->ai_addrlen > sizeof(struct sockaddr_storage))
+                    continue;
+                addrs[n].family = p->ai_family;
+                addrs[n].socktype = p->ai_socktype;
+                addrs[n].protocol = p->ai_protocol;
+                addrs[n].addrlen = p->ai_addrlen;
+                memcpy(&addrs[n].addr, p->ai_addr, p->ai_addrlen);
+                n++;
+            }
+            Freeaddrinfo(listp);
+            if (n == 0)
+                *error = EAI_NONAME;
+        }
+    }
+    gettimeofday(&end, NULL);
+
+    P(&dns_lock);
+    stats.resolves++;
+    if (n == 0)
+        stats.failures++;
+    stats.resolve_usec += (end.tv_sec - start.tv_sec) * 1000000L +
+                          end.tv_usec - start.tv_usec;
+    V(&dns_lock);
+    if (n == 0)
+        fprintf(stderr, "getaddrinfo failed (%s): %s\n", name,
+                gai_strerror(*error));
+    return n;
+}
+
+/**
+ * store the answer for an entry being resolved, and wake up the
+ * lookups waiting for it
+ * notice: need to acquire dns_lock
+ */
+static void finish_resolve(struct dns_entry* e, struct dns_addr* addrs,
+                           int n) {
+    int i;
+    memcpy(e->addrs, addrs, n * sizeof(struct dns_addr));
+    e->naddrs = n;
+    e->expires = coarse_msec() +
+        (n ? config.dns_ttl : config.dns_negative_ttl) * 1000L;
+    e->lookups = 0;
+    e->resolving = 0;
+    for (i = 0; i < e->waiters; i++)
+        V(&e->done);
+}
+
+/**
+ * resolve the names queued for a refresh, one after another
+ */
+static void* refresh_thread(void* vargp) {
+    struct dns_addr addrs[DNS_MAX_ADDRS];
+    char name[DNS_NAME_LEN];
+    int i, n, error;
+    Pthread_detach(pthread_self());
+    while (1) {
+        P(&refresh_due);
+        while (1) {
+            P(&dns_lock);
+            for (i = 0; i < nnames && !names[i].refresh; i++)
+                ;
+            if (i == nnames) {
+                V(&dns_lock);
+                break;
+            }
+            names[i].refresh = 0;
+            strcpy(name, names[i].name);
+            V(&dns_lock);
+
+            n = resolve(name, addrs, &error);
+            P(&dns_lock);
+            stats.refreshes++;
+            // a failure leaves the old addresses until they expire
+            if (n > 0 || names[i].waiters > 0 ||
+                names[i].expires <= coarse_msec())
+                finish_resolve(&names[i], addrs, n);
+            else
+                names[i].resolving = 0;
+            V(&dns_lock);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * queue the hot names that expire soon for the refresh thread, and
+ * sweep again later
+ * the wheel's thread runs this
+ */
+static void sweep(void* arg) {
+    long now = coarse_msec();
+    // a window shorter than the period could fall between sweeps
+    long ahead = config.dns_ttl * 1000L / 4;
+    int i, due = 0;
+    if (ahead < 2 * DNS_REFRESH_MS)
+        ahead = 2 * DNS_REFRESH_MS;
+    P(&dns_lock);
+    for (i = 0; i < nnames; i++) {
+        struct dns_entry* e = &names[i];
+        if (e->naddrs > 0 && e->lookups > 0 && !e->resolving &&
+            e->expires > now && e->expires - now < ahead) {
+            e->resolving = e->refresh = 1;
+            due = 1;
+        }
+    }
+    V(&dns_lock);
+    if (due)
+        V(&refresh_due);
+    timer_add(&refresh_timer, DNS_REFRESH_MS);
+}
+
+/**
+ * prepare the cache and start the refresh thread
+ * notice: call before starting other threads, after timer_init()
+ */
+void dns_init(void) {
+    pthread_t tid;
+    int i;
+    Sem_init(&dns_lock, 0, 1);
+    Sem_init(&refresh_due, 0, 0);
+    for (i = 0; i < DNS_MAX_NAMES; i++)
+        Sem_init(&names[i].done, 0, 0);
+    if (config.dns_ttl > 0) {
+        Pthread_create(&tid, NULL, refresh_thread, NULL);
+        timer_setup(&refresh_timer, sweep, NULL);
+        timer_add(&refresh_timer, DNS_REFRESH_MS);
+    }
+}
+
+/**
+ * the entry of a name, a new one if it is not cached
+ * notice: need to acquire dns_lock
+ * @return NULL if every entry is busy
+ */
+static struct dns_entry* find_entry(char* name) {
+    struct dns_entry* e = NULL;
+    int i;
+    for (i = 0; i < nnames; i++) {
+        if (strcasecmp(names[i].name, name) == 0)
+            return &names[i];
+        if (!names[i].resolving && names[i].waiters == 0 &&
+            (!e || names[i].used < e->used))
+            e = &names[i];
+    }
+    if (nnames < DNS_MAX_NAMES)
+        e = &names[nnames++];
+    else if (!e)
+        return NULL;
+    strcpy(e->name, name);
+    e->naddrs = 0;
+    e->expires = 0;
+    e->lookups = 0;
+    e->refresh = 0;
+    return e;
+}
+
+/**
+ * set the port of addresses
+ * @param addrs
+ * @param n
+ * @param port: a number
+ * @return n, -1 if port is not one
+ */
+static int set_port(struct dns_addr* addrs, int n, char* port) {
+    char* end;
+    long p = strtol(port, &end, 10);
+    int i;
+    if (end == port || *end || p < 0 || p > 65535)
+        return -1;
+    for (i = 0; i < n; i++)
+        if (addrs[i].family == AF_INET)
+            ((struct sockaddr_in*) &addrs[i].addr)->sin_port = htons(p);
+        else if (addrs[i].family == AF_INET6)
+            ((struct sockaddr_in6*) &addrs[i].addr)->sin6_port = htons(p);
+    return n;
+}
+
+/**
+ * the addresses of a server, from the cache if it has the name
+ * @param hostname
+ * @param port
+ * @param addrs: DNS_MAX_ADDRS of them, filled in
+ * @return number of addresses, -1 if the name does not resolve
+ */
+int dns_lookup(char* hostname, char* port, struct dns_addr* addrs) {
+    struct dns_entry* e;
+    int n, error;
+
+    if (parse_addr(hostname, addrs))
+        return set_port(addrs, 1, port);
+    e = NULL;
+    if (config.dns_ttl > 0 && strlen(hostname) < DNS_NAME_LEN) {
+        P(&dns_lock);
+        if (!(e = find_entry(hostname)))
+            V(&dns_lock);
+    }
+    if (!e) {
+        // not cached, or every entry is busy
+        n = resolve(hostname, addrs, &error);
+        return n ? set_port(addrs, n, port) : -1;
+    }
+
+    stats.lookups++;
+    e->used = coarse_msec();
+    e->lookups++;
+    if (e->expires <= e->used && e->resolving) {
+        // another thread asked already, its answer will do
+        stats.coalesced++;
+        while (e->resolving) {
+            e->waiters++;
+            V(&dns_lock);
+            P(&e->done);
+            P(&dns_lock);
+            e->waiters--;
+        }
+    }
+    else if (e->expires > e->used) {
+        if (e->naddrs)
+            stats.hits++;
+        else
+            stats.negative_hits++;
+    }
+    else {
+        e->resolving = 1;
+        V(&dns_lock);
+        n = resolve(hostname, addrs, &error);
+        P(&dns_lock);
+        finish_resolve(e, addrs, n);
+    }
+    n = e->naddrs;
+    memcpy(addrs, e->addrs, n * sizeof(struct dns_addr));
+    V(&dns_lock);
+    return n ? set_port(addrs, n, port) : -1;
+}
+
+/**
+ * copy the cache counters
+ * @param out
+ */
+void get_dns_stats(struct dns_stats* out) {
+    P(&dns_lock);
+    *out = stats;
+    out->names = nnames;
+    V(&dns_lock);
+}
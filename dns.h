@@ -0,0 +1,46 @@
+#ifndef __DNS_H__
+#define __DNS_H__
+
+#include "csapp.h"
+
+/* names cached, the least recently looked up is replaced */
+#define DNS_MAX_NAMES 256
+#define DNS_NAME_LEN 256
+/* addresses kept per name */
+#define DNS_MAX_ADDRS 8
+/* period of the sweep that refreshes hot names, in ms */
+#define DNS_REFRESH_MS 1000
+
+/* an address of a name, with the port of the lookup */
+struct dns_addr {
+    int family;
+    int socktype;
+    int protocol;
+    socklen_t addrlen;
+    struct sockaddr_storage addr;
+};
+
+/* lookups since start */
+struct dns_stats {
+    // lookups, and those answered by the cache, with addresses
+    // or with a failure, and those that waited for another one
+    long lookups;
+    long hits;
+    long negative_hits;
+    long coalesced;
+    // names resolved, those that failed, and hot names resolved
+    // again before they expired
+    long resolves;
+    long failures;
+    long refreshes;
+    // names in the cache now
+    long names;
+    // time spent resolving, in us
+    long resolve_usec;
+};
+
+void dns_init(void);
+int dns_lookup(char* hostname, char* port, struct dns_addr* addrs);
+void get_dns_stats(struct dns_stats* stats);
+
+#endif /* __DNS_H__ */
@@ -0,0 +1,585 @@
+/* strptime() and timegm() */
+#define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE
+#include <limits.h>
+#include "http.h"
+
+/**
+ * reset a meta to "nothing known"
+ * @param meta
+ */
+void init_meta(struct http_meta* meta) {
+    meta->status = -1;
+    meta->content_len = -1;
+    meta->bad_length = 0;
+    meta->no_store = 0;
+    meta->no_cache = 0;
+    meta->must_revalidate = 0;
+    meta->max_age = -1;
+    meta->has_s_maxage = 0;
+    meta->stale_while_revalidate = 0;
+    meta->stale_if_error = 0;
+    meta->age = 0;
+    meta->date = 0;
+    meta->expires = 0;
+    meta->last_modified = 0;
+    meta->has_expires = 0;
+    meta->etag[0] = '\0';
+    meta->last_modified_str[0] = '\0';
+    meta->content_encoded = 0;
+    meta->content_type[0] = '\0';
+    meta->range_first = 0;
+    meta->range_last = -1;
+    meta->range_total = -1;
+    meta->tags[0] = '\0';
+    meta->chunked = 0;
+    meta->keep_alive = 0;
+}
+
+/**
+ * parse the status code out of a status line
+ * @param  line: e.g. "HTTP/1.0 200 OK\r\n"
+ * @return status code, -1 if malformed
+ */
+int parse_status_line(char* line) {
+    int status;
+    if (strncasecmp(line, "HTTP/", 5) != 0)
+        return -1;
+    if (sscanf(line, "%*s %d", &status) != 1)
+        return -1;
+    return status;
+}
+
+/**
+ * copy a header's value without leading blanks and trailing CRLF
+ * @param dst: at least MAXLINE bytes
+ * @param value: the text after the colon
+ */
+static void copy_value(char* dst, char* value) {
+    while (*value == ' ' || *value == '\t')
+        value++;
+    strncpy(dst, value, MAXLINE - 1);
+    dst[MAXLINE - 1] = '\0';
+    char* end = dst + strlen(dst);
+    while (end > dst && (end[-1] == '\r' || end[-1] == '\n' ||
+                         end[-1] == ' ' || end[-1] == '\t'))
+        *--end = '\0';
+}
+
+/**
+ * add the tags of a Surrogate-Key or Cache-Tag header,
+ * tags that do not fit are dropped
+ * @param meta
+ * @param value: tags separated by spaces or commas
+ */
+static void add_tags(struct http_meta* meta, char* value) {
+    int len = strlen(meta->tags);
+    char* save;
+    char* tag = strtok_r(value, " \t,", &save);
+    while (tag) {
+        int n = strlen(tag);
+        if (len + n + 2 > MAXLINE)
+            break;
+        if (len > 0)
+            meta->tags[len++] = ' ';
+        memcpy(meta->tags + len, tag, n + 1);
+        len += n;
+        tag = strtok_r(NULL, " \t,", &save);
+    }
+}
+
+/**
+ * parse the directives of a Cache-Control header
+ * @param meta
+ * @param value: header value, e.g. "public, max-age=60"
+ */
+static void parse_cache_control(struct http_meta* meta, char* value) {
+    char* save;
+    char* tok = strtok_r(value, ",", &save);
+    while (tok) {
+        while (*tok == ' ' || *tok == '\t')
+            tok++;
+        if (strncasecmp(tok, "no-store", 8) == 0 ||
+            strncasecmp(tok, "private", 7) == 0)
+            meta->no_store = 1;
+        else if (strncasecmp(tok, "no-cache", 8) == 0)
+            meta->no_cache = 1;
+        else if (strncasecmp(tok, "must-revalidate", 15) == 0 ||
+                 strncasecmp(tok, "proxy-revalidate", 16) == 0)
+            meta->must_revalidate = 1;
+        else if (strncasecmp(tok, "s-maxage=", 9) == 0) {
+            meta->max_age = atol(tok + 9);
+            meta->has_s_maxage = 1;
+        }
+        else if (strncasecmp(tok, "max-age=", 8) == 0 && !meta->has_s_maxage)
+            meta->max_age = atol(tok + 8);
+        else if (strncasecmp(tok, "stale-while-revalidate=", 23) == 0)
+            meta->stale_while_revalidate = atol(tok + 23);
+        else if (strncasecmp(tok, "stale-if-error=", 15) == 0)
+            meta->stale_if_error = atol(tok + 15);
+        tok = strtok_r(NULL, ",", &save);
+    }
+}
+
+/**
+ * parse a Content-Length value into meta; a list of equal values,
+ * as a proxy may have merged repeated headers into, is one length
+ * @param meta
+ * @param value: trimmed
+ */
+static void parse_content_length(struct http_meta* meta, char* value) {
+    char *save, *end;
+    char* tok = strtok_r(value, ",", &save);
+    if (!tok)
+        meta->bad_length = 1;
+    while (tok) {
+        while (*tok == ' ' || *tok == '\t')
+            tok++;
+        // strtol takes signs and blanks, 1*DIGIT does not
+        errno = 0;
+        long len = isdigit((unsigned char) *tok) ? strtol(tok, &end, 10) : -1;
+        if (len >= 0)
+            while (*end == ' ' || *end == '\t')
+                end++;
+        if (len < 0 || *end || errno == ERANGE ||
+            (meta->content_len >= 0 && meta->content_len != len)) {
+            meta->bad_length = 1;
+            return;
+        }
+        meta->content_len = len;
+        tok = strtok_r(NULL, ",", &save);
+    }
+}
+
+/**
+ * collect a response header line into meta
+ * unknown headers are ignored
+ * @param meta
+ * @param line: one header line, NUL terminated
+ */
+void parse_header(struct http_meta* meta, char* line) {
+    char value[MAXLINE];
+    char* colon = strchr(line, ':');
+    if (!colon)
+        return;
+    copy_value(value, colon + 1);
+
+    if (strncasecmp(line, "Content-Length:", 15) == 0)
+        parse_content_length(meta, value);
+    else if (strncasecmp(line, "Cache-Control:", 14) == 0)
+        parse_cache_control(meta, value);
+    else if (strncasecmp(line, "Pragma:", 7) == 0) {
+        if (strncasecmp(value, "no-cache", 8) == 0)
+            meta->no_cache = 1;
+    }
+    else if (strncasecmp(line, "Age:", 4) == 0)
+        meta->age = atol(value);
+    else if (strncasecmp(line, "Date:", 5) == 0)
+        meta->date = parse_http_date(value);
+    else if (strncasecmp(line, "Expires:", 8) == 0) {
+        // an invalid date means "already expired"
+        meta->expires = parse_http_date(value);
+        meta->has_expires = 1;
+    }
+    else if (strncasecmp(line, "Content-Range:", 14) == 0) {
+        if (sscanf(value, "bytes %ld-%ld/%ld", &meta->range_first,
+                   &meta->range_last, &meta->range_total) != 3)
+            meta->range_total = -1;
+    }
+    else if (strncasecmp(line, "Content-Type:", 13) == 0)
+        strcpy(meta->content_type, value);
+    else if (strncasecmp(line, "Content-Encoding:", 17) == 0)
+        meta->content_encoded = strcasecmp(value, "identity") != 0;
+    else if (strncasecmp(line, "ETag:", 5) == 0)
+        strcpy(meta->etag, value);
+    else if (strncasecmp(line, "Last-Modified:", 14) == 0) {
+        strcpy(meta->last_modified_str, value);
+        meta->last_modified = parse_http_date(value);
+    }
+    else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0) {
+        // the last coding must be chunked, else the body is
+        // delimited by the end of the connection
+        size_t len = strlen(value);
+        meta->chunked = len >= 7 && strcasecmp(value + len - 7, "chunked") == 0;
+    }
+    else if (strncasecmp(line, "Connection:", 11) == 0) {
+        if (has_token(value, "close"))
+            meta->keep_alive = 0;
+        else if (has_token(value, "keep-alive"))
+            meta->keep_alive = 1;
+    }
+    else if (is_tag_header(line))
+        add_tags(meta, value);
+}
+
+/**
+ * whether a header line tags the response for purging,
+ * such headers are for the cache and not passed on
+ * @param line
+ */
+int is_tag_header(char* line) {
+    return strncasecmp(line, "Surrogate-Key:", 14) == 0 ||
+           strncasecmp(line, "Cache-Tag:", 10) == 0;
+}
+
+/**
+ * the Connection header that ends the head of a response to a
+ * client, stored heads leave it out since it depends on the request
+ * @param keep_alive: whether the connection is kept after the response
+ * @return the header line and the blank line
+ */
+char* connection_end(int keep_alive) {
+    return keep_alive ? "Connection: keep-alive\r\n\r\n" :
+                        "Connection: close\r\n\r\n";
+}
+
+/**
+ * parse an HTTP-date in any of the three formats of RFC 7231
+ * @param  str
+ * @return seconds since the epoch, 0 if malformed
+ */
+time_t parse_http_date(char* str) {
+    static const char* formats[] = {
+        "%a, %d %b %Y %H:%M:%S GMT",    // RFC 1123
+        "%A, %d-%b-%y %H:%M:%S GMT",    // RFC 850
+        "%a %b %d %H:%M:%S %Y",         // asctime()
+    };
+    struct tm tm;
+    int i;
+    for (i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+        memset(&tm, 0, sizeof(tm));
+        char* end = strptime(str, formats[i], &tm);
+        if (end && *end == '\0')
+            return timegm(&tm);
+    }
+    return 0;
+}
+
+/**
+ * how long a response stays fresh after it was received
+ * s-maxage/max-age win over Expires, which wins over the
+ * Last-Modified heuristic (10% of the object's age)
+ * @param  meta
+ * @param  now: time the response was received
+ * @return lifetime in seconds, <= 0 means stale on arrival
+ */
+long freshness_lifetime(struct http_meta* meta, time_t now) {
+    long ttl;
+    time_t date = meta->date ? meta->date : now;
+
+    if (meta->no_cache)
+        ttl = 0;
+    else if (meta->max_age >= 0)
+        ttl = meta->max_age;
+    else if (meta->has_expires)
+        ttl = meta->expires ? meta->expires - date : 0;
+    else if (meta->last_modified && meta->last_modified < date) {
+        ttl = (date - meta->last_modified) / 10;
+        if (ttl > MAX_HEURISTIC_TTL)
+            ttl = MAX_HEURISTIC_TTL;
+    }
+    else
+        ttl = DEFAULT_TTL;
+    return ttl - meta->age;
+}
+
+/**
+ * whether an Accept-Encoding value allows a content coding
+ * @param  value: header value, e.g. " gzip, deflate;q=0.5"
+ * @param  coding: e.g. "gzip"
+ * @return 1 if coding (or *) is listed with a non-zero q
+ */
+int accepts_coding(char* value, char* coding) {
+    char list[MAXLINE];
+    char* save;
+    int len = strlen(coding);
+    copy_value(list, value);
+    char* tok = strtok_r(list, ",", &save);
+    while (tok) {
+        while (*tok == ' ' || *tok == '\t')
+            tok++;
+        if ((strncasecmp(tok, coding, len) == 0 &&
+             (tok[len] == '\0' || tok[len] == ';' || tok[len] == ' ')) ||
+            (tok[0] == '*' && (tok[1] == '\0' || tok[1] == ';'))) {
+            char* q = strstr(tok, "q=");
+            return !q || atof(q + 2) > 0;
+        }
+        tok = strtok_r(NULL, ",", &save);
+    }
+    return 0;
+}
+
+/**
+ * whether a comma-separated header value lists a token
+ * @param  value: header value, e.g. " keep-alive, Upgrade"
+ * @param  token: e.g. "close", matched regardless of case
+ * @return 1 if listed
+ */
+int has_token(char* value, char* token) {
+    char list[MAXLINE];
+    char* save;
+    int len = strlen(token);
+    copy_value(list, value);
+    char* tok = strtok_r(list, ",", &save);
+    while (tok) {
+        while (*tok == ' ' || *tok == '\t')
+            tok++;
+        if (strncasecmp(tok, token, len) == 0 &&
+            (tok[len] == '\0' || tok[len] == ' ' || tok[len] == '\t'))
+            return 1;
+        tok = strtok_r(NULL, ",", &save);
+    }
+    return 0;
+}
+
+/**
+ * parse a Range header against an object of known length
+ * ranges are clipped to the object, e.g. "bytes=0-99,-20"
+ * @param  value: header value
+ * @param  total: length of the object
+ * @param  ranges: filled in request order
+ * @param  max: capacity of ranges
+ * @return number of ranges, 0 if the header must be ignored
+ *         (not a valid bytes range, or too many ranges),
+ *         -1 if no range overlaps the object (416)
+ */
+int parse_range(char* value, long total, struct byte_range* ranges, int max) {
+    char list[MAXLINE];
+    char* save;
+    int n = 0, valid = 0;
+    copy_value(list, value);
+    if (strncasecmp(list, "bytes=", 6) != 0)
+        return 0;
+    char* tok = strtok_r(list + 6, ",", &save);
+    while (tok) {
+        long first, last;
+        char* end;
+        while (*tok == ' ' || *tok == '\t')
+            tok++;
+        if (*tok == '-') {
+            // suffix range: the last N bytes
+            long suffix = strtol(tok + 1, &end, 10);
+            if (end == tok + 1 || suffix < 0)
+                return 0;
+            first = total - suffix < 0 ? 0 : total - suffix;
+            last = total - 1;
+            if (suffix == 0)
+                first = total;
+        }
+        else {
+            first = strtol(tok, &end, 10);
+            if (end == tok || *end != '-')
+                return 0;
+            char* start = end + 1;
+            last = strtol(start, &end, 10);
+            if (end == start)
+                last = total - 1;
+            else if (last < first)
+                return 0;
+            if (last > total - 1)
+                last = total - 1;
+        }
+        while (*end == ' ' || *end == '\t')
+            end++;
+        if (*end != '\0')
+            return 0;
+        valid++;
+        if (first < total) {
+            if (n == max)
+                return 0;
+            ranges[n].first = first;
+            ranges[n].last = last;
+            n++;
+        }
+        tok = strtok_r(NULL, ",", &save);
+    }
+    if (!valid)
+        return 0;
+    return n > 0 ? n : -1;
+}
+
+/**
+ * find how the body of a response ends, once its head was parsed
+ * notice: the response must be to a GET
+ * @param bf
+ * @param meta
+ */
+void init_framer(struct body_framer* bf, struct http_meta* meta) {
+    bf->left = 0;
+    bf->in_chunk = 0;
+    bf->done = 0;
+    if ((meta->status >= 100 && meta->status < 200) || meta->status == 204 ||
+        meta->status == 304)
+        bf->framing = BODY_NONE;
+    else if (meta->chunked) {
+        bf->framing = BODY_CHUNKED;
+        meta->content_len = -1;
+    }
+    else if (meta->bad_length)
+        bf->framing = BODY_INVALID;
+    else if (meta->content_len >= 0) {
+        bf->framing = BODY_LENGTH;
+        bf->left = meta->content_len;
+    }
+    else
+        bf->framing = BODY_CLOSE;
+}
+
+/**
+ * how many bytes of the body may be read next in one go, reading
+ * the chunk framing in front of them if need be
+ * @param rp: the server, past the head
+ * @param bf
+ * @return bytes, LONG_MAX up to EOF, 0 at the end of the body,
+ *         -1 if the framing is malformed or cut short
+ */
+long body_left(rio_t* rp, struct body_framer* bf) {
+    char line[MAXLINE];
+    char* end;
+
+    if (bf->done)
+        return 0;
+    switch (bf->framing) {
+    case BODY_NONE:
+        bf->done = 1;
+        return 0;
+    case BODY_LENGTH:
+        if (bf->left == 0)
+            bf->done = 1;
+        return bf->left;
+    case BODY_CLOSE:
+        return LONG_MAX;
+    case BODY_INVALID:
+        return -1;
+    case BODY_CHUNKED:
+        break;
+    }
+    if (bf->left > 0)
+        return bf->left;
+    // the CRLF that ends the data of a chunk
+    if (bf->in_chunk) {
+        if (rio_readlineb(rp, line, MAXLINE) <= 0 || strcmp(line, "\r\n") != 0)
+            return -1;
+        bf->in_chunk = 0;
+    }
+    // chunk-size [; extensions] CRLF
+    if (rio_readlineb(rp, line, MAXLINE) <= 0)
+        return -1;
+    bf->left = strtol(line, &end, 16);
+    if (end == line || bf->left < 0 || (*end != ';' && *end != '\r' &&
+                                        *end != '\n' && *end != ' '))
+        return -1;
+    if (bf->left > 0) {
+        bf->in_chunk = 1;
+        return bf->left;
+    }
+    // the last chunk: trailer fields are read and dropped, a
+    // close-delimited copy of the body has no place for them
+    while (rio_readlineb(rp, line, MAXLINE) > 0)
+        if (strcmp(line, "\r\n") == 0) {
+            bf->done = 1;
+            return 0;
+        }
+    return -1;
+}
+
+/**
+ * account for bytes of the body that were read or moved
+ * @param bf
+ * @param n: up to what body_left() returned, 0 at EOF
+ */
+void body_consumed(struct body_framer* bf, long n) {
+    if (bf->framing == BODY_CLOSE && n == 0)
+        bf->done = 1;
+    else if (bf->framing == BODY_LENGTH || bf->framing == BODY_CHUNKED)
+        bf->left -= n;
+}
+
+/**
+ * read the next bytes of a body, whatever one read returns
+ * @param rp: the server, past the head
+ * @param bf
+ * @param buf
+ * @param n: most bytes to read
+ * @return bytes read, 0 at the end of the body, or at EOF before it,
+ *         which leaves bf->done 0; -1 on errors and bad framing
+ */
+ssize_t read_body(rio_t* rp, struct body_framer* bf, char* buf, size_t n) {
+    long left = body_left(rp, bf);
+    ssize_t rc;
+    if (left <= 0)
+        return left;
+    if (n > left)
+        n = left;
+    if ((rc = rio_readsomeb(rp, buf, n)) >= 0)
+        body_consumed(bf, rc);
+    return rc;
+}
+
+/**
+ * start an empty head
+ * @param hb
+ */
+void head_buf_init(struct head_buf* hb) {
+    hb->data = hb->small;
+    hb->len = 0;
+    hb->cap = sizeof(hb->small);
+}
+
+/**
+ * make room for more bytes in a head
+ */
+static void head_buf_reserve(struct head_buf* hb, size_t more) {
+    if (hb->len + more <= hb->cap)
+        return;
+    while (hb->len + more > hb->cap)
+        hb->cap *= 2;
+    if (hb->data == hb->small) {
+        hb->data = Malloc(hb->cap);
+        memcpy(hb->data, hb->small, hb->len);
+    }
+    else
+        hb->data = Realloc(hb->data, hb->cap);
+}
+
+/**
+ * append bytes, e.g. a header line, to a head
+ * @param hb
+ * @param s
+ * @param len
+ */
+void head_buf_add(struct head_buf* hb, const char* s, size_t len) {
+    head_buf_reserve(hb, len);
+    memcpy(hb->data + hb->len, s, len);
+    hb->len += len;
+}
+
+/**
+ * append formatted text to a head
+ * @param hb
+ * @param fmt: as for printf()
+ */
+void head_buf_printf(struct head_buf* hb, const char* fmt, ...) {
+    va_list ap;
+    int n;
+    va_start(ap, fmt);
+    n = vsnprintf(hb->data + hb->len, hb->cap - hb->len, fmt, ap);
+    va_end(ap);
+    if (n >= hb->cap - hb->len) {
+        head_buf_reserve(hb, n + 1);
+        va_start(ap, fmt);
+        vsnprintf(hb->data + hb->len, hb->cap - hb->len, fmt, ap);
+        va_end(ap);
+    }
+    hb->len += n;
+}
+
+/**
+ * release the memory of a head
+ * @param hb
+ */
+void head_buf_free(struct head_buf* hb) {
+    if (hb->data != hb->small)
+        Free(hb->data);
+    head_buf_init(hb);
+}
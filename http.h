@@ -0,0 +1,117 @@
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include "csapp.h"
+
+/* freshness of responses that carry no explicit lifetime, in seconds */
+#define DEFAULT_TTL 300
+/* upper bound of the Last-Modified heuristic, in seconds */
+#define MAX_HEURISTIC_TTL 86400
+
+/* most ranges answered from the cache for one request */
+#define MAX_RANGES 16
+
+/* one range of a Range header, both ends inclusive as in HTTP */
+struct byte_range {
+    long first;
+    long last;
+};
+
+/* cache-relevant fields of an HTTP response head */
+struct http_meta {
+    int status;
+    long content_len;
+    // Content-Length is malformed, negative, too large, or given
+    // twice with different values
+    int bad_length;
+    // no-store or private: never cache
+    int no_store;
+    // no-cache: cache, but revalidate before every use
+    int no_cache;
+    // must-revalidate or proxy-revalidate: never serve it stale
+    int must_revalidate;
+    // max-age (or s-maxage, which wins), -1 if absent
+    long max_age;
+    int has_s_maxage;
+    // seconds a stale response may be served while it is
+    // revalidated, or when the server fails
+    long stale_while_revalidate;
+    long stale_if_error;
+    long age;
+    time_t date;
+    time_t expires;
+    time_t last_modified;
+    int has_expires;
+    // raw validators, empty if absent
+    char etag[MAXLINE];
+    char last_modified_str[MAXLINE];
+    // the body has a Content-Encoding other than identity
+    int content_encoded;
+    char content_type[MAXLINE];
+    // Content-Range of a 206, range_total is -1 if absent or unknown
+    long range_first;
+    long range_last;
+    long range_total;
+    // Surrogate-Key and Cache-Tag values, separated by spaces
+    char tags[MAXLINE];
+    // Transfer-Encoding ends with chunked, Content-Length is ignored
+    int chunked;
+    // the server keeps the connection after the response, which
+    // HTTP/1.1 does unless it says otherwise
+    int keep_alive;
+};
+
+/* how the end of a response body is found */
+enum body_framing {
+    // no body: 1xx, 204, 304
+    BODY_NONE,
+    BODY_LENGTH,
+    BODY_CHUNKED,
+    // up to EOF
+    BODY_CLOSE,
+    // Content-Length is invalid: where the body ends is unknown, and
+    // the response must not be relayed
+    BODY_INVALID
+};
+
+/* reads a response body up to where it ends, without the chunked
+   encoding; see body_left() */
+struct body_framer {
+    enum body_framing framing;
+    // bytes left of the body, or of the current chunk
+    long left;
+    // the CRLF after a chunk's data is still to be read
+    int in_chunk;
+    // the whole body was read, also the trailers of a chunked one
+    int done;
+};
+
+/* a request or response head assembled to be sent with one write,
+   in place up to MAXLINE bytes and on the heap beyond */
+struct head_buf {
+    char* data;
+    size_t len;
+    size_t cap;
+    char small[MAXLINE];
+};
+
+void init_meta(struct http_meta* meta);
+int parse_status_line(char* line);
+void parse_header(struct http_meta* meta, char* line);
+time_t parse_http_date(char* str);
+long freshness_lifetime(struct http_meta* meta, time_t now);
+int accepts_coding(char* value, char* coding);
+int has_token(char* value, char* token);
+int parse_range(char* value, long total, struct byte_range* ranges, int max);
+int is_tag_header(char* line);
+char* connection_end(int keep_alive);
+void init_framer(struct body_framer* bf, struct http_meta* meta);
+long body_left(rio_t* rp, struct body_framer* bf);
+void body_consumed(struct body_framer* bf, long n);
+ssize_t read_body(rio_t* rp, struct body_framer* bf, char* buf, size_t n);
+void head_buf_init(struct head_buf* hb);
+void head_buf_add(struct head_buf* hb, const char* s, size_t len);
+void head_buf_printf(struct head_buf* hb, const char* fmt, ...);
+void head_buf_free(struct head_buf* hb);
+
+#endif /* __HTTP_H__ */
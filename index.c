@@ -0,0 +1,447 @@
+#include "index.h"
+
+/*
+ * Indexes over the listed blocks, kept by the list functions of
+ * cache.c under list_lock: a hash table for exact lookups and a
+ * radix tree for prefix and wildcard matches of uris, and an inverted
+ * index from surrogate keys to blocks. Their cost is proportional to
+ * the matching blocks, not to the cache.
+ */
+
+/* a node of the radix tree, its key is the labels from the root */
+struct radix_node {
+    char* label;
+    int len;
+    // number of listed blocks whose uri is the key
+    int refs;
+    struct radix_node* child;
+    struct radix_node* sibling;
+};
+
+static struct cache_block** buckets = NULL;
+static unsigned nbuckets = 0;
+static unsigned nblocks = 0;
+static struct radix_node root = { "", 0, 0, NULL, NULL };
+static struct tag_entry** tag_buckets = NULL;
+static unsigned ntag_buckets = 0;
+static unsigned ntags = 0;
+
+/**
+ * FNV-1a hash of a uri or a surrogate key
+ * @param uri
+ */
+static unsigned hash_uri(char* uri) {
+    unsigned h = 2166136261u;
+    while (*uri) {
+        h ^= (unsigned char) *uri++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/**
+ * double the hash table, or create it
+ */
+static void grow_buckets(void) {
+    unsigned n = nbuckets ? nbuckets * 2 : INDEX_BUCKETS;
+    struct cache_block** table = (struct cache_block**)
+                                 Calloc(n, sizeof(struct cache_block*));
+    unsigned i;
+    for (i = 0; i < nbuckets; i++) {
+        struct cache_block* blk = buckets[i];
+        while (blk) {
+            struct cache_block* next = blk->hash_next;
+            unsigned b = hash_uri(blk->uri) & (n - 1);
+            blk->hash_next = table[b];
+            table[b] = blk;
+            blk = next;
+        }
+    }
+    if (buckets)
+        Free(buckets);
+    buckets = table;
+    nbuckets = n;
+}
+
+/**
+ * double the tag table, or create it
+ */
+static void grow_tag_buckets(void) {
+    unsigned n = ntag_buckets ? ntag_buckets * 2 : INDEX_BUCKETS;
+    struct tag_entry** table = (struct tag_entry**)
+                               Calloc(n, sizeof(struct tag_entry*));
+    unsigned i;
+    for (i = 0; i < ntag_buckets; i++) {
+        struct tag_entry* entry = tag_buckets[i];
+        while (entry) {
+            struct tag_entry* next = entry->next;
+            unsigned b = hash_uri(entry->tag) & (n - 1);
+            entry->next = table[b];
+            table[b] = entry;
+            entry = next;
+        }
+    }
+    if (tag_buckets)
+        Free(tag_buckets);
+    tag_buckets = table;
+    ntag_buckets = n;
+}
+
+/**
+ * the entry of a surrogate key
+ * @param tag
+ * @param create: add an empty entry if there is none
+ * @return the link to it, to unlink it, NULL if there is none
+ */
+static struct tag_entry** find_tag(char* tag, int create) {
+    if (create && ntags >= ntag_buckets * 2)
+        grow_tag_buckets();
+    if (!ntag_buckets)
+        return NULL;
+    struct tag_entry** link = &tag_buckets[hash_uri(tag) & (ntag_buckets - 1)];
+    while (*link && strcmp((*link)->tag, tag) != 0)
+        link = &(*link)->next;
+    if (!*link && create) {
+        struct tag_entry* entry = (struct tag_entry*)
+                                  Malloc(sizeof(struct tag_entry));
+        entry->tag = strdup(tag);
+        entry->refs = NULL;
+        entry->next = NULL;
+        *link = entry;
+        ntags++;
+    }
+    return *link ? link : NULL;
+}
+
+/**
+ * enter the surrogate keys of a block into the tag index
+ * @param blk
+ */
+static void add_tags(struct cache_block* blk) {
+    char* list = strdup(blk->tags);
+    char* save;
+    char* tag;
+    for (tag = strtok_r(list, " ", &save); tag;
+         tag = strtok_r(NULL, " ", &save)) {
+        struct tag_entry* entry = *find_tag(tag, 1);
+        struct tag_ref* ref = (struct tag_ref*) Malloc(sizeof(struct tag_ref));
+        ref->blk = blk;
+        ref->entry = entry;
+        ref->prev = NULL;
+        ref->next = entry->refs;
+        if (entry->refs)
+            entry->refs->prev = ref;
+        entry->refs = ref;
+        ref->blk_next = blk->tag_refs;
+        blk->tag_refs = ref;
+    }
+    Free(list);
+}
+
+/**
+ * take a block out of the tag index, dropping keys left without blocks
+ * @param blk
+ */
+static void remove_tags(struct cache_block* blk) {
+    while (blk->tag_refs) {
+        struct tag_ref* ref = blk->tag_refs;
+        struct tag_entry* entry = ref->entry;
+        blk->tag_refs = ref->blk_next;
+        if (ref->prev)
+            ref->prev->next = ref->next;
+        else
+            entry->refs = ref->next;
+        if (ref->next)
+            ref->next->prev = ref->prev;
+        Free(ref);
+        if (!entry->refs) {
+            struct tag_entry** link = find_tag(entry->tag, 0);
+            *link = entry->next;
+            ntags--;
+            Free(entry->tag);
+            Free(entry);
+        }
+    }
+}
+
+/**
+ * a radix node with the given label
+ */
+static struct radix_node* new_node(char* label, int len) {
+    struct radix_node* node = (struct radix_node*)
+                              Malloc(sizeof(struct radix_node));
+    node->label = strndup(label, len);
+    node->len = len;
+    node->refs = 0;
+    node->child = NULL;
+    node->sibling = NULL;
+    return node;
+}
+
+/**
+ * the child of a node whose label starts with c
+ * @return the link to it, to replace or unlink it
+ */
+static struct radix_node** find_child(struct radix_node* node, char c) {
+    struct radix_node** link = &node->child;
+    while (*link && (*link)->label[0] != c)
+        link = &(*link)->sibling;
+    return link;
+}
+
+/**
+ * count one more block with this key, splitting labels as needed
+ * @param key
+ */
+static void radix_insert(char* key) {
+    struct radix_node* node = &root;
+    while (*key) {
+        struct radix_node** link = find_child(node, *key);
+        struct radix_node* child = *link;
+        if (!child) {
+            child = new_node(key, strlen(key));
+            child->refs = 1;
+            *link = child;
+            return;
+        }
+        int common = 0;
+        while (common < child->len && key[common] == child->label[common])
+            common++;
+        if (common < child->len) {
+            // the key leaves the label: split it
+            struct radix_node* mid = new_node(child->label, common);
+            memmove(child->label, child->label + common, child->len - common + 1);
+            child->len -= common;
+            mid->sibling = child->sibling;
+            child->sibling = NULL;
+            mid->child = child;
+            *link = mid;
+            child = mid;
+        }
+        node = child;
+        key += common;
+    }
+    node->refs++;
+}
+
+/**
+ * merge a node without blocks into its only child
+ * @param node
+ */
+static void radix_merge(struct radix_node* node) {
+    struct radix_node* child = node->child;
+    node->label = (char*) Realloc(node->label, node->len + child->len + 1);
+    memcpy(node->label + node->len, child->label, child->len + 1);
+    node->len += child->len;
+    node->refs = child->refs;
+    node->child = child->child;
+    Free(child->label);
+    Free(child);
+}
+
+/**
+ * count one block less with this key, pruning empty nodes
+ * @param node: the subtree below which key is
+ * @param key: rest of the key
+ */
+static void radix_remove(struct radix_node* node, char* key) {
+    struct radix_node** link = find_child(node, *key);
+    struct radix_node* child = *link;
+    if (!child || strncmp(key, child->label, child->len) != 0)
+        return;
+    if (key[child->len])
+        radix_remove(child, key + child->len);
+    else if (child->refs > 0)
+        child->refs--;
+    if (child->refs > 0)
+        return;
+    if (!child->child) {
+        *link = child->sibling;
+        Free(child->label);
+        Free(child);
+    }
+    else if (!child->child->sibling)
+        radix_merge(child);
+}
+
+/**
+ * whether a uri matches a pattern in which * stands for any string
+ * @param pattern
+ * @param uri
+ */
+static int match_wildcard(char* pattern, char* uri) {
+    char* star = NULL;
+    char* resume = NULL;
+    while (*uri) {
+        if (*pattern == '*') {
+            star = ++pattern;
+            resume = uri;
+        }
+        else if (*pattern == *uri) {
+            pattern++;
+            uri++;
+        }
+        else if (star) {
+            pattern = star;
+            uri = ++resume;
+        }
+        else
+            return 0;
+    }
+    while (*pattern == '*')
+        pattern++;
+    return *pattern == '\0';
+}
+
+/**
+ * add the blocks of the keys in a subtree that match a pattern
+ * @param node
+ * @param key: key of node, with room up to MAXLINE
+ * @param len: length of key
+ * @param pattern
+ * @param set
+ */
+static void radix_collect(struct radix_node* node, char* key, int len,
+                          char* pattern, struct block_set* set) {
+    if (len + node->len >= MAXLINE)
+        return;
+    memcpy(key + len, node->label, node->len + 1);
+    len += node->len;
+    if (node->refs > 0 && match_wildcard(pattern, key)) {
+        struct cache_block* blk = NULL;
+        while ((blk = index_find(key, blk)) != NULL)
+            add_to_set(set, blk);
+    }
+    struct radix_node* child;
+    for (child = node->child; child; child = child->sibling)
+        radix_collect(child, key, len, pattern, set);
+}
+
+/**
+ * index a block that is put into the list
+ * notice: need to acquire list_lock
+ * @param blk
+ */
+void index_add(struct cache_block* blk) {
+    if (nblocks >= nbuckets * 2)
+        grow_buckets();
+    unsigned b = hash_uri(blk->uri) & (nbuckets - 1);
+    blk->hash_next = buckets[b];
+    buckets[b] = blk;
+    nblocks++;
+    radix_insert(blk->uri);
+    if (blk->tags)
+        add_tags(blk);
+}
+
+/**
+ * forget a block that is taken out of the list
+ * notice: need to acquire list_lock
+ * @param blk
+ */
+void index_remove(struct cache_block* blk) {
+    if (!nbuckets)
+        return;
+    struct cache_block** link = &buckets[hash_uri(blk->uri) & (nbuckets - 1)];
+    while (*link && *link != blk)
+        link = &(*link)->hash_next;
+    if (!*link)
+        return;
+    *link = blk->hash_next;
+    blk->hash_next = NULL;
+    nblocks--;
+    radix_remove(&root, blk->uri);
+    remove_tags(blk);
+}
+
+/**
+ * find a listed block by uri
+ * notice: need to acquire list_lock
+ * @param uri
+ * @param after: a block returned before to find the next one, or NULL
+ * @return block ptr, NULL if there is none (more)
+ */
+struct cache_block* index_find(char* uri, struct cache_block* after) {
+    if (!nbuckets)
+        return NULL;
+    struct cache_block* blk = after ? after->hash_next :
+                              buckets[hash_uri(uri) & (nbuckets - 1)];
+    while (blk && strcmp(blk->uri, uri) != 0)
+        blk = blk->hash_next;
+    return blk;
+}
+
+/**
+ * find the listed blocks whose uri matches a pattern, in which *
+ * stands for any string; only the subtree of the literal prefix
+ * before the first * is visited
+ * notice: need to acquire list_lock
+ * @param pattern
+ * @param set: the blocks are added to it
+ */
+void index_match(char* pattern, struct block_set* set) {
+    char key[MAXLINE];
+    char* star = strchr(pattern, '*');
+    if (!star) {
+        struct cache_block* blk = NULL;
+        while ((blk = index_find(pattern, blk)) != NULL)
+            add_to_set(set, blk);
+        return;
+    }
+    // walk down to the node whose key covers the literal prefix
+    char* prefix = pattern;
+    int plen = star - pattern;
+    int len = 0;
+    struct radix_node* node = &root;
+    while (plen > 0) {
+        struct radix_node* child = *find_child(node, *prefix);
+        if (!child)
+            return;
+        int n = child->len < plen ? child->len : plen;
+        if (strncmp(child->label, prefix, n) != 0)
+            return;
+        if (n == plen) {
+            // the prefix ends within this label
+            radix_collect(child, key, len, pattern, set);
+            return;
+        }
+        if (len + child->len >= MAXLINE)
+            return;
+        memcpy(key + len, child->label, child->len);
+        len += child->len;
+        prefix += n;
+        plen -= n;
+        node = child;
+    }
+    // the pattern starts with *
+    radix_collect(&root, key, 0, pattern, set);
+}
+
+/**
+ * find the listed blocks tagged with a surrogate key
+ * notice: need to acquire list_lock
+ * @param tag
+ * @param set: the blocks are added to it
+ */
+void index_tag(char* tag, struct block_set* set) {
+    struct tag_entry** link = find_tag(tag, 0);
+    struct tag_ref* ref;
+    if (!link)
+        return;
+    for (ref = (*link)->refs; ref; ref = ref->next)
+        add_to_set(set, ref->blk);
+}
+
+/**
+ * add a block to a set
+ * @param set
+ * @param blk
+ */
+void add_to_set(struct block_set* set, struct cache_block* blk) {
+    if (set->n == set->cap) {
+        set->cap = set->cap ? set->cap * 2 : 16;
+        set->blks = (struct cache_block**) Realloc(set->blks,
+                    set->cap * sizeof(struct cache_block*));
+    }
+    set->blks[set->n++] = blk;
+}
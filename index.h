@@ -0,0 +1,39 @@
+#ifndef __INDEX_H__
+#define __INDEX_H__
+
+#include "cache.h"
+
+/* initial number of hash buckets, doubled as the cache grows */
+#define INDEX_BUCKETS 1024
+
+/* all blocks with one surrogate key */
+struct tag_entry {
+    char* tag;
+    struct tag_ref* refs;
+    struct tag_entry* next;
+};
+
+/* one surrogate key of one block, in the lists of both */
+struct tag_ref {
+    struct cache_block* blk;
+    struct tag_entry* entry;
+    struct tag_ref* prev;
+    struct tag_ref* next;
+    struct tag_ref* blk_next;
+};
+
+/* blocks found by index_match(), Malloc'ed */
+struct block_set {
+    struct cache_block** blks;
+    int n;
+    int cap;
+};
+
+void index_add(struct cache_block* blk);
+void index_remove(struct cache_block* blk);
+struct cache_block* index_find(char* uri, struct cache_block* after);
+void index_match(char* pattern, struct block_set* set);
+void index_tag(char* tag, struct block_set* set);
+void add_to_set(struct block_set* set, struct cache_block* blk);
+
+#endif /* __INDEX_H__ */
@@ -0,0 +1,60 @@
+#!/bin/bash
+#
+# latency.sh - Latency of uncached requests through the proxy, with
+#     delay-shim.py between the proxy and Tiny to stand in for a
+#     network path. Prints the median, mean and 90th percentile of N
+#     requests for 1KB files, and how many of the shim's connections
+#     came with TCP Fast Open. The options are passed to the proxy,
+#     e.g. ./latency.sh --fastopen-connect --nodelay
+#
+#     usage: [N=100] [DELAY=10] ./latency.sh [proxy options]
+#
+
+N=${N:-100}
+DELAY=${DELAY:-10}
+HOME_DIR=`pwd`
+TEST_DIR=`mktemp -d /tmp/latency.XXXXXX`
+BASE_PORT=$((( RANDOM % 60000) + 4500))
+TINY_PORT=${BASE_PORT}
+SHIM_PORT=$((BASE_PORT + 1))
+PROXY_PORT=$((BASE_PORT + 2))
+
+function cleanup {
+    kill ${tiny_pid} ${shim_pid} ${proxy_pid} 2> /dev/null
+    wait 2> /dev/null
+    rm -rf ${TEST_DIR}
+}
+trap cleanup EXIT
+
+if [ ! -x ./proxy ] || [ ! -x ./tiny/tiny ]; then
+    echo "Build the proxy and tiny/tiny first"
+    exit 1
+fi
+
+# Tiny serves 1KB files from the test directory, a new one for each
+# request so that none of them is cached
+for i in `seq 0 ${N}`; do
+    head -c 1024 /dev/zero | tr '\0' 'x' > ${TEST_DIR}/s${i}
+done
+(cd ${TEST_DIR}; exec ${HOME_DIR}/tiny/tiny ${TINY_PORT} &> /dev/null) &
+tiny_pid=$!
+python3 ./delay-shim.py ${SHIM_PORT} ${TINY_PORT} ${DELAY} ${TEST_DIR}/shim.stats &
+shim_pid=$!
+./proxy "$@" --max-object-size=1 ${PROXY_PORT} &> /dev/null &
+proxy_pid=$!
+sleep 1
+
+# The first request gets the fast open cookie
+curl --silent --proxy http://localhost:${PROXY_PORT} \
+    --output /dev/null http://localhost:${SHIM_PORT}/s0
+for i in `seq 1 ${N}`; do
+    curl --silent --proxy http://localhost:${PROXY_PORT} --output /dev/null \
+        --write-out "%{time_total}\n" http://localhost:${SHIM_PORT}/s${i}
+done | sort -n | awk '{ t[NR] = $1 * 1000; sum += t[NR] }
+    END { printf "median %.1f ms  mean %.1f ms  p90 %.1f ms",
+          t[int(NR / 2) + 1], sum / NR, t[int(NR * 0.9)] }'
+
+# The shim writes its counters every second
+sleep 1.1
+read conns fastopen < ${TEST_DIR}/shim.stats
+echo "  (${fastopen}/${conns} fast open)"
@@ -0,0 +1,125 @@
+#include <netinet/tcp.h>
+#include "net.h"
+#include "dns.h"
+
+#ifndef TCP_FASTOPEN_CONNECT
+#define TCP_FASTOPEN_CONNECT 30
+#endif
+
+/*
+ * Socket options of the listener, of client connections and of
+ * connections to servers, from the config. An option the kernel
+ * refuses is reported once and otherwise ignored: the proxy works
+ * without any of them.
+ *
+ * With TCP_FASTOPEN_CONNECT, connect() returns at once and the
+ * request goes out with the SYN if the server gave us a cookie
+ * before; a refused connection then only shows when the request
+ * is written or the response read.
+ */
+
+/**
+ * set an int socket option, complaining once if it fails
+ * @param fd
+ * @param level
+ * @param name
+ * @param value
+ * @param what: the option, for the complaint
+ * @param warned: whether it was complained about already
+ */
+static void set_option(int fd, int level, int name, int value,
+                       char* what, int* warned) {
+    if (setsockopt(fd, level, name, &value, sizeof(value)) < 0 && !*warned) {
+        *warned = 1;
+        fprintf(stderr, "setsockopt %s: %s\n", what, strerror(errno));
+    }
+}
+
+/**
+ * apply the listener options
+ * @param listenfd: from open_listenfd()
+ */
+void tune_listener(int listenfd) {
+    static int warned = 0;
+    // wake up accept() only once the request arrived
+    if (config.defer_accept > 0)
+        set_option(listenfd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                   config.defer_accept, "TCP_DEFER_ACCEPT", &warned);
+    // take requests in the SYN of clients with a cookie
+    if (config.fastopen > 0)
+        set_option(listenfd, IPPROTO_TCP, TCP_FASTOPEN, config.fastopen,
+                   "TCP_FASTOPEN", &warned);
+}
+
+/**
+ * apply the options of an accepted client connection
+ * @param fd
+ */
+void tune_client(int fd) {
+    static int warned = 0;
+    if (config.nodelay)
+        set_option(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY", &warned);
+}
+
+/**
+ * apply the options of a client connection that is kept alive:
+ * the end of a response must not wait for the ACK of the one
+ * before, which the client may delay, so Nagle's algorithm is off
+ * @param fd
+ */
+void keep_client(int fd) {
+    static int warned = 0;
+    if (!config.nodelay)
+        set_option(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY", &warned);
+}
+
+/**
+ * hold back partial segments to a client while it has pipelined
+ * requests waiting, so that their responses share segments; they
+ * are sent once it is uncorked
+ * @param fd
+ * @param on
+ */
+void cork_client(int fd, int on) {
+    static int warned = 0;
+    set_option(fd, IPPROTO_TCP, TCP_CORK, on, "TCP_CORK", &warned);
+}
+
+/**
+ * open a connection to a server, as open_clientfd() does, with the
+ * upstream options set before connecting and its name resolved
+ * through the cache
+ * @param hostname
+ * @param port
+ * @return the socket, -2 if the name does not resolve, -1 if no
+ *         address could be connected to
+ */
+int connect_server(char* hostname, char* port) {
+    static int warned = 0;
+    struct dns_addr addrs[DNS_MAX_ADDRS], *p;
+    int fd = -1, i, n;
+
+    if ((n = dns_lookup(hostname, port, addrs)) < 0)
+        return -2;
+    for (i = 0; i < n; i++) {
+        p = &addrs[i];
+        if ((fd = socket(p->family, p->socktype, p->protocol)) < 0)
+            continue;
+        if (config.nodelay)
+            set_option(fd, IPPROTO_TCP, TCP_NODELAY, 1, "TCP_NODELAY", &warned);
+        // the buffers must be sized before the connection exists
+        if (config.sndbuf > 0)
+            set_option(fd, SOL_SOCKET, SO_SNDBUF, config.sndbuf, "SO_SNDBUF",
+                       &warned);
+        if (config.rcvbuf > 0)
+            set_option(fd, SOL_SOCKET, SO_RCVBUF, config.rcvbuf, "SO_RCVBUF",
+                       &warned);
+        if (config.fastopen_connect)
+            set_option(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, 1,
+                       "TCP_FASTOPEN_CONNECT", &warned);
+        if (connect(fd, (SA*) &p->addr, p->addrlen) != -1)
+            break;
+        Close(fd);
+    }
+    return i < n ? fd : -1;
+}
@@ -0,0 +1,13 @@
+#ifndef __NET_H__
+#define __NET_H__
+
+#include "csapp.h"
+#include "config.h"
+
+void tune_listener(int listenfd);
+void tune_client(int fd);
+void keep_client(int fd);
+void cork_client(int fd, int on);
+int connect_server(char* hostname, char* port);
+
+#endif /* __NET_H__ */
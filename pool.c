@@ -0,0 +1,192 @@
+#include <sys/time.h>
+#include "pool.h"
+#include "config.h"
+#include "net.h"
+#include "timer.h"
+
+/*
+ * Connections to servers are kept open between requests. Once a
+ * response was read to its end and neither side asked to close,
+ * the connection goes into the pool under its host:port, up to
+ * config.pool_size per server and POOL_MAX in all. The next request
+ * for that server takes the most recent idle one instead of
+ * connecting: no DNS lookup, no handshake, and a congestion window
+ * that has grown already.
+ *
+ * An idle connection is checked on checkout, since the server may
+ * have closed it. One idle for longer than config.pool_idle_timeout
+ * is closed, on checkout or by a sweep from the timer wheel. The
+ * server may still close a connection while the request is sent on
+ * it; the caller then sends it again on a new one, see pool_retry().
+ */
+
+struct idle_conn {
+    char key[POOL_KEY_LEN];
+    int fd;
+    // coarse_msec() when it was put in the pool
+    long since;
+};
+
+static struct idle_conn idle[POOL_MAX];
+static int nidle = 0;
+static struct pool_stats stats;
+// this lock protects idle, nidle and stats
+static sem_t pool_lock;
+static struct timer sweep_timer;
+
+/**
+ * drop an idle connection from the pool, the last one takes its place
+ * notice: need to acquire pool_lock
+ */
+static void remove_idle(int i) {
+    idle[i] = idle[--nidle];
+}
+
+static int is_expired(struct idle_conn* c, long now) {
+    return now - c->since >= config.pool_idle_timeout * 1000L;
+}
+
+/**
+ * whether an idle connection can take a request: the server
+ * neither closed it nor sent anything since the last response
+ * @param fd
+ */
+static int is_alive(int fd) {
+    char c;
+    ssize_t n = recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/**
+ * close the idle connections that expired, and sweep again later
+ * the wheel's thread runs this
+ */
+static void sweep(void* arg) {
+    long now = coarse_msec();
+    int i;
+    P(&pool_lock);
+    // backwards, the one moved into a freed slot was looked at
+    for (i = nidle - 1; i >= 0; i--)
+        if (is_expired(&idle[i], now)) {
+            close(idle[i].fd);
+            remove_idle(i);
+            stats.expired++;
+        }
+    V(&pool_lock);
+    timer_add(&sweep_timer, POOL_SWEEP_MS);
+}
+
+/**
+ * prepare the pool
+ * notice: call before starting other threads, after timer_init()
+ */
+void pool_init(void) {
+    Sem_init(&pool_lock, 0, 1);
+    timer_setup(&sweep_timer, sweep, NULL);
+    timer_add(&sweep_timer, POOL_SWEEP_MS);
+}
+
+/**
+ * a connection to a server: the most recent idle one, else a new one
+ * @param hostname
+ * @param port
+ * @param reused: set to whether it came from the pool
+ * @return the socket, or as connect_server()
+ */
+int open_server(char* hostname, char* port, int* reused) {
+    char key[POOL_KEY_LEN];
+    struct timeval start, end;
+    long now = coarse_msec();
+    int i, fd;
+
+    snprintf(key, sizeof(key), "%s:%s", hostname, port);
+    P(&pool_lock);
+    while (1) {
+        int best = -1;
+        for (i = 0; i < nidle; i++)
+            if (strcmp(idle[i].key, key) == 0 &&
+                (best < 0 || idle[i].since > idle[best].since))
+                best = i;
+        if (best < 0)
+            break;
+        int expired = is_expired(&idle[best], now);
+        fd = idle[best].fd;
+        remove_idle(best);
+        if (!expired && is_alive(fd)) {
+            stats.reuses++;
+            V(&pool_lock);
+            *reused = 1;
+            return fd;
+        }
+        close(fd);
+        if (expired)
+            stats.expired++;
+        else
+            stats.stale++;
+    }
+    V(&pool_lock);
+
+    *reused = 0;
+    gettimeofday(&start, NULL);
+    fd = connect_server(hostname, port);
+    gettimeofday(&end, NULL);
+    if (fd >= 0) {
+        P(&pool_lock);
+        stats.connects++;
+        stats.connect_usec += (end.tv_sec - start.tv_sec) * 1000000L +
+                              end.tv_usec - start.tv_usec;
+        V(&pool_lock);
+    }
+    return fd;
+}
+
+/**
+ * keep a connection whose response was read to its end for the
+ * next request to the server
+ * @param hostname
+ * @param port
+ * @param fd
+ * @return 1 if it was pooled, 0 if the caller must close it
+ */
+int pool_put(char* hostname, char* port, int fd) {
+    char key[POOL_KEY_LEN];
+    int i, n = 0;
+
+    snprintf(key, sizeof(key), "%s:%s", hostname, port);
+    P(&pool_lock);
+    for (i = 0; i < nidle; i++)
+        if (strcmp(idle[i].key, key) == 0)
+            n++;
+    if (n >= config.pool_size || nidle == POOL_MAX) {
+        V(&pool_lock);
+        return 0;
+    }
+    strcpy(idle[nidle].key, key);
+    idle[nidle].fd = fd;
+    idle[nidle].since = coarse_msec();
+    nidle++;
+    V(&pool_lock);
+    return 1;
+}
+
+/**
+ * count a reused connection that got no response, the request
+ * goes out again on a new one
+ */
+void pool_retry(void) {
+    P(&pool_lock);
+    stats.reuses--;
+    stats.stale++;
+    V(&pool_lock);
+}
+
+/**
+ * copy the pool counters
+ * @param out
+ */
+void get_pool_stats(struct pool_stats* out) {
+    P(&pool_lock);
+    *out = stats;
+    out->idle = nidle;
+    V(&pool_lock);
+}
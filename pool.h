@@ -0,0 +1,34 @@
+#ifndef __POOL_H__
+#define __POOL_H__
+
+#include "csapp.h"
+
+/* idle connections kept for all servers together */
+#define POOL_MAX 256
+/* host:port of a pooled connection */
+#define POOL_KEY_LEN 272
+/* period of the sweep that closes expired idle connections, in ms */
+#define POOL_SWEEP_MS 1000
+
+/* connections to servers since start */
+struct pool_stats {
+    // requests sent on new connections, and on idle ones reused
+    long connects;
+    long reuses;
+    // idle connections closed: expired, or found closed or with
+    // data on checkout, or reused but got no response
+    long expired;
+    long stale;
+    // connections in the pool now
+    long idle;
+    // time spent connecting, in us
+    long connect_usec;
+};
+
+void pool_init(void);
+int open_server(char* hostname, char* port, int* reused);
+int pool_put(char* hostname, char* port, int fd);
+void pool_retry(void);
+void get_pool_stats(struct pool_stats* stats);
+
+#endif /* __POOL_H__ */
@@ -0,0 +1,326 @@
+#include "prefetch.h"
+
+/* a bounded queue of uris, see sbuf in CS:APP */
+static char queue[PREFETCH_QUEUE][MAXLINE];
+static int front = 0, rear = 0;
+// mutex protects queue, front, rear and stats
+static sem_t mutex, slots, items;
+static struct prefetch_stats stats;
+// fetches a uri into the cache, returns 0 if it was cached already
+static int (*fetch_uri)(char* uri);
+
+static void* prefetch_thread(void* vargp);
+
+/**
+ * start a thread in place of one that an I/O error ended inside
+ * fetch_uri, as the csapp wrappers do, so that one failed prefetch
+ * does not cost a thread for good
+ * a pthread cleanup handler
+ */
+static void replace_thread(void* vargp) {
+    pthread_t tid;
+    P(&mutex);
+    stats.failed++;
+    V(&mutex);
+    if (pthread_create(&tid, NULL, prefetch_thread, NULL) != 0)
+        fprintf(stderr, "prefetch: could not replace a thread\n");
+}
+
+/**
+ * take the next uri off the queue and fetch it
+ */
+static void* prefetch_thread(void* vargp) {
+    char uri[MAXLINE];
+    int fetched;
+    Pthread_detach(pthread_self());
+    while (1) {
+        P(&items);
+        P(&mutex);
+        strcpy(uri, queue[front]);
+        front = (front + 1) % PREFETCH_QUEUE;
+        V(&mutex);
+        V(&slots);
+        pthread_cleanup_push(replace_thread, NULL);
+        fetched = fetch_uri(uri);
+        pthread_cleanup_pop(0);
+        P(&mutex);
+        if (fetched)
+            stats.fetched++;
+        else
+            stats.cached++;
+        V(&mutex);
+    }
+    return NULL;
+}
+
+/**
+ * start the prefetch threads
+ * @param threads
+ * @param fetch: fetches a uri into the cache unless it is cached,
+ *        returns whether it did
+ */
+void prefetch_init(int threads, int (*fetch)(char* uri)) {
+    pthread_t tid;
+    int i;
+    fetch_uri = fetch;
+    Sem_init(&mutex, 0, 1);
+    Sem_init(&slots, 0, PREFETCH_QUEUE);
+    Sem_init(&items, 0, 0);
+    for (i = 0; i < threads; i++)
+        Pthread_create(&tid, NULL, prefetch_thread, NULL);
+}
+
+/**
+ * queue a uri unless it is queued already or the queue is full
+ * @param uri
+ */
+static void enqueue(char* uri) {
+    int i;
+    if (!fetch_uri)
+        return;
+    // never wait for a slot on the request path
+    if (sem_trywait(&slots) < 0) {
+        P(&mutex);
+        stats.dropped++;
+        V(&mutex);
+        return;
+    }
+    P(&mutex);
+    for (i = front; i != rear; i = (i + 1) % PREFETCH_QUEUE)
+        if (strcmp(queue[i], uri) == 0)
+            break;
+    if (i != rear) {
+        V(&mutex);
+        V(&slots);
+        return;
+    }
+    strcpy(queue[rear], uri);
+    rear = (rear + 1) % PREFETCH_QUEUE;
+    stats.queued++;
+    V(&mutex);
+    V(&items);
+}
+
+/**
+ * start scanning a page
+ * @param sc
+ * @param uri: of the page
+ * @param budget: most links queued for it
+ */
+void scan_init(struct link_scanner* sc, char* uri, int budget) {
+    strcpy(sc->base, uri);
+    // http://host[:port]
+    char* slash = strchr(uri + 7, '/');
+    sc->origin_len = slash ? slash - uri : strlen(uri);
+    sc->len = 0;
+    sc->budget = budget;
+    sc->nseen = 0;
+}
+
+/**
+ * make a link absolute, the same way as a browser would
+ * @param sc
+ * @param link
+ * @param uri: at least MAXLINE bytes
+ * @return 0, or -1 if it is not an http link to the page's server
+ */
+static int resolve_link(struct link_scanner* sc, char* link, char* uri) {
+    char* colon = strchr(link, ':');
+    char* slash = strchr(link, '/');
+    int len;
+
+    if (strncasecmp(link, "http://", 7) == 0)
+        len = snprintf(uri, MAXLINE, "%s", link);
+    else if (strncmp(link, "//", 2) == 0)
+        len = snprintf(uri, MAXLINE, "http:%s", link);
+    // another scheme, e.g. https:, mailto: or javascript:
+    else if (colon && (!slash || colon < slash))
+        return -1;
+    else if (link[0] == '/')
+        len = snprintf(uri, MAXLINE, "%.*s%s", sc->origin_len, sc->base, link);
+    else {
+        // relative to the directory of the page
+        int dir = sc->origin_len;
+        char* p;
+        for (p = sc->base + sc->origin_len; *p && *p != '?'; p++)
+            if (*p == '/')
+                dir = p + 1 - sc->base;
+        len = snprintf(uri, MAXLINE, "%.*s%s%s", dir, sc->base,
+                       dir == sc->origin_len ? "/" : "", link);
+    }
+    if (len >= MAXLINE)
+        return -1;
+    // same server: the scheme and authority match the page's
+    if (strncasecmp(uri, sc->base, sc->origin_len) != 0 ||
+        (uri[sc->origin_len] != '/' && uri[sc->origin_len] != '\0'))
+        return -1;
+    return 0;
+}
+
+/**
+ * queue one link of the page, within its budget
+ * @param sc
+ * @param value: the link, not NUL terminated
+ * @param len: length of value
+ */
+static void add_link(struct link_scanner* sc, char* value, int len) {
+    char link[MAXLINE], uri[MAXLINE];
+    int i;
+    while (len > 0 && isspace((unsigned char) *value)) {
+        value++;
+        len--;
+    }
+    if (sc->budget <= 0 || len <= 0 || len >= MAXLINE)
+        return;
+    memcpy(link, value, len);
+    link[len] = '\0';
+    // the fragment is not sent to servers
+    char* hash = strchr(link, '#');
+    if (hash)
+        *hash = '\0';
+    if (!link[0] || resolve_link(sc, link, uri) < 0 ||
+        strcmp(uri, sc->base) == 0)
+        return;
+    unsigned h = 2166136261u;
+    for (i = 0; uri[i]; i++)
+        h = (h ^ (unsigned char) uri[i]) * 16777619u;
+    for (i = 0; i < sc->nseen; i++)
+        if (sc->seen[i] == h)
+            return;
+    if (sc->nseen < MAX_PREFETCH_BUDGET)
+        sc->seen[sc->nseen++] = h;
+    sc->budget--;
+    enqueue(uri);
+}
+
+/**
+ * length of a src= or href= attribute name at p
+ * @param p
+ * @param n: bytes available at p
+ * @return length including the =, 0 if there is none,
+ *         -1 if more bytes are needed to tell
+ */
+static int match_attr(char* p, int n) {
+    static char* names[] = { "src=", "href=" };
+    int i, more = 0;
+    for (i = 0; i < 2; i++) {
+        int len = strlen(names[i]);
+        if (n >= len && strncasecmp(p, names[i], len) == 0)
+            return len;
+        if (n < len && strncasecmp(p, names[i], n) == 0)
+            more = 1;
+    }
+    return more ? -1 : 0;
+}
+
+/**
+ * queue the links of the buffered body
+ * @param sc
+ * @return number of bytes scanned, the rest must be kept
+ */
+static int scan_links(struct link_scanner* sc) {
+    char* buf = sc->buf;
+    int len = sc->len;
+    int i = 0;
+    while (i < len) {
+        // attributes follow white space
+        if (i > 0 && !isspace((unsigned char) buf[i - 1])) {
+            i++;
+            continue;
+        }
+        int alen = match_attr(buf + i, len - i);
+        if (alen < 0)
+            return i;
+        if (alen == 0) {
+            i++;
+            continue;
+        }
+        int start = i, j = i + alen, end;
+        if (j >= len)
+            return start;
+        char quote = buf[j];
+        if (quote == '"' || quote == '\'') {
+            char* close = memchr(buf + j + 1, quote, len - j - 1);
+            if (!close)
+                return start;
+            j++;
+            end = close - buf;
+        }
+        else {
+            for (end = j; end < len && !isspace((unsigned char) buf[end]) &&
+                 buf[end] != '>'; end++)
+                ;
+            if (end == len)
+                return start;
+        }
+        add_link(sc, buf + j, end - j);
+        i = end;
+    }
+    return len;
+}
+
+/**
+ * scan the next bytes of an HTML body for src and href links
+ * @param sc
+ * @param data
+ * @param len
+ */
+void scan_html(struct link_scanner* sc, char* data, int len) {
+    while (len > 0 && sc->budget > 0) {
+        int n = sizeof(sc->buf) - sc->len;
+        if (n > len)
+            n = len;
+        memcpy(sc->buf + sc->len, data, n);
+        sc->len += n;
+        data += n;
+        len -= n;
+        int done = scan_links(sc);
+        // a value longer than the buffer is not a link we want
+        if (done == 0 && sc->len == sizeof(sc->buf))
+            done = sc->len;
+        memmove(sc->buf, sc->buf + done, sc->len - done);
+        sc->len -= done;
+    }
+}
+
+/**
+ * queue the preloads of a Link header, e.g.
+ * </style.css>; rel=preload; as=style, </app.js>; rel="preload"
+ * @param sc
+ * @param value: header value
+ */
+void scan_link_header(struct link_scanner* sc, char* value) {
+    char* p = value;
+    while ((p = strchr(p, '<')) != NULL) {
+        char* close = strchr(p, '>');
+        if (!close)
+            return;
+        // the parameters of this link end at the next one
+        char* next = strchr(close, '<');
+        char params[MAXLINE];
+        int n = next ? next - close : (int) strlen(close);
+        if (n >= MAXLINE)
+            n = MAXLINE - 1;
+        memcpy(params, close, n);
+        params[n] = '\0';
+        char* rel = strstr(params, "rel=");
+        if (rel && (strncasecmp(rel + 4, "preload", 7) == 0 ||
+                    strncasecmp(rel + 4, "\"preload", 8) == 0))
+            add_link(sc, p + 1, close - p - 1);
+        p = close;
+    }
+}
+
+/**
+ * copy the prefetch counters
+ * @param out
+ */
+void get_prefetch_stats(struct prefetch_stats* out) {
+    if (!fetch_uri) {
+        memset(out, 0, sizeof(*out));
+        return;
+    }
+    P(&mutex);
+    *out = stats;
+    V(&mutex);
+}
@@ -0,0 +1,41 @@
+#ifndef __PREFETCH_H__
+#define __PREFETCH_H__
+
+#include "csapp.h"
+#include "config.h"
+
+/* uris waiting for a prefetch thread, more are dropped */
+#define PREFETCH_QUEUE 64
+
+/* finds the links of an HTML page while it is relayed and queues
+   those on the page's server for prefetching */
+struct link_scanner {
+    // uri of the page, and its scheme and authority
+    char base[MAXLINE];
+    int origin_len;
+    // unscanned rest of the body, a link may be split across chunks
+    char buf[MAXLINE];
+    int len;
+    // links that may still be queued, and hashes of those queued
+    int budget;
+    unsigned seen[MAX_PREFETCH_BUDGET];
+    int nseen;
+};
+
+/* prefetches since start */
+struct prefetch_stats {
+    long queued;
+    long dropped;
+    long fetched;
+    long cached;
+    // ended by an I/O error
+    long failed;
+};
+
+void prefetch_init(int threads, int (*fetch)(char* uri));
+void scan_init(struct link_scanner* sc, char* uri, int budget);
+void scan_html(struct link_scanner* sc, char* data, int len);
+void scan_link_header(struct link_scanner* sc, char* value);
+void get_prefetch_stats(struct prefetch_stats* stats);
+
+#endif /* __PREFETCH_H__ */
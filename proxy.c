@@ -6,11 +6,24 @@
  */
 #include "csapp.h"
 #include "cache.h"
+#include "config.h"
+#include "compress.h"
+#include "range.h"
+#include "segment.h"
+#include "admin.h"
+#include "prefetch.h"
+#include "arena.h"
+#include "timer.h"
+#include "stats.h"
+#include "relay.h"
+#include "net.h"
+#include "tunnel.h"
+#include "pool.h"
+#include "dns.h"
 
+/* send_request() got no response from the server */
+#define NO_RESPONSE -3
 
-/* Recommended max cache and object sizes */
-#define MAX_CACHE_SIZE 1049000
-#define MAX_OBJECT_SIZE 102400
 
 /* You won't lose style points for including these long lines in your code */
 static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
@@ -23,8 +36,39 @@ typedef struct {
 	struct sockaddr_storage socket_addr;
 } thread_args;
 
+/* a parsed client request */
+typedef struct {
+	char uri[MAXLINE];
+	char hostname[MAXLINE];
+	char port[10];
+	char filename[MAXLINE];
+	/* client headers to forward, NULL for background requests */
+	char* headers;
+	int headers_len;
+	/* the client takes Content-Encoding: gzip */
+	int accept_gzip;
+	/* Range and If-Range values, empty if absent */
+	char range[MAXLINE];
+	char if_range[MAXLINE];
+	/* ranges to answer from the cached object, see parse_range() */
+	struct byte_range ranges[MAX_RANGES];
+	int nranges;
+	/* times out the connections of the request */
+	struct watchdog* wd;
+	/* the client may send another request on the connection: it
+	   wants to, and the response was delimited and sent in full */
+	int keep_alive;
+} request_t;
+
+typedef struct {
+	/* request without client headers */
+	request_t req;
+	/* the block being refreshed, pinned */
+	struct cache_block* stale;
+} refresh_args;
+
 /* total cache size */
-int cache_size = 0;
+long cache_size = 0;
 
 /* the head of cache list */
 struct cache_block* head;
@@ -34,8 +78,32 @@ struct cache_block* head;
 */
 sem_t list_lock;
 
-void serve(int fd);
+int serve(int fd, rio_t *rio_to_client, struct watchdog *wd);
 int parse_uri(char *uri, char *hostname, char* port, char *filename);
+int is_hop_header(char *buf);
+void serve_cache(int fd, struct cache_block* blk, request_t *req);
+void serve_segments(int fd, struct cache_block* desc, request_t *req);
+long body_length(struct cache_block* blk, request_t *req);
+int fetch_segments(request_t *req, struct cache_block* desc,
+		long first, long last, int to_client_fd, long from, long to);
+void set_ranges(request_t *req, struct cache_block* blk);
+int store_fragment(struct cache_block* blk, struct http_meta* meta,
+		long size, struct cache_block* stale);
+int fetch(request_t *req, int to_client_fd, struct cache_block* stale);
+void refresh_cache(request_t *req, struct cache_block* stale);
+int prefetch_uri(char *uri);
+void *refresh_thread(void *vargp);
+void finish_refresh(void *vargp);
+void clienterror(int fd, int keep_alive,
+		char *errnum, char *shortmsg, char *longmsg);
+void format_error(char *buf, char *body,
+		char *errnum, char *shortmsg, char *longmsg);
+struct cache_block* add_server_failure(char *server_key, int rc);
+int send_request(request_t *req, rio_t *rio, struct head_buf *hb, char *buf);
+void close_server(request_t *req, int fd);
+void release_server(request_t *req, int fd, rio_t *rio, int reusable);
+void stop_watchdog(void *vargp);
+void unpin_block(void *vargp);
 void *thread (void *vargp);
 void sigsegv_handler(int sig);
 
@@ -45,16 +113,26 @@ int main(int argc, char **argv)
 	char hostname[MAXLINE], port[MAXLINE];
 
 	/* Check command line args */
-	if (argc != 2) {
-		fprintf(stderr, "usage: %s <port>\n", argv[0]);
-		exit(1);
-	}
+	parse_config(argc, argv);
+	timer_init();
+	stats_init(config.stats_interval);
 
-	listenfd = Open_listenfd(argv[1]);
+	listenfd = Open_listenfd(config.port);
+	tune_listener(listenfd);
 	Sem_init(&list_lock, 0, 1);
 	// init cache's head node
 	head = (struct cache_block*) malloc(sizeof(struct cache_block));
 	init_cache(head);
+	if (config.arena)
+		arena_init(config.max_cache_size, config.arena_prefault,
+			config.arena_mlock, config.sendfile);
+	if (config.zerocopy)
+		arena_zerocopy(1);
+	if (config.prefetch > 0)
+		prefetch_init(config.prefetch, prefetch_uri);
+	relay_init();
+	pool_init();
+	dns_init();
 
 	// block sigpipe
 	Signal(SIGPIPE, SIG_IGN);
@@ -73,6 +151,7 @@ int main(int argc, char **argv)
 
 		args_ptr->fd = Accept(listenfd, 
 			(SA *)&args_ptr->socket_addr, &clientlen);
+		tune_client(args_ptr->fd);
 		
 		if (getnameinfo((SA *) &args_ptr->socket_addr, 
 			clientlen, hostname, MAXLINE, port, MAXLINE, 0) != 0) {
@@ -90,18 +169,58 @@ int main(int argc, char **argv)
 
 void *thread (void *vargp) {
 	thread_args args;
+	struct watchdog wd;
+	rio_t rio_to_client;
+	int served = 1, corked = 0;
 	args = *((thread_args *) vargp);
 	Pthread_detach(pthread_self());
 	// handle segment fault: it is sometimes weird
 	Signal(SIGSEGV, sigsegv_handler);
-	// Valar Dohaeris
-	serve(args.fd);
+	watchdog_start(&wd, args.fd, config.idle_timeout * 1000L);
+	// an I/O error ends the thread, the watchdog must not outlive it
+	pthread_cleanup_push(stop_watchdog, &wd);
+	count_stat(STAT_CLIENTS, 1);
+	// Valar Dohaeris: requests are answered one by one, in order,
+	// the buffer keeps the pipelined ones that were read already
+	Rio_readinitb(&rio_to_client, args.fd);
+	while (serve(args.fd, &rio_to_client, &wd) &&
+			served++ < config.keepalive_requests) {
+		if (served == 2)
+			keep_client(args.fd);
+		// responses to pipelined requests go out back to back,
+		// the last one when the client has nothing more pending
+		if ((rio_to_client.rio_cnt > 0) != corked)
+			cork_client(args.fd, corked = !corked);
+		watchdog_set(&wd, config.keepalive_timeout * 1000L);
+	}
+	pthread_cleanup_pop(1);
 	// Valar Morghulis
 	Close(args.fd);
 	Free(vargp);
 	return NULL;
 }
 
+/*
+ * stop_watchdog - stop the watchdog of a connection, as a
+ *     pthread cleanup handler
+ */
+void stop_watchdog(void *vargp)
+{
+	watchdog_stop((struct watchdog *) vargp);
+}
+
+/*
+ * unpin_block - release the block a variable points to, if any, as
+ *     a pthread cleanup handler: an I/O error may end the thread
+ *     while it holds the pin
+ */
+void unpin_block(void *vargp)
+{
+	struct cache_block **blk = (struct cache_block **) vargp;
+	if (*blk)
+		sub_reading_cnt(*blk);
+}
+
 /**
  * segment fault signal handler
  */
@@ -113,156 +232,647 @@ void sigsegv_handler(int sig) {
 
 /*
  * serve - handle one HTTP request/response transaction
+ *     The client has the idle timeout to send its first request,
+ *     the keep-alive timeout for the next ones, then the I/O
+ *     timeout applies to both connections.
+ *     Returns whether the client may send another request: an
+ *     HTTP/1.1 client unless it asks to close, an HTTP/1.0 one
+ *     if it asks to keep the connection, and only after a
+ *     response delimited by its length.
  */
-void serve(int to_client_fd)
+int serve(int to_client_fd, rio_t *rio_to_client, struct watchdog *wd)
 {
-	char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-	char filename[MAXLINE], hostname[MAXLINE];
-	char port[10];
-	rio_t rio_to_client;
-	rio_t rio_to_server;
-	int to_server_fd;
+	char buf[MAXLINE], method[MAXLINE], version[MAXLINE];
+	char *line;
+	request_t req;
+	ssize_t n;
 
-	/* Read request line and headers */
-	Rio_readinitb(&rio_to_client, to_client_fd);
-	Rio_readlineb(&rio_to_client, buf, MAXLINE);
-	sscanf(buf, "%s %s %s", method, uri, version);
+	/* Read request line and headers, the client may have closed
+	   a kept-alive connection instead */
+	if (Rio_readlineb(rio_to_client, buf, MAXLINE) <= 0)
+		return 0;
+	version[0] = '\0';
+	sscanf(buf, "%s %s %s", method, req.uri, version);
+	req.keep_alive = strcasecmp(version, "HTTP/1.1") == 0;
+
+	/* PURGE, and requests for the proxy itself */
+	if (is_admin_request(method, req.uri)) {
+		serve_admin(to_client_fd, rio_to_client, method, req.uri,
+			req.keep_alive);
+		return req.keep_alive;
+	}
+
+	/* CONNECT host:port, the connection becomes a tunnel */
+	if (strcasecmp(method, "CONNECT") == 0) {
+		serve_tunnel(to_client_fd, rio_to_client, req.uri, wd);
+		return 0;
+	}
 
 	/* if not GET method, ignore it */
 	if (strcasecmp(method, "GET")) {
-		return;
+		return 0;
 	}
 
 	/* Parse URI from GET request */
-	parse_uri(uri, hostname, port, filename);
+	parse_uri(req.uri, req.hostname, req.port, req.filename);
 	// strange display error in csapp page
-	if (strcasecmp(hostname, "csapp.cs.cmu.edu") == 0) {
-		return;
+	if (strcasecmp(req.hostname, "csapp.cs.cmu.edu") == 0) {
+		return 0;
 	}
 
-	sprintf(buf, "%s %s %s\r\n", "GET", filename, "HTTP/1.0");
-
-	/* search content in cache list */
-	struct cache_block* ptr = search_cache(head, uri);
+	/* read http headers from client, they are forwarded on a miss;
+	   the lines are read in place and copied once, into req.headers */
+	req.headers = NULL;
+	req.headers_len = 0;
+	req.accept_gzip = 0;
+	req.range[0] = req.if_range[0] = '\0';
+	req.nranges = 0;
+	req.wd = wd;
+	while ((n = Rio_nextlineb(rio_to_client, &line)) > 0 &&
+			strcmp(line, "\r\n") != 0) {
+		if (strncasecmp(line, "Accept-Encoding:", 16) == 0)
+			req.accept_gzip = accepts_coding(line + 16, "gzip");
+		else if (strncasecmp(line, "Connection:", 11) == 0 ||
+				strncasecmp(line, "Proxy-Connection:", 17) == 0) {
+			if (has_token(strchr(line, ':') + 1, "close"))
+				req.keep_alive = 0;
+			else if (has_token(strchr(line, ':') + 1, "keep-alive"))
+				req.keep_alive = 1;
+		}
+		else if (strncasecmp(line, "Range:", 6) == 0)
+			strcpy(req.range, line + 6);
+		else if (strncasecmp(line, "If-Range:", 9) == 0)
+			strcpy(req.if_range, line + 9);
+		req.headers = (char*) Realloc(req.headers, req.headers_len + n);
+		memcpy(req.headers + req.headers_len, line, n);
+		req.headers_len += n;
+	}
+	watchdog_set(wd, config.io_timeout * 1000L);
 
-	/* cache found, directly send to client */
-	if (ptr) {
-		// add the number of existing threads reading
-		add_reading_cnt(ptr);
-		// send cache to client
-		Rio_writen(to_client_fd, ptr->file, ptr->size);
-		// subtract the number of existing threads reading
+	/* search content in cache list, the found block is pinned
+	   until the response was sent, even if that fails */
+	struct cache_block* ptr = search_cache(head, req.uri);
+	pthread_cleanup_push(unpin_block, &ptr);
+	/* segments are only served through their descriptor */
+	if (ptr && ptr->segment) {
 		sub_reading_cnt(ptr);
-		// update timestamp and reorder LRU list
-		update_timestamp(head, ptr);
+		ptr = NULL;
+	}
+	/* a partial block only serves ranges it holds */
+	if (ptr)
+		set_ranges(&req, ptr);
+	int usable = ptr && covers_ranges(ptr, req.ranges, req.nranges);
 
-		return;
+	/* fresh cache found, directly send to client */
+	if (usable && is_fresh(ptr)) {
+		serve_cache(to_client_fd, ptr, &req);
+		count_request(req.hostname, req.port, 1, body_length(ptr, &req));
 	}
 
-	/* cache not found, connect with server */
-	to_server_fd = Open_clientfd(hostname, port);
-	Rio_readinitb(&rio_to_server, to_server_fd);
-	// send request line: GET HTTP/1.0
-	Rio_writen(to_server_fd, buf, strlen(buf));
-	// send host to server
-	sprintf(buf, "Host: %s\r\n", hostname);
-	Rio_writen(to_server_fd, buf, strlen(buf));
-
-	
-	/* read http headers from client and write to server */
-	Rio_readlineb(&rio_to_client, buf, MAXLINE);
-	while (strncmp(buf, "\r\n", MAXLINE) != 0) {
-		if (strstr(buf, "User-Agent"))
-			strncpy(buf, user_agent_hdr, MAXLINE);
-		else if (strstr(buf, "Connection"))
-			strncpy(buf, "Connection: close\r\n", MAXLINE);
-		else if (strstr(buf, "Proxy-Connection"))
-			strncpy(buf, "Proxy-Connection: close\r\n", MAXLINE);
-		else if (strstr(buf, "Host")) {
-			// ignore, because we already sent one
-			Rio_readlineb(&rio_to_client, buf, MAXLINE);
-			continue;
+	/* stale but within stale-while-revalidate:
+	   send it now and let one background thread refresh it */
+	else if (usable && can_serve_stale(ptr)) {
+		serve_cache(to_client_fd, ptr, &req);
+		count_request(req.hostname, req.port, 1, body_length(ptr, &req));
+		if (start_refresh(ptr))
+			refresh_cache(&req, ptr);
+	}
+
+	/* cache not found or stale, ask the server */
+	else if (fetch(&req, to_client_fd, ptr) < 0) {
+		/* server failed, stale-if-error allows the stale block */
+		serve_cache(to_client_fd, ptr, &req);
+		count_request(req.hostname, req.port, 1, body_length(ptr, &req));
+	}
+
+	pthread_cleanup_pop(1);
+	if (req.headers)
+		Free(req.headers);
+	return req.keep_alive;
+}
+
+/*
+ * fetch - send a request to the server and read its response
+ *     into the cache. The response is also sent to the client
+ *     unless to_client_fd is -1; the client's headers are forwarded
+ *     unless req->headers is NULL. With a stale block, the request
+ *     is conditional and a 304 refreshes the block.
+ *
+ *     A server that could not be resolved or reached is remembered
+ *     in a negative block keyed by host:port, which answers for it
+ *     until it expires.
+ *
+ *     Returns the status of the response, or -1 if the server could
+ *     not be reached or failed while stale-if-error allows the stale
+ *     block; nothing was sent to the client in that case.
+ */
+int fetch(request_t *req, int to_client_fd, struct cache_block* stale)
+{
+	char buf[MAXLINE];
+	char server_key[MAXLINE + 16];
+	rio_t rio_to_server;
+	int to_server_fd = -1;
+	/* the stale block may stand in for the response */
+	int servable = stale && covers_ranges(stale, req->ranges, req->nranges);
+
+	/* the server failed recently: do not connect again */
+	snprintf(server_key, sizeof(server_key), "%s:%s", req->hostname, req->port);
+	struct cache_block* failure = search_cache(head, server_key);
+	if (failure && !is_fresh(failure)) {
+		sub_reading_cnt(failure);
+		failure = NULL;
+	}
+
+	/* the request is assembled and sent with one write; with
+	   the pool, the connection is kept for the next request */
+	struct head_buf hb;
+	head_buf_init(&hb);
+	head_buf_printf(&hb, "GET %s HTTP/1.%d\r\n", req->filename,
+		config.pool_size > 0);
+	head_buf_printf(&hb, "Host: %s\r\n", req->hostname);
+
+	/* a stale block is revalidated or replaced as a whole,
+	   ranges are only forwarded to fill a partial block or
+	   for several ranges of a segmented one */
+	int whole = stale && !stale->partial &&
+		!(stale->segmented && req->nranges > 1);
+	int revalidate = whole && (stale->etag || stale->last_modified);
+
+	/* forward the client's http headers to server */
+	if (req->headers) {
+		char* line = req->headers;
+		char* end = req->headers + req->headers_len;
+		while (line < end) {
+			char* eol = memchr(line, '\n', end - line);
+			int len = eol ? eol + 1 - line : end - line;
+			memcpy(buf, line, len);
+			buf[len] = '\0';
+			line += len;
+			if (strstr(buf, "User-Agent"))
+				head_buf_add(&hb, user_agent_hdr, strlen(user_agent_hdr));
+			else if (is_hop_header(buf))
+				// the connection to the server is the proxy's own
+				continue;
+			else if (strstr(buf, "Host") ||
+					strncasecmp(buf, "If-None-Match:", 14) == 0 ||
+					strncasecmp(buf, "If-Modified-Since:", 18) == 0 ||
+					(whole && (strncasecmp(buf, "Range:", 6) == 0 ||
+						strncasecmp(buf, "If-Range:", 9) == 0))) {
+				// ignore Host, because we already sent one, and the
+				// client's validators, because we want a full response
+				continue;
+			}
+			else
+				head_buf_add(&hb, line - len, len);
 		}
-		Rio_writen(to_server_fd, buf, strlen(buf));
-		Rio_readlineb(&rio_to_client, buf, MAXLINE);
 	}
+	else {
+		/* background request, there is no client */
+		head_buf_add(&hb, user_agent_hdr, strlen(user_agent_hdr));
+	}
+	head_buf_printf(&hb, "Connection: %s\r\n",
+		config.pool_size > 0 ? "keep-alive" : "close");
+	/* stale cache: ask the server whether it is still valid */
+	if (revalidate && stale->etag)
+		head_buf_printf(&hb, "If-None-Match: %s\r\n", stale->etag);
+	if (revalidate && stale->last_modified)
+		head_buf_printf(&hb, "If-Modified-Since: %s\r\n", stale->last_modified);
 	/* terminates request headers */
-	Rio_writen(to_server_fd, "\r\n", 2);
-
-
-	/* read http response from server and write to client */
-	memset(buf, 0, MAXLINE);
-	Rio_readlineb(&rio_to_server, buf, MAXLINE);
-	int content_len = 0;
-	
-	while (strncmp(buf, "\r\n", MAXLINE) != 0) {
-		char* ptr = strstr(buf, "Content-length");
-		if (ptr) {
-			content_len = atoi(ptr + 16);
+	head_buf_add(&hb, "\r\n", 2);
+
+	/* send it and read the status line, unless the server failed
+	   recently */
+	if (!failure && (to_server_fd = send_request(req, &rio_to_server,
+			&hb, buf)) < 0 && to_server_fd != NO_RESPONSE)
+		failure = add_server_failure(server_key, to_server_fd);
+	head_buf_free(&hb);
+
+	if (to_server_fd < 0 && to_server_fd != NO_RESPONSE) {
+		int status = servable && can_serve_stale_on_error(stale) ? -1 : 502;
+		pthread_cleanup_push(unpin_block, &failure);
+		if (status > 0 && to_client_fd >= 0) {
+			count_request(req->hostname, req->port, 0, 0);
+			/* the error answers the whole request, not its ranges */
+			req->nranges = 0;
+			if (failure)
+				serve_cache(to_client_fd, failure, req);
+			else
+				clienterror(to_client_fd, req->keep_alive, "502",
+					"Bad Gateway", "Proxy could not connect to the server");
 		}
-		//printf("write2: %s\n", uri);
-		//printf("fd: %d\n", to_client_fd);
-		//printf("%d: %s\n", strlen(buf), buf);
-		Rio_writen(to_client_fd, buf, strlen(buf));
-		memset(buf, 0, MAXLINE);
-		Rio_readlineb(&rio_to_server, buf, MAXLINE);
+		pthread_cleanup_pop(1);
+		return status;
 	}
-	/* terminates response headers */
-	Rio_writen(to_client_fd, "\r\n", 2);
+	if (to_server_fd == NO_RESPONSE) {
+		if (servable && can_serve_stale_on_error(stale))
+			return -1;
+		if (to_client_fd >= 0) {
+			count_request(req->hostname, req->port, 0, 0);
+			clienterror(to_client_fd, req->keep_alive, "502",
+				"Bad Gateway", "Proxy got no response from the server");
+		}
+		return 502;
+	}
+
+	/* parse status line */
+	struct http_meta meta;
+	ssize_t n = strlen(buf);
+	init_meta(&meta);
+	meta.status = parse_status_line(buf);
+	meta.keep_alive = strncmp(buf, "HTTP/1.1", 8) == 0;
 
-	int size = 0;
-	int need_cache = 0;
-	/* shall we cache it? */
-	if (content_len < MAX_OBJECT_SIZE)
-		need_cache = 1;
+	/* server error: the caller serves the stale block instead */
+	if (meta.status >= 500 && servable && can_serve_stale_on_error(stale)) {
+		close_server(req, to_server_fd);
+		return -1;
+	}
+
+	/* not modified: refresh the stored head, the body stays */
+	if (revalidate && meta.status == 304) {
+		// readers of stale keep the old version until it is replaced
+		struct cache_block* blk = clone_cache(stale);
+		while ((n = Rio_readlineb(&rio_to_server, buf, MAXLINE)) > 0 &&
+				strcmp(buf, "\r\n") != 0) {
+			if (!is_hop_header(buf) && !is_tag_header(buf) &&
+					strncasecmp(buf, "Age:", 4) != 0 &&
+					strncasecmp(buf, "Content-Length:", 15) != 0)
+				replace_head_field(blk, buf, n);
+			parse_header(&meta, buf);
+		}
+		// new surrogate keys replace the old ones
+		if (meta.tags[0]) {
+			if (blk->tags)
+				Free(blk->tags);
+			blk->tags = strdup(meta.tags);
+		}
+		refresh_freshness(blk, coarse_time() - meta.age);
+		// the 304 describes the identity variant, whose ETag
+		// refresh_freshness() took
+		if (blk->plain_head)
+			mark_gzip_variant(blk);
+		// pin it until it is sent, it may be evicted once listed
+		add_reading_cnt(blk);
+		store_cache(head, blk, config.max_cache_size);
+		pthread_cleanup_push(unpin_block, &blk);
+		if (to_client_fd >= 0) {
+			serve_cache(to_client_fd, blk, req);
+			count_stat(STAT_REVALIDATED, 1);
+			count_request(req->hostname, req->port, 1, body_length(blk, req));
+		}
+		pthread_cleanup_pop(1);
+		release_server(req, to_server_fd, &rio_to_server, meta.keep_alive);
+		return 200;
+	}
+
+	/* the links of an HTML page are prefetched while it is relayed */
+	struct link_scanner* scan = NULL;
+	if (config.prefetch > 0 && to_client_fd >= 0 && meta.status == 200) {
+		scan = (struct link_scanner*) Malloc(sizeof(struct link_scanner));
+		scan_init(scan, req->uri, config.prefetch_budget);
+	}
 
 	/* init a new cache block */
 	struct cache_block* blk = (struct cache_block*) 
-								malloc(sizeof(struct cache_block));
+								Malloc(sizeof(struct cache_block));
 	init_cache(blk);
-	strncpy(blk->uri, uri, MAXLINE);
+	strcpy(blk->uri, req->uri);
 
-	if (content_len > 0)
-		blk->file = (char*) malloc(sizeof(char) * content_len);
+	/* read http response from server and write to client,
+	   a 206 is stored as a part of the whole object */
+	int need_cache;
+	if (meta.status == 206)
+		need_cache = append_head(blk, "HTTP/1.0 200 OK\r\n", 17,
+			config.segment_size) == 0;
 	else
-		blk->file = (char*) malloc(sizeof(char) * MAX_OBJECT_SIZE);
+		need_cache = append_head(blk, buf, n, config.segment_size) == 0;
+	/* the head for the client is assembled like the request */
+	head_buf_add(&hb, buf, n);
 
-	memset(buf, 0, MAXLINE);
-	int total_size = 0;
-	char* headptr = blk->file;
+	while ((n = Rio_readlineb(&rio_to_server, buf, MAXLINE)) > 0 &&
+			strcmp(buf, "\r\n") != 0) {
+		parse_header(&meta, buf);
+		if (scan && strncasecmp(buf, "Link:", 5) == 0)
+			scan_link_header(scan, buf + 5);
+		// surrogate keys are for this cache only
+		if (is_tag_header(buf))
+			continue;
+		// hop-by-hop headers and the length are not stored,
+		// finish_head() writes the real length once it is known
+		if (strncasecmp(buf, "Content-Length:", 15) != 0 &&
+				strncasecmp(buf, "Content-Range:", 14) != 0 &&
+				strncasecmp(buf, "Age:", 4) != 0 &&
+				!is_hop_header(buf) && need_cache &&
+				append_head(blk, buf, n, config.segment_size) < 0)
+			need_cache = 0;
+		// the connection to the client is the proxy's own, and
+		// it gets the body without the chunked encoding
+		if (is_hop_header(buf))
+			continue;
+		head_buf_add(&hb, buf, n);
+	}
 
-	/* read response contents and write to client */
-	while ((size = Rio_readnb(&rio_to_server, buf, MAXLINE)) > 0) {
+	/* the body ends where its framing says, not at EOF; a chunked
+	   one has no length up front */
+	struct body_framer bf;
+	init_framer(&bf, &meta);
+	/* nothing of a response whose end is unknown is passed on, a
+	   stale copy may do instead */
+	if (bf.framing == BODY_INVALID) {
+		if (scan)
+			Free(scan);
+		head_buf_free(&hb);
+		free_cache_node(blk);
+		close_server(req, to_server_fd);
+		if (servable && can_serve_stale_on_error(stale))
+			return -1;
+		if (to_client_fd >= 0) {
+			count_request(req->hostname, req->port, 0, 0);
+			clienterror(to_client_fd, req->keep_alive, "502",
+				"Bad Gateway",
+				"Proxy got an invalid Content-Length from the server");
+		}
+		return 502;
+	}
+	/* a body that is not delimited by its length goes to the
+	   client up to the close, a chunked one as well once decoded */
+	if (bf.framing == BODY_CLOSE || bf.framing == BODY_CHUNKED)
+		req->keep_alive = 0;
+	/* terminates response headers */
+	head_buf_printf(&hb, "Connection: %s\r\n\r\n",
+		req->keep_alive ? "keep-alive" : "close");
+	if (scan && (meta.content_encoded ||
+			strncasecmp(meta.content_type, "text/html", 9) != 0)) {
+		Free(scan);
+		scan = NULL;
+	}
+
+	/* shall we cache it? errors are cached briefly, but a 5xx
+	   must not replace a stale copy of the object */
+	long content_len = meta.content_len;
+	long limit = object_size_limit(req->uri);
+	int negative = is_negative_status(meta.status) && config.negative_ttl > 0 &&
+		(meta.status < 500 || !stale);
+	/* a part of a small object is merged into a partial block,
+	   the segments a part of a large object holds are kept */
+	int fragment = meta.status == 206 && meta.range_total > 0 &&
+		meta.range_total <= config.segment_size && meta.range_total <= limit;
+	int segmented = meta.status == 206 &&
+		meta.range_total > config.segment_size && meta.range_total <= limit;
+	if ((meta.status != 200 && !negative && !fragment && !segmented) ||
+			meta.no_store || content_len > limit ||
+			(negative && content_len > config.segment_size))
+		need_cache = 0;
+	set_freshness(blk, &meta, coarse_time());
+	if (negative)
+		set_negative(blk, &meta, config.negative_ttl, coarse_time());
+
+	/* a body larger than a segment goes into segments */
+	struct seg_writer sw;
+	if (need_cache && meta.status == 200 && content_len > config.segment_size)
+		segmented = 1;
+	if (need_cache && segmented) {
+		blk->version = next_version();
+		if (meta.status == 206)
+			seg_init(&sw, blk->uri, blk->version, config.segment_size,
+				meta.range_first, meta.range_total);
+		else
+			seg_init(&sw, blk->uri, blk->version, config.segment_size,
+				0, content_len);
+	}
+
+	long capacity = config.segment_size;
+	if (content_len >= 0 && content_len < capacity)
+		capacity = content_len;
+	if (need_cache && !segmented)
+		blk->file = (char*) cache_alloc(sizeof(char) * (capacity ? capacity : 1));
+
+	long size = 0;
+	long total_size = 0;
+
+	/* the head goes out with the start of the body if that came
+	   along with it, else right away */
+	if (to_client_fd < 0)
+		head_buf_free(&hb);
+	else if (rio_to_server.rio_cnt == 0) {
+		Rio_writen(to_client_fd, hb.data, hb.len);
+		head_buf_free(&hb);
+	}
+
+	/* read response contents and write to client, until it
+	   turns out not to be cached if it can be spliced instead;
+	   a body that is cached is read right into its block or
+	   segment and written to the client from there */
+	int relay = config.splice && to_client_fd >= 0 && !scan;
+	while (!relay || need_cache) {
+		char* data = buf;
+		long room = MAXLINE;
+		if (need_cache && segmented && (room = seg_reserve(&sw, &data)) == 0) {
+			data = buf;
+			room = MAXLINE;
+		}
+		else if (need_cache && !segmented && total_size < capacity) {
+			data = blk->file + total_size;
+			room = capacity - total_size;
+		}
+		if ((size = read_body(&rio_to_server, &bf, data, room)) <= 0)
+			break;
+		watchdog_kick(req->wd);
+		if (need_cache && !segmented && data == buf) {
+			/* unknown length, and it outgrew a segment */
+			if (meta.status == 200 && content_len < 0 &&
+					limit > config.segment_size) {
+				segmented = 1;
+				blk->version = next_version();
+				seg_init(&sw, blk->uri, blk->version, config.segment_size, 0, -1);
+				seg_write(&sw, blk->file, total_size);
+				cache_free(blk->file);
+				blk->file = NULL;
+			}
+			else
+				need_cache = 0;
+		}
 		total_size += size;
-		if (total_size > MAX_OBJECT_SIZE)
+		// the client gets it before a filled segment is stored
+		// and may be evicted
+		if (to_client_fd >= 0 && hb.len > 0) {
+			struct iovec iov[2];
+			iov[0].iov_base = hb.data;
+			iov[0].iov_len = hb.len;
+			iov[1].iov_base = data;
+			iov[1].iov_len = size;
+			Rio_writev(to_client_fd, iov, 2);
+			head_buf_free(&hb);
+		}
+		else if (to_client_fd >= 0)
+			Rio_writen(to_client_fd, data, size);
+		if (scan)
+			scan_html(scan, data, size);
+		if (need_cache && segmented && data != buf)
+			seg_commit(&sw, size);
+		else if (need_cache && segmented)
+			seg_write(&sw, buf, size);
+		if (need_cache && total_size > limit) {
+			if (segmented)
+				seg_finish(&sw, 0);
 			need_cache = 0;
-		if (need_cache) {
-			memcpy(headptr, buf, size);
-			headptr += size;
 		}
-		//printf("write3: %s\n", uri);
-		Rio_writen(to_client_fd, buf, size);
-		memset(buf, 0, MAXLINE);
 	}
+	/* a head that is still held waits for the spliced body,
+	   or had no body to go with */
+	if (hb.len > 0) {
+		Rio_sendn(to_client_fd, hb.data, hb.len,
+			relay && !need_cache ? MSG_MORE : 0);
+		head_buf_free(&hb);
+	}
+	if (relay && !need_cache)
+		total_size += relay_body(&rio_to_server, to_client_fd, &bf, req->wd);
+	if (scan)
+		Free(scan);
+	/* a body cut short, e.g. by a timeout, is not cached, and
+	   the client sees the connection close */
+	if (!bf.done)
+		req->keep_alive = 0;
+	if (need_cache && !segmented && !bf.done)
+		need_cache = 0;
 
-	/* add cache block */
-	if (need_cache) {
+	/* a segmented object is cached once all of its body arrived,
+	   the descriptor only has the head */
+	if (need_cache && segmented) {
+		int complete;
+		if (meta.status == 206) {
+			complete = bf.done &&
+				total_size == meta.range_last - meta.range_first + 1;
+			blk->total_size = meta.range_total;
+		}
+		else {
+			complete = bf.done;
+			blk->total_size = total_size;
+		}
+		seg_finish(&sw, complete && sw.offset == blk->total_size);
+		blk->segmented = 1;
+		need_cache = complete;
+	}
+	/* a part is merged with the parts cached before */
+	else if (need_cache && fragment)
+		need_cache = store_fragment(blk, &meta, total_size, stale);
+	else if (need_cache) {
 		blk->size = total_size;
 		// resize block
-		blk->file = (char*) realloc(blk->file, blk->size);
-		// size overflow, need to evict using LRU
-		if (blk->size + cache_size > MAX_CACHE_SIZE)
-			evict_cache(head, blk->size);
-		// add it
-		add_cache(head, blk);
+		if (blk->size > 0)
+			blk->file = (char*) cache_realloc(blk->file, blk->size);
+	}
+
+	/* add cache block */
+	if (need_cache) {
+		finish_head(blk);
+		if (meta.tags[0])
+			blk->tags = strdup(meta.tags);
+		// store text bodies compressed
+		if (config.compress && !meta.content_encoded && !blk->negative &&
+				!blk->partial && !blk->segmented)
+			compress_block(blk, meta.content_type, config.compress_level);
+		// add it, the new version replaces a stale one
+		store_cache(head, blk, config.max_cache_size);
+		count_stat(STAT_FILLS, 1);
+		count_stat(STAT_FILL_BYTES, total_size);
 	}
 	/* prevent memory leakage */
 	else {
 		free_cache_node(blk);
+		count_stat(STAT_REJECTS, 1);
 	}
+	if (to_client_fd >= 0)
+		count_request(req->hostname, req->port, 0, total_size);
 
-	Close(to_server_fd);
-	return;
+	release_server(req, to_server_fd, &rio_to_server,
+		meta.keep_alive && bf.done && bf.framing != BODY_CLOSE);
+	return meta.status;
+}
+
+/*
+ * refresh_cache - start a background thread that revalidates
+ *     a stale block while it is still being served.
+ *     The caller must have won start_refresh() for it.
+ */
+void refresh_cache(request_t *req, struct cache_block* stale)
+{
+	pthread_t tid;
+	refresh_args* args = (refresh_args*) Malloc(sizeof(refresh_args));
+	args->req = *req;
+	args->req.headers = NULL;
+	args->req.headers_len = 0;
+	// keep the stale block alive until the refresh is done
+	add_reading_cnt(stale);
+	args->stale = stale;
+	if (pthread_create(&tid, NULL, refresh_thread, args) != 0) {
+		printf("pthread_create error\n");
+		finish_refresh(args);
+	}
+}
+
+/*
+ * prefetch_uri - fetch a link of a page into the cache for a
+ *     prefetch thread, or revalidate it if it is stale.
+ *     Returns whether the server was asked.
+ */
+int prefetch_uri(char *uri)
+{
+	request_t req;
+	struct watchdog wd;
+
+	struct cache_block* blk = search_cache(head, uri);
+	if (blk && (blk->segment || is_fresh(blk))) {
+		sub_reading_cnt(blk);
+		return 0;
+	}
+	strcpy(req.uri, uri);
+	if (parse_uri(req.uri, req.hostname, req.port, req.filename) < 0) {
+		sub_reading_cnt(blk);
+		return 0;
+	}
+	req.headers = NULL;
+	req.headers_len = 0;
+	req.accept_gzip = 0;
+	req.range[0] = req.if_range[0] = '\0';
+	req.nranges = 0;
+	watchdog_start(&wd, -1, config.io_timeout * 1000L);
+	req.wd = &wd;
+	req.keep_alive = 0;
+	// an I/O error ends the thread inside fetch()
+	pthread_cleanup_push(unpin_block, &blk);
+	pthread_cleanup_push(stop_watchdog, &wd);
+	fetch(&req, -1, blk);
+	pthread_cleanup_pop(1);
+	pthread_cleanup_pop(1);
+	return 1;
+}
+
+void *refresh_thread(void *vargp) {
+	refresh_args* args = (refresh_args *) vargp;
+	struct watchdog wd;
+	Pthread_detach(pthread_self());
+	watchdog_start(&wd, -1, config.io_timeout * 1000L);
+	args->req.wd = &wd;
+	// an I/O error ends the thread inside fetch()
+	pthread_cleanup_push(finish_refresh, args);
+	pthread_cleanup_push(stop_watchdog, &wd);
+	fetch(&args->req, -1, args->stale);
+	pthread_cleanup_pop(1);
+	pthread_cleanup_pop(1);
+	return NULL;
+}
+
+/*
+ * finish_refresh - end a background refresh, also as a pthread
+ *     cleanup handler: a refresh that did not replace the block
+ *     lets the next hit try again, and the block is unpinned
+ */
+void finish_refresh(void *vargp)
+{
+	refresh_args* args = (refresh_args *) vargp;
+	end_refresh(args->stale);
+	sub_reading_cnt(args->stale);
+	Free(args);
 }
 /* $end serve */
 
@@ -283,8 +893,11 @@ int parse_uri(char *uri, char *hostname, char* port, char* filename)
 	// end of "http://""
 	host_start = uri + 7;
 	host_end = strstr(host_start, "/");
-	size_t hostname_len = strlen(host_start) - strlen(host_end);
-	strncpy(hostname, host_start, hostname_len);
+	if (!host_end)
+		host_end = host_start + strlen(host_start);
+	size_t hostname_len = host_end - host_start;
+	memcpy(hostname, host_start, hostname_len);
+	hostname[hostname_len] = '\0';
 
 	char* p = strtok(hostname, ":");
 	// get port number
@@ -294,6 +907,403 @@ int parse_uri(char *uri, char *hostname, char* port, char* filename)
 	else
 		strcpy(port, "80");
 	file_start = host_end;
-	strcpy(filename, file_start);
+	strcpy(filename, *file_start ? file_start : "/");
 	return 0;
 }
+
+/*
+ * is_hop_header - whether a header line only applies to one
+ *     connection and must not be stored in the cache
+ */
+int is_hop_header(char *buf)
+{
+	return strncasecmp(buf, "Connection:", 11) == 0 ||
+		strncasecmp(buf, "Proxy-Connection:", 17) == 0 ||
+		strncasecmp(buf, "Keep-Alive:", 11) == 0 ||
+		strncasecmp(buf, "Transfer-Encoding:", 18) == 0 ||
+		strncasecmp(buf, "Trailer:", 8) == 0;
+}
+
+/*
+ * serve_cache - send a cached response to the client
+ *     with a single writev of the stored head and body, or
+ *     sendfile from the arena with --sendfile.
+ *     A compressed body goes out as is if the client accepts
+ *     gzip, and is decompressed on the fly otherwise.
+ *     Ranges the request asks for are cut from the body.
+ *     The stored head goes out without its blank line, which
+ *     follows the Connection header of this request.
+ *     The caller must have pinned blk.
+ */
+void serve_cache(int fd, struct cache_block* blk, request_t *req)
+{
+	if (blk->segmented && req->nranges >= 0) {
+		serve_segments(fd, blk, req);
+		update_timestamp(head, blk);
+		return;
+	}
+	/* a response cut short ends the connection */
+	if (req->nranges != 0) {
+		if (serve_range(fd, blk, req->ranges, req->nranges,
+				req->keep_alive) < 0)
+			req->keep_alive = 0;
+		update_timestamp(head, blk);
+		return;
+	}
+	if (blk->plain_head && !req->accept_gzip) {
+		if (serve_decompressed(fd, blk, req->keep_alive) < 0)
+			req->keep_alive = 0;
+		update_timestamp(head, blk);
+		return;
+	}
+	send_payload(fd, blk->head, blk->head_size - 2,
+		connection_end(req->keep_alive), blk->file, blk->size, blk);
+	// update timestamp and reorder LRU list
+	update_timestamp(head, blk);
+}
+
+/*
+ * body_length - bytes of the body serve_cache() sends for a request,
+ *     not counting the parts of a multipart response
+ */
+long body_length(struct cache_block* blk, request_t *req)
+{
+	long len = 0;
+	int i;
+
+	if (req->nranges == 0)
+		return object_length(blk);
+	for (i = 0; i < req->nranges; i++)
+		len += req->ranges[i].last - req->ranges[i].first + 1;
+	return len;
+}
+
+/*
+ * serve_segments - send a segmented object, or the single range
+ *     the request asks for, segment by segment. Runs of segments
+ *     that were evicted are fetched from the server again.
+ *     The caller must have pinned desc.
+ */
+void serve_segments(int fd, struct cache_block* desc, request_t *req)
+{
+	char buf[MAXBUF + 2 * MAXLINE];
+	long seg_size = config.segment_size;
+	long first = 0, last = desc->total_size - 1;
+	long i, j;
+	int len;
+
+	if (req->nranges == 1) {
+		first = req->ranges[0].first;
+		last = req->ranges[0].last;
+		if ((len = format_range_head(buf, sizeof(buf), desc, first, last,
+				req->keep_alive)) < 0) {
+			req->keep_alive = 0;
+			return;
+		}
+		Rio_sendn(fd, buf, len, MSG_MORE);
+	}
+	else {
+		char *conn = connection_end(req->keep_alive);
+		Rio_sendn(fd, desc->head, desc->head_size - 2, MSG_MORE);
+		Rio_sendn(fd, conn, strlen(conn), MSG_MORE);
+	}
+
+	for (i = first / seg_size; i <= last / seg_size; i = j) {
+		struct cache_block* seg = search_segment(desc, i);
+		if (seg) {
+			// the part of the segment within [first, last]
+			long lo = i * seg_size > first ? i * seg_size : first;
+			long hi = i * seg_size + seg->size - 1 < last ?
+				i * seg_size + seg->size - 1 : last;
+			pthread_cleanup_push(unpin_block, &seg);
+			if (lo <= hi)
+				send_payload(fd, NULL, 0, NULL, seg->file + lo - i * seg_size,
+					hi - lo + 1, seg);
+			watchdog_kick(req->wd);
+			update_timestamp(head, seg);
+			pthread_cleanup_pop(1);
+			j = i + 1;
+			continue;
+		}
+		/* missing: get the run of missing segments at once */
+		for (j = i + 1; j <= last / seg_size; j++) {
+			if ((seg = search_segment(desc, j)) != NULL) {
+				sub_reading_cnt(seg);
+				break;
+			}
+		}
+		long end = j * seg_size < desc->total_size ?
+			j * seg_size : desc->total_size;
+		if (fetch_segments(req, desc, i * seg_size, end - 1,
+				fd, first, last) < 0) {
+			// the object changed or the server failed: cut the
+			// response short and drop the descriptor
+			delete_cache(head, desc);
+			req->keep_alive = 0;
+			return;
+		}
+	}
+}
+
+/*
+ * fetch_segments - get the bytes [first, last] of a segmented object
+ *     from the server with a Range request, store their segments and
+ *     send the ones within [from, to] to the client. If-Range makes
+ *     sure they belong to the cached version.
+ *     Returns 0, or -1 if the server did not send all of them.
+ */
+int fetch_segments(request_t *req, struct cache_block* desc,
+		long first, long last, int to_client_fd, long from, long to)
+{
+	char buf[MAXLINE + 32];
+	rio_t rio_to_server;
+	struct http_meta meta;
+	struct seg_writer sw;
+	struct body_framer bf;
+	struct head_buf hb;
+	int to_server_fd;
+	ssize_t n;
+	long pos = first;
+
+	// request line and headers, sent with one write
+	head_buf_init(&hb);
+	head_buf_printf(&hb, "GET %s HTTP/1.%d\r\n", req->filename,
+		config.pool_size > 0);
+	head_buf_printf(&hb, "Host: %s\r\n", req->hostname);
+	head_buf_add(&hb, user_agent_hdr, strlen(user_agent_hdr));
+	head_buf_printf(&hb, "Connection: %s\r\nRange: bytes=%ld-%ld\r\n",
+		config.pool_size > 0 ? "keep-alive" : "close", first, last);
+	if (desc->etag || desc->last_modified)
+		head_buf_printf(&hb, "If-Range: %s\r\n",
+			desc->etag ? desc->etag : desc->last_modified);
+	head_buf_add(&hb, "\r\n", 2);
+	to_server_fd = send_request(req, &rio_to_server, &hb, buf);
+	head_buf_free(&hb);
+	if (to_server_fd < 0)
+		return -1;
+
+	/* only the very bytes of the same object will do */
+	init_meta(&meta);
+	meta.status = parse_status_line(buf);
+	meta.keep_alive = strncmp(buf, "HTTP/1.1", 8) == 0;
+	while ((n = Rio_readlineb(&rio_to_server, buf, MAXLINE)) > 0 &&
+			strcmp(buf, "\r\n") != 0)
+		parse_header(&meta, buf);
+	if (meta.status != 206 || meta.range_first != first ||
+			meta.range_total != desc->total_size || meta.bad_length) {
+		close_server(req, to_server_fd);
+		return -1;
+	}
+
+	seg_init(&sw, desc->uri, desc->version, config.segment_size,
+		first, desc->total_size);
+	init_framer(&bf, &meta);
+	while (pos <= last && (n = read_body(&rio_to_server, &bf, buf, MAXLINE)) > 0) {
+		watchdog_kick(req->wd);
+		if (n > last + 1 - pos)
+			n = last + 1 - pos;
+		seg_write(&sw, buf, n);
+		// the part the client asked for
+		long lo = pos > from ? pos : from;
+		long hi = pos + n - 1 < to ? pos + n - 1 : to;
+		if (lo <= hi)
+			Rio_writen(to_client_fd, buf + lo - pos, hi - lo + 1);
+		pos += n;
+	}
+	seg_finish(&sw, pos == desc->total_size);
+	// the connection is kept once the body was read to its end
+	release_server(req, to_server_fd, &rio_to_server, meta.keep_alive &&
+		pos == last + 1 && body_left(&rio_to_server, &bf) == 0 && bf.done);
+	return pos == last + 1 ? 0 : -1;
+}
+
+/*
+ * format_error - build the head and body of an error response,
+ *     the head without a Connection header like a stored one,
+ *     see finish_head()
+ */
+void format_error(char *buf, char *body,
+		char *errnum, char *shortmsg, char *longmsg)
+{
+	/* Build the HTTP response body */
+	snprintf(body, MAXBUF, "<html><title>Proxy Error</title>"
+		"<body>%s: %s\r\n<p>%s\r\n</body></html>\r\n",
+		errnum, shortmsg, longmsg);
+
+	/* Build the HTTP response head */
+	snprintf(buf, MAXLINE, "HTTP/1.0 %s %s\r\n"
+		"Content-type: text/html\r\n"
+		"Content-length: %d\r\n\r\n", errnum, shortmsg, (int)strlen(body));
+}
+
+/*
+ * clienterror - returns an error message to the client
+ */
+void clienterror(int fd, int keep_alive,
+		char *errnum, char *shortmsg, char *longmsg)
+{
+	char buf[MAXLINE], body[MAXBUF];
+	struct iovec iov[3];
+
+	format_error(buf, body, errnum, shortmsg, longmsg);
+	iov[0].iov_base = buf;
+	iov[0].iov_len = strlen(buf) - 2;
+	iov[1].iov_base = connection_end(keep_alive);
+	iov[1].iov_len = strlen(iov[1].iov_base);
+	iov[2].iov_base = body;
+	iov[2].iov_len = strlen(body);
+	Rio_writev(fd, iov, 3);
+}
+
+/*
+ * add_server_failure - remember that a server could not be resolved
+ *     (rc == -2) or reached (rc == -1) in a negative block, so that
+ *     requests for it are answered without retrying for a while.
+ *     Returns the block pinned, or NULL if this is disabled.
+ */
+struct cache_block* add_server_failure(char *server_key, int rc)
+{
+	char buf[MAXLINE], body[MAXBUF];
+
+	if (config.negative_connect_ttl <= 0)
+		return NULL;
+	if (rc == -2)
+		format_error(buf, body, "502", "Bad Gateway",
+			"Proxy could not resolve the server");
+	else
+		format_error(buf, body, "502", "Bad Gateway",
+			"Proxy could not connect to the server");
+
+	struct cache_block* blk = (struct cache_block*)
+								Malloc(sizeof(struct cache_block));
+	init_cache(blk);
+	strcpy(blk->uri, server_key);
+	append_head(blk, buf, strlen(buf), MAXLINE);
+	blk->size = strlen(body);
+	blk->file = (char*) cache_alloc(blk->size);
+	memcpy(blk->file, body, blk->size);
+	blk->negative = 1;
+	blk->expires = coarse_time() + config.negative_connect_ttl;
+	blk->stale_until = blk->stale_error_until = blk->expires;
+
+	add_reading_cnt(blk);
+	store_cache(head, blk, config.max_cache_size);
+	return blk;
+}
+
+/*
+ * send_request - send a request head to the server and read the
+ *     status line of its response into buf, on an idle connection
+ *     from the pool if there is one. The server may have closed
+ *     that one meanwhile, which shows as no response, and the
+ *     request is then sent again on a new connection.
+ *     Returns the connection, -2 or -1 if the server could not be
+ *     resolved or reached as for connect_server(), or NO_RESPONSE.
+ */
+int send_request(request_t *req, rio_t *rio, struct head_buf *hb, char *buf)
+{
+	int fd, reused;
+
+	do {
+		if ((fd = open_server(req->hostname, req->port, &reused)) < 0)
+			return fd;
+		watchdog_watch(req->wd, fd);
+		Rio_readinitb(rio, fd);
+		// a failed write, e.g. of a refused fast open, shows as no response
+		rio_writen(fd, hb->data, hb->len);
+		if (rio_readlineb(rio, buf, MAXLINE) > 0)
+			return fd;
+		close_server(req, fd);
+		if (reused)
+			pool_retry();
+	} while (reused);
+	return NO_RESPONSE;
+}
+
+/*
+ * close_server - close the connection to a server, which the
+ *     request's watchdog must stop shutting down first
+ */
+void close_server(request_t *req, int fd)
+{
+	watchdog_watch(req->wd, -1);
+	Close(fd);
+}
+
+/*
+ * release_server - done with the connection to a server: it goes
+ *     back to the pool if the response left it reusable, the
+ *     server keeping it and the body read to its very end, and
+ *     is closed otherwise
+ */
+void release_server(request_t *req, int fd, rio_t *rio, int reusable)
+{
+	watchdog_watch(req->wd, -1);
+	if (!reusable || rio->rio_cnt > 0 ||
+			!pool_put(req->hostname, req->port, fd))
+		Close(fd);
+}
+
+/*
+ * set_ranges - parse the ranges of a request against a cached
+ *     object; they are ignored if If-Range does not match it
+ */
+void set_ranges(request_t *req, struct cache_block* blk)
+{
+	char validator[MAXLINE];
+	char *p = req->if_range, *end;
+
+	req->nranges = 0;
+	if (!req->range[0] || blk->negative)
+		return;
+	if (*p) {
+		// a strong ETag or a date, as sent by the server
+		while (*p == ' ' || *p == '\t')
+			p++;
+		strcpy(validator, p);
+		end = validator + strlen(validator);
+		while (end > validator && (end[-1] == '\r' || end[-1] == '\n' ||
+				end[-1] == ' '))
+			*--end = '\0';
+		if (validator[0] == '"') {
+			if (!blk->etag || strcmp(blk->etag, validator) != 0)
+				return;
+		}
+		else if (!blk->last_modified || strcmp(blk->last_modified, validator) != 0)
+			return;
+	}
+	req->nranges = parse_range(req->range, object_length(blk),
+		req->ranges, MAX_RANGES);
+}
+
+/*
+ * store_fragment - turn the body of a 206 into a part of a partial
+ *     block, merged with the parts of a stale partial block of the
+ *     same version. Returns whether blk is worth caching.
+ */
+int store_fragment(struct cache_block* blk, struct http_meta* meta,
+		long size, struct cache_block* stale)
+{
+	if (size != meta->range_last - meta->range_first + 1)
+		return 0;
+	blk->partial = 1;
+	blk->total_size = meta->range_total;
+
+	/* parts of different versions must not be mixed */
+	if (stale && stale->partial) {
+		int same;
+		if (meta->etag[0] || stale->etag)
+			same = stale->etag && strcmp(stale->etag, meta->etag) == 0;
+		else if (meta->last_modified_str[0] || stale->last_modified)
+			same = stale->last_modified &&
+				strcmp(stale->last_modified, meta->last_modified_str) == 0;
+		else
+			same = is_fresh(stale);
+		if (same && stale->total_size == blk->total_size)
+			copy_fragments(blk, stale);
+	}
+	add_fragment(blk, meta->range_first, blk->file, size);
+	blk->file = NULL;
+	complete_fragments(blk);
+	return 1;
+}
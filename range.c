@@ -0,0 +1,162 @@
+#include "range.h"
+#include "compress.h"
+
+/**
+ * whether a block holds all bytes of the requested ranges
+ * @param blk
+ * @param ranges
+ * @param n: number of ranges, as returned by parse_range()
+ */
+int covers_ranges(struct cache_block* blk, struct byte_range* ranges, int n) {
+    int i;
+    // missing segments are fetched, but only for a single range
+    if (blk->segmented)
+        return n <= 1;
+    if (n == 0)
+        return !blk->partial;
+    if (n < 0 || !blk->partial)
+        return 1;
+    for (i = 0; i < n; i++)
+        if (!fragment_data(blk, ranges[i].first, ranges[i].last))
+            return 0;
+    return 1;
+}
+
+/**
+ * copy the headers of a block's head that describe the whole object
+ * to buf, i.e. everything but the status line, the length, the
+ * connection and the content coding, and the blank line
+ * @param buf: at least MAXBUF bytes
+ * @param blk
+ * @param content_type: set to the Content-Type line, or ""
+ * @return length of the copied headers, -1 if they do not fit
+ */
+static int copy_entity_headers(char* buf, struct cache_block* blk,
+                               char* content_type) {
+    char* head = blk->plain_head ? blk->plain_head : blk->head;
+    int head_size = blk->plain_head ? blk->plain_head_size : blk->head_size;
+    char* start = strstr(head, "\r\n") + 2;
+    char* end = head + head_size - 2;
+    int n = 0;
+    content_type[0] = '\0';
+    while (start < end) {
+        char* eol = strstr(start, "\r\n") + 2;
+        int len = eol - start;
+        if (strncasecmp(start, "Content-Type:", 13) == 0 && len < MAXLINE) {
+            memcpy(content_type, start, len);
+            content_type[len] = '\0';
+        }
+        if (strncasecmp(start, "Content-Length:", 15) != 0 &&
+            strncasecmp(start, "Connection:", 11) != 0 &&
+            strncasecmp(start, "Content-Encoding:", 17) != 0 &&
+            strncasecmp(start, "Content-Type:", 13) != 0) {
+            if (n + len >= MAXBUF)
+                return -1;
+            memcpy(buf + n, start, len);
+            n += len;
+        }
+        start = eol;
+    }
+    buf[n] = '\0';
+    return n;
+}
+
+/**
+ * build the head of a 206 with a single range of a cached object
+ * @param head: buffer of size bytes
+ * @param size: at least MAXBUF + 2 * MAXLINE
+ * @param blk
+ * @param first: first byte of the range
+ * @param last: last byte of the range
+ * @param keep_alive: whether the client keeps the connection
+ * @return length of the head, -1 if it does not fit
+ */
+int format_range_head(char* head, int size, struct cache_block* blk,
+                      long first, long last, int keep_alive) {
+    char headers[MAXBUF], content_type[MAXLINE];
+    if (copy_entity_headers(headers, blk, content_type) < 0)
+        return -1;
+    return snprintf(head, size, "HTTP/1.0 206 Partial Content\r\n%s%s"
+                    "Content-Range: bytes %ld-%ld/%ld\r\n"
+                    "Content-Length: %ld\r\n%s", headers, content_type,
+                    first, last, object_length(blk), last - first + 1,
+                    connection_end(keep_alive));
+}
+
+/**
+ * answer a Range request from a cached object: 206 with one range,
+ * 206 multipart/byteranges with several, 416 if none is satisfiable
+ * notice: the caller must have pinned blk and checked covers_ranges()
+ * @param fd: client
+ * @param blk
+ * @param ranges
+ * @param n: number of ranges, as returned by parse_range()
+ * @param keep_alive: whether the client keeps the connection
+ * @return 0, or -1 if the response could not be sent in full
+ */
+int serve_range(int fd, struct cache_block* blk,
+                struct byte_range* ranges, int n, int keep_alive) {
+    char head[MAXBUF + 2 * MAXLINE], headers[MAXBUF], content_type[MAXLINE];
+    char parts[MAX_RANGES][MAXLINE];
+    struct iovec iov[2 * MAX_RANGES + 2];
+    long total = object_length(blk);
+    int i, len, iovcnt = 0;
+    long body_len = 0;
+
+    if (n < 0) {
+        len = snprintf(head, sizeof(head), "HTTP/1.0 416 Range Not Satisfiable\r\n"
+                       "Content-Range: bytes */%ld\r\n"
+                       "Content-Length: 0\r\n%s", total,
+                       connection_end(keep_alive));
+        Rio_writen(fd, head, len);
+        return 0;
+    }
+    if (copy_entity_headers(headers, blk, content_type) < 0)
+        return -1;
+
+    // a compressed body is inflated to cut it
+    char* body = blk->file;
+    char* inflated = NULL;
+    if (blk->plain_head && !(body = inflated = inflate_block(blk)))
+        return -1;
+
+    iovcnt = 1;
+    for (i = 0; i < n; i++) {
+        long first = ranges[i].first, last = ranges[i].last;
+        if (n > 1) {
+            len = snprintf(parts[i], MAXLINE, "\r\n--%s\r\n%s"
+                           "Content-Range: bytes %ld-%ld/%ld\r\n\r\n",
+                           RANGE_BOUNDARY, content_type, first, last, total);
+            iov[iovcnt].iov_base = parts[i];
+            iov[iovcnt].iov_len = len;
+            iovcnt++;
+            body_len += len;
+        }
+        iov[iovcnt].iov_base = blk->partial ?
+            fragment_data(blk, first, last) : body + first;
+        iov[iovcnt].iov_len = last - first + 1;
+        iovcnt++;
+        body_len += last - first + 1;
+    }
+
+    if (n == 1)
+        len = format_range_head(head, sizeof(head), blk, ranges[0].first,
+                                ranges[0].last, keep_alive);
+    else {
+        char* closing = "\r\n--" RANGE_BOUNDARY "--\r\n";
+        iov[iovcnt].iov_base = closing;
+        iov[iovcnt].iov_len = strlen(closing);
+        iovcnt++;
+        body_len += strlen(closing);
+        len = snprintf(head, sizeof(head), "HTTP/1.0 206 Partial Content\r\n%s"
+                       "Content-Type: multipart/byteranges; boundary=%s\r\n"
+                       "Content-Length: %ld\r\n%s", headers,
+                       RANGE_BOUNDARY, body_len, connection_end(keep_alive));
+    }
+    iov[0].iov_base = head;
+    iov[0].iov_len = len;
+    int rc = rio_writev(fd, iov, iovcnt) < 0 ? -1 : 0;
+    if (inflated)
+        Free(inflated);
+    return rc;
+}
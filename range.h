@@ -0,0 +1,15 @@
+#ifndef __RANGE_H__
+#define __RANGE_H__
+
+#include "cache.h"
+
+/* separates the parts of a multipart/byteranges response */
+#define RANGE_BOUNDARY "EASYPROXY_BYTERANGES"
+
+int covers_ranges(struct cache_block* blk, struct byte_range* ranges, int n);
+int format_range_head(char* head, int size, struct cache_block* blk,
+                      long first, long last, int keep_alive);
+int serve_range(int fd, struct cache_block* blk,
+                struct byte_range* ranges, int n, int keep_alive);
+
+#endif /* __RANGE_H__ */
@@ -0,0 +1,261 @@
+/*
+ * readline-bench.c - microbenchmark and fuzz check of the line readers
+ *
+ * The benchmark reads a head, e.g. readline-head.txt (a request and a
+ * response head, 855 bytes in 23 lines), copied COPIES times into a
+ * file, with the original byte-at-a-time rio_readlineb(), the memchr
+ * rio_readlineb() of csapp.c and the zero-copy rio_nextlineb(), and
+ * prints the best of RUNS runs of each.
+ *
+ * The fuzz check writes random lines, some of them binary or longer
+ * than the buffer, and compares the two rio_readlineb() for several
+ * maxlen, interleaved with rio_readnb(); rio_nextlineb() must hand the
+ * whole file back.
+ *
+ * usage: readline-bench HEADFILE [COPIES [RUNS]]
+ *        readline-bench -f
+ */
+#include <time.h>
+#include "csapp.h"
+
+#define FUZZ_LINES 20000
+#define FUZZ_MAXLEN 20000
+
+/**
+ * rio_read() as csapp.c had it, used by old_readlineb()
+ */
+static ssize_t old_read(rio_t* rp, char* usrbuf, size_t n) {
+    int cnt;
+    while (rp->rio_cnt <= 0) {
+        rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, RIO_BUFSIZE);
+        if (rp->rio_cnt < 0) {
+            if (errno != EINTR)
+                return -1;
+        }
+        else if (rp->rio_cnt == 0)
+            return 0;
+        else
+            rp->rio_bufptr = rp->rio_buf;
+    }
+    cnt = n;
+    if (rp->rio_cnt < n)
+        cnt = rp->rio_cnt;
+    memcpy(usrbuf, rp->rio_bufptr, cnt);
+    rp->rio_bufptr += cnt;
+    rp->rio_cnt -= cnt;
+    return cnt;
+}
+
+/**
+ * rio_readlineb() as csapp.c had it, one byte at a time
+ */
+static ssize_t old_readlineb(rio_t* rp, void* usrbuf, size_t maxlen) {
+    int n, rc;
+    char c, *bufp = usrbuf;
+    for (n = 1; n < maxlen; n++) {
+        if ((rc = old_read(rp, &c, 1)) == 1) {
+            *bufp++ = c;
+            if (c == '\n') {
+                n++;
+                break;
+            }
+        }
+        else if (rc == 0) {
+            if (n == 1)
+                return 0;
+            break;
+        }
+        else
+            return -1;
+    }
+    *bufp = 0;
+    return n - 1;
+}
+
+static double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/**
+ * create a temporary file, the caller unlinks it
+ * @param path: template ending in XXXXXX, filled in
+ * @return descriptor
+ */
+static int temp_file(char* path) {
+    int fd = mkstemp(path);
+    if (fd < 0)
+        unix_error("mkstemp error");
+    return fd;
+}
+
+/**
+ * compare the readers on random lines
+ * @return 0 if they agree
+ */
+static int fuzz(void) {
+    char path[] = "/tmp/readline-fuzzXXXXXX";
+    size_t maxlens[] = { 1, 2, 7, 100, 8192, FUZZ_MAXLEN };
+    static char x[FUZZ_MAXLEN + 1], y[FUZZ_MAXLEN + 1];
+    int fd = temp_file(path);
+    int i, k;
+
+    srand(1);
+    FILE* f = fdopen(dup(fd), "w");
+    for (i = 0; i < FUZZ_LINES; i++) {
+        int len = rand() % 10 == 0 ? rand() % FUZZ_MAXLEN : rand() % 200;
+        for (k = 0; k < len; k++) {
+            int c = rand() % 50 ? 'a' + rand() % 26 : rand() % 256;
+            fputc(c == '\n' ? 'x' : c, f);
+        }
+        if (rand() % 50)
+            fputc('\n', f);
+    }
+    fclose(f);
+
+    for (k = 0; k < sizeof(maxlens) / sizeof(maxlens[0]); k++) {
+        rio_t a, b;
+        ssize_t n1, n2;
+        long lines = 0;
+        int fa = open(path, O_RDONLY), fb = open(path, O_RDONLY);
+        rio_readinitb(&a, fa);
+        rio_readinitb(&b, fb);
+        do {
+            n1 = old_readlineb(&a, x, maxlens[k]);
+            n2 = rio_readlineb(&b, y, maxlens[k]);
+            if (n1 != n2 || memcmp(x, y, n1 > 0 ? n1 + 1 : 0)) {
+                printf("maxlen %zu, line %ld: %zd and %zd bytes differ\n",
+                       maxlens[k], lines, n1, n2);
+                return 1;
+            }
+            lines++;
+            // mix in buffered block reads
+            if (lines % 97 == 0) {
+                n1 = rio_readnb(&a, x, 123);
+                n2 = rio_readnb(&b, y, 123);
+                if (n1 != n2 || memcmp(x, y, n1 > 0 ? n1 : 0)) {
+                    printf("maxlen %zu, rio_readnb after line %ld differs\n",
+                           maxlens[k], lines);
+                    return 1;
+                }
+            }
+            // maxlen 1 reads nothing but empty lines
+        } while (n1 > 0 && (maxlens[k] > 1 || lines < 10));
+        close(fa);
+        close(fb);
+    }
+
+    // rio_nextlineb() hands back the file, mixed with rio_readnb()
+    struct stat st;
+    rio_t r;
+    char *line, *all, *cat;
+    ssize_t n;
+    size_t total = 0;
+    fstat(fd, &st);
+    all = Malloc(st.st_size + 1);
+    cat = Malloc(st.st_size + 1);
+    if (pread(fd, all, st.st_size, 0) != st.st_size)
+        unix_error("pread error");
+    Lseek(fd, 0, SEEK_SET);
+    rio_readinitb(&r, fd);
+    for (i = 1; ; i++) {
+        if (i % 89 == 0) {
+            if ((n = rio_readnb(&r, x, 150)) <= 0)
+                break;
+            memcpy(cat + total, x, n);
+            total += n;
+            continue;
+        }
+        if ((n = rio_nextlineb(&r, &line)) <= 0)
+            break;
+        char* nl = memchr(line, '\n', n);
+        if (line[n] != '\0' || (nl && nl != line + n - 1) ||
+            n > RIO_BUFSIZE - 1) {
+            printf("rio_nextlineb returned a bad line after %zu bytes\n",
+                   total);
+            return 1;
+        }
+        memcpy(cat + total, line, n);
+        total += n;
+    }
+    int ok = total == st.st_size && memcmp(all, cat, total) == 0;
+    printf("fuzz %s: %ld bytes\n", ok ? "ok" : "FAILED", (long) st.st_size);
+    Free(all);
+    Free(cat);
+    close(fd);
+    unlink(path);
+    return !ok;
+}
+
+/**
+ * time the readers on copies of a head
+ * @param head_path
+ * @param copies
+ * @param runs: the best of them is printed
+ */
+static void bench(char* head_path, long copies, int runs) {
+    char path[] = "/tmp/readline-benchXXXXXX";
+    char head[MAXBUF], buf[MAXLINE], *line;
+    int fd = temp_file(path);
+    long i, lines = 0;
+    int k, run;
+
+    int hfd = Open(head_path, O_RDONLY, 0);
+    ssize_t len = Read(hfd, head, sizeof(head));
+    Close(hfd);
+    for (i = 0; i < len; i++)
+        lines += head[i] == '\n';
+    if (lines == 0)
+        app_error("the head has no lines");
+    for (i = 0; i < copies; i++)
+        Rio_writen(fd, head, len);
+    printf("head: %zd bytes, %ld lines, %.0f bytes per line, %ld copies\n",
+           len, lines, (double) len / lines, copies);
+
+    static const char* names[] = {
+        "byte-at-a-time readlineb", "memchr readlineb", "nextlineb"
+    };
+    for (k = 0; k < 3; k++) {
+        double best = 1e9;
+        long sum = 0;
+        for (run = 0; run < runs; run++) {
+            rio_t r;
+            ssize_t n;
+            Lseek(fd, 0, SEEK_SET);
+            rio_readinitb(&r, fd);
+            double start = now();
+            if (k == 0)
+                while ((n = old_readlineb(&r, buf, MAXLINE)) > 0)
+                    sum += buf[0];
+            else if (k == 1)
+                while ((n = rio_readlineb(&r, buf, MAXLINE)) > 0)
+                    sum += buf[0];
+            else
+                while ((n = rio_nextlineb(&r, &line)) > 0)
+                    sum += line[0];
+            double t = now() - start;
+            if (t < best)
+                best = t;
+        }
+        // sum keeps the loops from being optimized out
+        printf("%-26s %5.1f ns/line  %5.2f GB/s%s\n", names[k],
+               best * 1e9 / (copies * lines), copies * len / best / 1e9,
+               sum == 0 ? " (empty)" : "");
+    }
+    close(fd);
+    unlink(path);
+}
+
+int main(int argc, char** argv) {
+    if (argc == 2 && strcmp(argv[1], "-f") == 0)
+        return fuzz();
+    if (argc < 2 || argc > 4) {
+        fprintf(stderr, "usage: %s HEADFILE [COPIES [RUNS]]\n"
+                        "       %s -f\n", argv[0], argv[0]);
+        return 1;
+    }
+    bench(argv[1], argc > 2 ? atol(argv[2]) : 20000,
+          argc > 3 ? atoi(argv[3]) : 10);
+    return 0;
+}
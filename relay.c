@@ -0,0 +1,122 @@
+#include "relay.h"
+
+#ifndef F_SETPIPE_SZ
+#define F_SETPIPE_SZ 1031
+#endif
+
+/*
+ * A body that will not be cached needs no copy in the proxy. It is
+ * moved from the server's socket into a pipe and from the pipe into
+ * the client's socket with splice(), so its pages are handed over by
+ * the kernel and never copied to user space.
+ *
+ * A pipe is only put back into the pool when it is empty; one left
+ * holding data by an error is closed instead. CONNECT tunnels take
+ * their pipes from the same pool.
+ */
+
+static int pool[RELAY_POOL][2];
+static int npool = 0;
+static struct relay_stats stats;
+// this lock protects pool, npool and stats
+static sem_t relay_lock;
+
+/**
+ * prepare the pipe pool
+ * notice: call before starting other threads
+ */
+void relay_init(void) {
+    Sem_init(&relay_lock, 0, 1);
+}
+
+/**
+ * take a pipe from the pool, or make one
+ * @param fds: read and write end
+ * @return 0, -1 if no pipe could be made
+ */
+int get_relay_pipe(int* fds) {
+    P(&relay_lock);
+    if (npool > 0) {
+        npool--;
+        fds[0] = pool[npool][0];
+        fds[1] = pool[npool][1];
+        V(&relay_lock);
+        return 0;
+    }
+    stats.pipes++;
+    V(&relay_lock);
+    if (pipe(fds) < 0)
+        return -1;
+    // larger pipes take more per splice(), the default is fine too
+    fcntl(fds[1], F_SETPIPE_SZ, RELAY_PIPE_SIZE);
+    return 0;
+}
+
+/**
+ * give an empty pipe back to the pool
+ * @param fds
+ */
+void put_relay_pipe(int* fds) {
+    P(&relay_lock);
+    if (npool < RELAY_POOL) {
+        pool[npool][0] = fds[0];
+        pool[npool][1] = fds[1];
+        npool++;
+        V(&relay_lock);
+        return;
+    }
+    V(&relay_lock);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+/**
+ * relay the rest of a body from a server to a client with splice()
+ * the client's write errors end the thread, like Rio_writen()
+ * @param rp: the server, may hold the start of the body
+ * @param to_fd: the client
+ * @param bf: where the body ends; chunks are relayed without
+ *            their framing, which is read through rp
+ * @param wd: kicked on progress, may be NULL
+ * @return bytes relayed
+ */
+long relay_body(rio_t* rp, int to_fd, struct body_framer* bf,
+                struct watchdog* wd) {
+    int fds[2];
+    long total = 0, left;
+    ssize_t n = 0;
+
+    if (get_relay_pipe(fds) < 0)
+        unix_error("relay pipe error");
+    while ((left = body_left(rp, bf)) > 0) {
+        size_t want = left < RELAY_PIPE_SIZE ? left : RELAY_PIPE_SIZE;
+        if ((n = rio_spliceb(rp, to_fd, fds, want)) <= 0)
+            break;
+        body_consumed(bf, n);
+        total += n;
+        watchdog_kick(wd);
+    }
+    if (n == 0)
+        body_consumed(bf, 0);
+    P(&relay_lock);
+    stats.bodies++;
+    stats.bytes += total;
+    V(&relay_lock);
+    if (n < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        unix_error("relay error");
+    }
+    put_relay_pipe(fds);
+    return total;
+}
+
+/**
+ * copy the relay counters
+ * @param out
+ */
+void get_relay_stats(struct relay_stats* out) {
+    P(&relay_lock);
+    *out = stats;
+    V(&relay_lock);
+}
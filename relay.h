@@ -0,0 +1,28 @@
+#ifndef __RELAY_H__
+#define __RELAY_H__
+
+#include "csapp.h"
+#include "timer.h"
+#include "http.h"
+
+/* idle pipes kept for reuse, more are closed */
+#define RELAY_POOL 64
+/* capacity asked for each pipe, up to /proc/sys/fs/pipe-max-size */
+#define RELAY_PIPE_SIZE (1 << 20)
+
+/* relays since start */
+struct relay_stats {
+    long bodies;
+    long bytes;
+    // pipes created, the rest came from the pool
+    long pipes;
+};
+
+void relay_init(void);
+int get_relay_pipe(int* fds);
+void put_relay_pipe(int* fds);
+long relay_body(rio_t* rp, int to_fd, struct body_framer* bf,
+                struct watchdog* wd);
+void get_relay_stats(struct relay_stats* stats);
+
+#endif /* __RELAY_H__ */
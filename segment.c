@@ -0,0 +1,175 @@
+#include "segment.h"
+#include "config.h"
+#include "arena.h"
+
+extern struct cache_block* head;
+extern sem_t list_lock;
+
+// versions tell the segments of different fills of a uri apart
+static int last_version = 0;
+
+/**
+ * key of a segment block, the version goes first as it is unique
+ * and a long uri is cut off
+ * @param key: at least MAXLINE bytes
+ * @param uri: of the descriptor
+ * @param version: of the descriptor
+ * @param index: number of the segment
+ */
+void seg_key(char* key, char* uri, int version, long index) {
+    int n = sprintf(key, "#seg%d.%ld#", version, index);
+    int len = strlen(uri);
+    if (len > MAXLINE - 1 - n)
+        len = MAXLINE - 1 - n;
+    memcpy(key + n, uri, len);
+    key[n + len] = '\0';
+}
+
+/**
+ * a version for a new descriptor
+ */
+int next_version(void) {
+    P(&list_lock);
+    int version = ++last_version;
+    V(&list_lock);
+    return version;
+}
+
+/**
+ * start cutting a body into segments
+ * @param sw
+ * @param uri: of the descriptor
+ * @param version: of the descriptor
+ * @param seg_size
+ * @param offset: offset in the object of the first byte written,
+ *        bytes before the next segment boundary are not stored
+ * @param total: length of the object, -1 if unknown
+ */
+void seg_init(struct seg_writer* sw, char* uri, int version, int seg_size,
+              long offset, long total) {
+    strcpy(sw->uri, uri);
+    sw->version = version;
+    sw->seg_size = seg_size;
+    sw->total = total;
+    sw->offset = offset;
+    sw->buf = NULL;
+    sw->len = 0;
+    sw->cap = 0;
+}
+
+/**
+ * add the filled segment to the cache
+ * @param sw
+ */
+static void emit_segment(struct seg_writer* sw) {
+    struct cache_block* blk = (struct cache_block*)
+                              Malloc(sizeof(struct cache_block));
+    init_cache(blk);
+    seg_key(blk->uri, sw->uri, sw->version,
+            (sw->offset - sw->len) / sw->seg_size);
+    blk->segment = 1;
+    blk->file = sw->buf;
+    blk->size = sw->len;
+    if (sw->len < sw->cap)
+        blk->file = (char*) cache_realloc(blk->file, sw->len);
+    store_cache(head, blk, config.max_cache_size);
+    sw->buf = NULL;
+    sw->len = 0;
+}
+
+/**
+ * room for the next bytes of the body in the segment being filled,
+ * so that they can be read into it; seg_commit() them once written
+ * @param sw
+ * @param ptr: set to where they go
+ * @return bytes of room, 0 if they are skipped or past the object
+ */
+long seg_reserve(struct seg_writer* sw, char** ptr) {
+    if (!sw->buf) {
+        // started within a segment: the rest of it is skipped
+        if (sw->offset % sw->seg_size != 0)
+            return 0;
+        if (sw->total >= 0 && sw->offset >= sw->total)
+            return 0;
+        sw->cap = sw->seg_size;
+        if (sw->total >= 0 && sw->total - sw->offset < sw->cap)
+            sw->cap = sw->total - sw->offset;
+        sw->buf = (char*) cache_alloc(sw->cap);
+    }
+    *ptr = sw->buf + sw->len;
+    return sw->cap - sw->len;
+}
+
+/**
+ * take bytes written where seg_reserve() said; a segment they fill
+ * is added to the cache, and may be evicted from then on
+ * @param sw
+ * @param len: up to the room reserved
+ */
+void seg_commit(struct seg_writer* sw, long len) {
+    sw->len += len;
+    sw->offset += len;
+    if (sw->len == sw->cap)
+        emit_segment(sw);
+}
+
+/**
+ * write the next bytes of the body
+ * @param sw
+ * @param data
+ * @param len
+ */
+void seg_write(struct seg_writer* sw, char* data, long len) {
+    while (len > 0) {
+        char* ptr;
+        long n = seg_reserve(sw, &ptr);
+        if (n == 0) {
+            // skip to the next segment, if there is one
+            n = (sw->seg_size - sw->offset % sw->seg_size) % sw->seg_size;
+            if (n == 0)
+                return;
+            if (n > len)
+                n = len;
+            sw->offset += n;
+            data += n;
+            len -= n;
+            continue;
+        }
+        if (n > len)
+            n = len;
+        memcpy(ptr, data, n);
+        seg_commit(sw, n);
+        data += n;
+        len -= n;
+    }
+}
+
+/**
+ * stop writing, the segment being filled is only kept if it
+ * is the last one of the object
+ * @param sw
+ * @param end: the body ended with the object
+ */
+void seg_finish(struct seg_writer* sw, int end) {
+    if (!sw->buf)
+        return;
+    if (end && sw->len > 0)
+        emit_segment(sw);
+    else {
+        cache_free(sw->buf);
+        sw->buf = NULL;
+    }
+}
+
+/**
+ * search for a segment of a descriptor
+ * the block is pinned, release it with sub_reading_cnt()
+ * @param desc
+ * @param index: number of the segment
+ * @return block ptr, NULL if it is not cached
+ */
+struct cache_block* search_segment(struct cache_block* desc, long index) {
+    char key[MAXLINE];
+    seg_key(key, desc->uri, desc->version, index);
+    return search_cache(head, key);
+}
@@ -0,0 +1,33 @@
+#ifndef __SEGMENT_H__
+#define __SEGMENT_H__
+
+#include "cache.h"
+
+/* cuts the body of a large object into segment blocks while it is
+   read; segment i holds the bytes from i * seg_size of the object */
+struct seg_writer {
+    // uri and version of the descriptor
+    char uri[MAXLINE];
+    int version;
+    int seg_size;
+    // length of the object, -1 if unknown
+    long total;
+    // offset in the object of the next byte written
+    long offset;
+    // the segment being filled and how much it takes
+    char* buf;
+    int len;
+    int cap;
+};
+
+void seg_key(char* key, char* uri, int version, long index);
+int next_version(void);
+void seg_init(struct seg_writer* sw, char* uri, int version, int seg_size,
+              long offset, long total);
+void seg_write(struct seg_writer* sw, char* data, long len);
+long seg_reserve(struct seg_writer* sw, char** ptr);
+void seg_commit(struct seg_writer* sw, long len);
+void seg_finish(struct seg_writer* sw, int end);
+struct cache_block* search_segment(struct cache_block* desc, long index);
+
+#endif /* __SEGMENT_H__ */
@@ -0,0 +1,383 @@
+#include "stats.h"
+#include "config.h"
+#include "compress.h"
+#include "prefetch.h"
+#include "arena.h"
+#include "timer.h"
+#include "relay.h"
+#include "pool.h"
+#include "dns.h"
+
+extern long cache_size;
+
+/*
+ * Counting must not make threads contend on the request path, so
+ * each thread counts into its own array, found through a pthread key.
+ * A reader adds up the arrays of the live threads and the totals of
+ * the threads that are gone; the key's destructor moves a thread's
+ * counts into those totals when it exits, also through pthread_exit.
+ * Reads race with the counting threads and may be a little behind.
+ *
+ * Origin servers are tracked in a table of the STATS_TOP_HOSTS
+ * busiest ones with the space-saving algorithm: a new server takes
+ * the place of the one with the fewest requests and inherits its
+ * count, so the table stays bounded however many servers there are.
+ * Requests are counted for the few servers a thread talks to in the
+ * thread's own buffer first, and merged into the table in a batch
+ * when it is full, when the thread exits, or when the table is read.
+ */
+
+/* requests for a server that a thread has not merged yet */
+struct pending_host {
+    unsigned hash;
+    char host[STATS_HOST_LEN];
+    long requests;
+    long hits;
+    long hit_bytes;
+    long miss_bytes;
+};
+
+struct thread_stats {
+    long counts[NSTATS];
+    // this lock protects hosts and nhosts, which readers merge;
+    // only they contend for it with the thread
+    sem_t lock;
+    struct pending_host hosts[STATS_THREAD_HOSTS];
+    int nhosts;
+    struct thread_stats* next;
+    struct thread_stats* prev;
+};
+
+static pthread_key_t stats_key;
+// live threads that counted something
+static struct thread_stats* threads = NULL;
+// counts of the threads that exited
+static long retired[NSTATS];
+// this lock protects threads and retired
+static sem_t stats_lock;
+
+static struct host_stats hosts[STATS_TOP_HOSTS];
+static int nhosts = 0;
+// this lock protects hosts and nhosts
+static sem_t hosts_lock;
+
+static struct timer dump_timer;
+static long dump_ms;
+
+/**
+ * FNV-1a hash of a server's host:port
+ * @param host
+ */
+static unsigned hash_host(char* host) {
+    unsigned h = 2166136261u;
+    while (*host) {
+        h ^= (unsigned char) *host++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/**
+ * merge the servers a thread counted into the table
+ * notice: need to acquire the thread's lock
+ * @param ts
+ */
+static void merge_hosts(struct thread_stats* ts) {
+    int i, j, min;
+    if (ts->nhosts == 0)
+        return;
+    P(&hosts_lock);
+    for (j = 0; j < ts->nhosts; j++) {
+        struct pending_host* ph = &ts->hosts[j];
+        min = 0;
+        for (i = 0; i < nhosts; i++) {
+            if (strcmp(hosts[i].host, ph->host) == 0)
+                break;
+            if (hosts[i].requests < hosts[min].requests)
+                min = i;
+        }
+        if (i == nhosts) {
+            if (nhosts < STATS_TOP_HOSTS) {
+                i = nhosts++;
+                memset(&hosts[i], 0, sizeof(hosts[i]));
+            }
+            else {
+                // replace the least busy, which may have been this one
+                i = min;
+                hosts[i].error = hosts[i].requests;
+                hosts[i].hits = hosts[i].hit_bytes = hosts[i].miss_bytes = 0;
+            }
+            strcpy(hosts[i].host, ph->host);
+        }
+        hosts[i].requests += ph->requests;
+        hosts[i].hits += ph->hits;
+        hosts[i].hit_bytes += ph->hit_bytes;
+        hosts[i].miss_bytes += ph->miss_bytes;
+    }
+    V(&hosts_lock);
+    ts->nhosts = 0;
+}
+
+/**
+ * move the counts of an exiting thread to the totals
+ * @param arg: its thread_stats
+ */
+static void retire_thread(void* arg) {
+    struct thread_stats* ts = (struct thread_stats*) arg;
+    int i;
+    P(&stats_lock);
+    P(&ts->lock);
+    merge_hosts(ts);
+    V(&ts->lock);
+    for (i = 0; i < NSTATS; i++)
+        retired[i] += ts->counts[i];
+    if (ts->prev)
+        ts->prev->next = ts->next;
+    else
+        threads = ts->next;
+    if (ts->next)
+        ts->next->prev = ts->prev;
+    V(&stats_lock);
+    Free(ts);
+}
+
+/**
+ * the counters of the calling thread, created on first use
+ */
+static struct thread_stats* thread_stats(void) {
+    struct thread_stats* ts = pthread_getspecific(stats_key);
+    if (ts)
+        return ts;
+    ts = (struct thread_stats*) Calloc(1, sizeof(struct thread_stats));
+    Sem_init(&ts->lock, 0, 1);
+    P(&stats_lock);
+    ts->next = threads;
+    if (threads)
+        threads->prev = ts;
+    threads = ts;
+    V(&stats_lock);
+    pthread_setspecific(stats_key, ts);
+    return ts;
+}
+
+/**
+ * print the statistics, and do it again after the interval
+ * the wheel's thread runs this
+ */
+static void dump_stats(void* arg) {
+    print_stats(stdout);
+    fflush(stdout);
+    timer_add(&dump_timer, dump_ms);
+}
+
+/**
+ * prepare the counters
+ * notice: call before starting other threads, after timer_init()
+ * @param interval: seconds between dumps to stdout, 0 for none
+ */
+void stats_init(int interval) {
+    pthread_key_create(&stats_key, retire_thread);
+    Sem_init(&stats_lock, 0, 1);
+    Sem_init(&hosts_lock, 0, 1);
+    if (interval > 0) {
+        dump_ms = interval * 1000L;
+        timer_setup(&dump_timer, dump_stats, NULL);
+        timer_add(&dump_timer, dump_ms);
+    }
+}
+
+/**
+ * add to a counter of the calling thread
+ * @param s
+ * @param n
+ */
+void count_stat(enum cache_stat s, long n) {
+    thread_stats()->counts[s] += n;
+}
+
+/**
+ * count a response to a client, and the request for its origin server
+ * @param host
+ * @param port
+ * @param hit: served from the cache
+ * @param bytes: of the body
+ */
+void count_request(char* host, char* port, int hit, long bytes) {
+    char key[STATS_HOST_LEN];
+    struct pending_host* ph;
+    unsigned hash;
+    int i;
+    struct thread_stats* ts = thread_stats();
+    ts->counts[hit ? STAT_HITS : STAT_MISSES]++;
+    ts->counts[hit ? STAT_HIT_BYTES : STAT_MISS_BYTES] += bytes;
+
+    snprintf(key, sizeof(key), "%s:%s", host, port);
+    hash = hash_host(key);
+    P(&ts->lock);
+    for (i = 0; i < ts->nhosts; i++)
+        if (ts->hosts[i].hash == hash && strcmp(ts->hosts[i].host, key) == 0)
+            break;
+    if (i == ts->nhosts) {
+        if (ts->nhosts == STATS_THREAD_HOSTS)
+            merge_hosts(ts);
+        i = ts->nhosts++;
+        ph = &ts->hosts[i];
+        memset(ph, 0, sizeof(*ph));
+        ph->hash = hash;
+        strcpy(ph->host, key);
+    }
+    ph = &ts->hosts[i];
+    ph->requests++;
+    if (hit) {
+        ph->hits++;
+        ph->hit_bytes += bytes;
+    }
+    else
+        ph->miss_bytes += bytes;
+    V(&ts->lock);
+}
+
+/**
+ * add up the counters of all threads
+ * @param counts: NSTATS of them
+ */
+void get_stats(long* counts) {
+    struct thread_stats* ts;
+    int i;
+    P(&stats_lock);
+    memcpy(counts, retired, sizeof(retired));
+    for (ts = threads; ts; ts = ts->next)
+        for (i = 0; i < NSTATS; i++)
+            counts[i] += ts->counts[i];
+    V(&stats_lock);
+}
+
+static int by_requests(const void* a, const void* b) {
+    long ra = ((struct host_stats*) a)->requests;
+    long rb = ((struct host_stats*) b)->requests;
+    return ra < rb ? 1 : ra > rb ? -1 : 0;
+}
+
+/**
+ * copy the table of origin servers, busiest first
+ * @param out: STATS_TOP_HOSTS of them
+ * @return number of servers
+ */
+int get_host_stats(struct host_stats* out) {
+    struct thread_stats* ts;
+    P(&stats_lock);
+    for (ts = threads; ts; ts = ts->next) {
+        P(&ts->lock);
+        merge_hosts(ts);
+        V(&ts->lock);
+    }
+    V(&stats_lock);
+    P(&hosts_lock);
+    int n = nhosts;
+    memcpy(out, hosts, n * sizeof(struct host_stats));
+    V(&hosts_lock);
+    qsort(out, n, sizeof(struct host_stats), by_requests);
+    return n;
+}
+
+static double percent(long part, long whole) {
+    return whole ? 100.0 * part / whole : 0.0;
+}
+
+/**
+ * print the cache statistics, per origin server, and of the
+ * subsystems that are enabled
+ * @param out
+ */
+void print_stats(FILE* out) {
+    long c[NSTATS];
+    struct host_stats top[STATS_TOP_HOSTS];
+    int i, n;
+
+    get_stats(c);
+    fprintf(out, "requests: %ld hits (%ld revalidated), %ld misses, "
+            "hit ratio %.1f%%\n", c[STAT_HITS], c[STAT_REVALIDATED],
+            c[STAT_MISSES], percent(c[STAT_HITS], c[STAT_HITS] + c[STAT_MISSES]));
+    fprintf(out, "bytes: %ld from the cache, %ld from servers, "
+            "byte hit ratio %.1f%%\n", c[STAT_HIT_BYTES], c[STAT_MISS_BYTES],
+            percent(c[STAT_HIT_BYTES], c[STAT_HIT_BYTES] + c[STAT_MISS_BYTES]));
+    fprintf(out, "cache: %ld of %ld bytes, %ld fills of %ld bytes, "
+            "%ld rejected, %ld evicted, %ld expired\n", cache_size,
+            config.max_cache_size, c[STAT_FILLS], c[STAT_FILL_BYTES],
+            c[STAT_REJECTS], c[STAT_EVICTIONS], c[STAT_EXPIRED]);
+    fprintf(out, "clients: %ld connections, %.2f requests per connection\n",
+            c[STAT_CLIENTS], c[STAT_CLIENTS] ? (double) (c[STAT_HITS] +
+            c[STAT_MISSES]) / c[STAT_CLIENTS] : 0.0);
+    fprintf(out, "tunnels: %ld, %ld bytes up, %ld bytes down\n",
+            c[STAT_TUNNELS], c[STAT_TUNNEL_UP], c[STAT_TUNNEL_DOWN]);
+
+    n = get_host_stats(top);
+    fprintf(out, "hosts: %d busiest\n", n);
+    for (i = 0; i < n; i++)
+        fprintf(out, "  %s %ld requests (%ld inherited), %ld hits, %.1f%% of "
+                "%ld bytes from the cache\n", top[i].host, top[i].requests,
+                top[i].error, top[i].hits,
+                percent(top[i].hit_bytes, top[i].hit_bytes + top[i].miss_bytes),
+                top[i].hit_bytes + top[i].miss_bytes);
+
+    if (config.compress)
+        print_compress_stats(out);
+    if (config.prefetch > 0) {
+        struct prefetch_stats ps;
+        get_prefetch_stats(&ps);
+        fprintf(out, "prefetch: %ld queued, %ld dropped, %ld fetched, "
+                "%ld cached already, %ld failed\n", ps.queued, ps.dropped,
+                ps.fetched, ps.cached, ps.failed);
+    }
+    if (config.arena) {
+        struct arena_stats as;
+        get_arena_stats(&as);
+        fprintf(out, "arena: %ld of %ld bytes used, %ld malloc fallbacks, "
+                "%ld bytes sent with sendfile\n", as.used, as.size,
+                as.fallbacks, as.sendfile_bytes);
+    }
+    if (config.zerocopy) {
+        struct arena_stats as;
+        get_arena_stats(&as);
+        fprintf(out, "zerocopy: %ld bytes in %ld sends, %ld copied by the "
+                "kernel\n", as.zerocopy_bytes, as.zerocopy_sends,
+                as.zerocopy_copied);
+    }
+    if (config.sendfile || config.zerocopy) {
+        struct arena_stats as;
+        get_arena_stats(&as);
+        fprintf(out, "lent: %ld payloads not taken by clients yet, %ld "
+                "connections aborted\n", as.loans, as.loans_aborted);
+    }
+    if (config.pool_size > 0) {
+        struct pool_stats ps;
+        get_pool_stats(&ps);
+        // a reuse saves about what connecting takes on average
+        double connect_ms = ps.connects ?
+            ps.connect_usec / 1000.0 / ps.connects : 0.0;
+        fprintf(out, "pool: %ld of %ld requests on reused connections "
+                "(%.1f%%), %ld idle, %ld expired, %ld stale; connecting "
+                "takes %.2f ms, %.0f ms saved\n", ps.reuses,
+                ps.connects + ps.reuses,
+                percent(ps.reuses, ps.connects + ps.reuses), ps.idle,
+                ps.expired, ps.stale, connect_ms, ps.reuses * connect_ms);
+    }
+    if (config.dns_ttl > 0) {
+        struct dns_stats ds;
+        get_dns_stats(&ds);
+        fprintf(out, "dns: %ld of %ld lookups from the cache (%.1f%%), "
+                "%ld negative, %ld coalesced; %ld names, %ld resolved, "
+                "%ld failed, %ld refreshed; resolving takes %.2f ms\n",
+                ds.hits + ds.negative_hits, ds.lookups,
+                percent(ds.hits + ds.negative_hits, ds.lookups),
+                ds.negative_hits, ds.coalesced, ds.names, ds.resolves,
+                ds.failures, ds.refreshes, ds.resolves ?
+                ds.resolve_usec / 1000.0 / ds.resolves : 0.0);
+    }
+    if (config.splice) {
+        struct relay_stats rs;
+        get_relay_stats(&rs);
+        fprintf(out, "relay: %ld bodies of %ld bytes spliced, %ld pipes\n",
+                rs.bodies, rs.bytes, rs.pipes);
+    }
+}
@@ -0,0 +1,59 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include "csapp.h"
+
+/* origin servers tracked, the busiest are kept */
+#define STATS_TOP_HOSTS 32
+#define STATS_HOST_LEN 272
+/* servers a thread counts on its own before it merges them */
+#define STATS_THREAD_HOSTS 8
+
+/* counters, each thread keeps its own, see count_stat() */
+enum cache_stat {
+    // responses served from the cache, fresh, stale or after a 304
+    STAT_HITS,
+    // responses relayed from a server
+    STAT_MISSES,
+    // hits that needed a 304 from the server
+    STAT_REVALIDATED,
+    // body bytes sent to clients, from the cache and from servers
+    STAT_HIT_BYTES,
+    STAT_MISS_BYTES,
+    // objects stored in the cache and their bytes
+    STAT_FILLS,
+    STAT_FILL_BYTES,
+    // responses that were not admitted into the cache
+    STAT_REJECTS,
+    // blocks evicted by LRU, or removed once they expired
+    STAT_EVICTIONS,
+    STAT_EXPIRED,
+    // client connections, which may carry several requests
+    STAT_CLIENTS,
+    // CONNECT tunnels, and bytes they carried to and from servers
+    STAT_TUNNELS,
+    STAT_TUNNEL_UP,
+    STAT_TUNNEL_DOWN,
+    NSTATS
+};
+
+/* requests for one origin server; with the space-saving
+   algorithm an entry may have inherited up to error requests
+   from the entry it replaced */
+struct host_stats {
+    char host[STATS_HOST_LEN];
+    long requests;
+    long error;
+    long hits;
+    long hit_bytes;
+    long miss_bytes;
+};
+
+void stats_init(int interval);
+void count_stat(enum cache_stat s, long n);
+void count_request(char* host, char* port, int hit, long bytes);
+void get_stats(long* counts);
+int get_host_stats(struct host_stats* hosts);
+void print_stats(FILE* out);
+
+#endif /* __STATS_H__ */
@@ -0,0 +1,323 @@
+#include "timer.h"
+
+#ifndef CLOCK_MONOTONIC_COARSE
+#define CLOCK_MONOTONIC_COARSE CLOCK_MONOTONIC
+#endif
+
+/*
+ * Timers live in a hierarchical timing wheel, as in the Linux kernel.
+ * A timer due within WHEEL_SLOTS ticks sits in the slot of the first
+ * level for its tick; a later one sits in an upper level, whose slots
+ * cover 2^(WHEEL_BITS + k * LEVEL_BITS) ticks each. Whenever the first
+ * level wraps around, the next slot of the level above is cascaded
+ * down. Adding and cancelling a timer is O(1), and a tick only looks
+ * at one slot, however many timers there are.
+ *
+ * A thread advances the wheel every TIMER_TICK_MS and runs the
+ * timers that are due, one by one and without the wheel's lock.
+ * It also reads the clocks once per tick for coarse_msec() and
+ * coarse_time(), so that the request path never has to.
+ */
+
+static struct timer* first[WHEEL_SLOTS];
+static struct timer* upper[WHEEL_LEVELS][LEVEL_SLOTS];
+// the next tick to run
+static unsigned long wheel_tick;
+// protects the wheel, wheel_tick and running
+static sem_t wheel_lock;
+// the timer whose function is being run
+static struct timer* running = NULL;
+
+static volatile long now_msec = 0;
+static volatile time_t now_sec = 0;
+
+/**
+ * read the clocks
+ */
+static void update_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    now_msec = ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+    now_sec = time(NULL);
+}
+
+/**
+ * the monotonic clock as of the last tick
+ * @return ms since an arbitrary point
+ */
+long coarse_msec(void) {
+    return now_msec;
+}
+
+/**
+ * the wall clock as of the last tick, for HTTP dates
+ * @return seconds since the epoch
+ */
+time_t coarse_time(void) {
+    return now_sec ? now_sec : time(NULL);
+}
+
+static void link_timer(struct timer** slot, struct timer* t) {
+    t->next = *slot;
+    if (t->next)
+        t->next->pprev = &t->next;
+    *slot = t;
+    t->pprev = slot;
+}
+
+static void unlink_timer(struct timer* t) {
+    *t->pprev = t->next;
+    if (t->next)
+        t->next->pprev = t->pprev;
+    t->next = NULL;
+    t->pprev = NULL;
+}
+
+/**
+ * put a timer in the slot for its tick
+ * notice: need to acquire wheel_lock
+ */
+static void insert_timer(struct timer* t) {
+    unsigned long delta = t->expires - wheel_tick;
+    int level, shift = WHEEL_BITS;
+    if ((long) delta < 0) {
+        // due already: run it on the next tick
+        t->expires = wheel_tick;
+        link_timer(&first[wheel_tick & (WHEEL_SLOTS - 1)], t);
+        return;
+    }
+    if (delta < WHEEL_SLOTS) {
+        link_timer(&first[t->expires & (WHEEL_SLOTS - 1)], t);
+        return;
+    }
+    for (level = 0; level < WHEEL_LEVELS - 1; level++, shift += LEVEL_BITS)
+        if (delta < 1UL << (shift + LEVEL_BITS))
+            break;
+    if (delta >= 1UL << (shift + LEVEL_BITS)) {
+        delta = (1UL << (shift + LEVEL_BITS)) - 1;
+        t->expires = wheel_tick + delta;
+    }
+    link_timer(&upper[level][(t->expires >> shift) & (LEVEL_SLOTS - 1)], t);
+}
+
+/**
+ * move the timers of a slot of an upper level to the levels below
+ * notice: need to acquire wheel_lock
+ * @return index of the slot
+ */
+static int cascade(int level) {
+    int index = (wheel_tick >> (WHEEL_BITS + level * LEVEL_BITS)) &
+        (LEVEL_SLOTS - 1);
+    struct timer* t = upper[level][index];
+    upper[level][index] = NULL;
+    while (t) {
+        struct timer* next = t->next;
+        insert_timer(t);
+        t = next;
+    }
+    return index;
+}
+
+/**
+ * run the timers of every tick up to now
+ */
+static void run_timers(void) {
+    unsigned long now = coarse_msec() / TIMER_TICK_MS;
+    P(&wheel_lock);
+    while ((long) (now - wheel_tick) >= 0) {
+        int index = wheel_tick & (WHEEL_SLOTS - 1);
+        int level;
+        // the first level wrapped around: refill it from above
+        for (level = 0; index == 0 && level < WHEEL_LEVELS; level++)
+            if (cascade(level) != 0)
+                break;
+        // detach the slot, timers added to it meanwhile wait a lap
+        struct timer* due = first[index];
+        first[index] = NULL;
+        if (due)
+            due->pprev = &due;
+        wheel_tick++;
+        while (due) {
+            struct timer* t = due;
+            unlink_timer(t);
+            running = t;
+            V(&wheel_lock);
+            t->fn(t->arg);
+            P(&wheel_lock);
+            running = NULL;
+        }
+    }
+    V(&wheel_lock);
+}
+
+static void* tick_thread(void* vargp) {
+    Pthread_detach(pthread_self());
+    while (1) {
+        usleep(TIMER_TICK_MS * 1000);
+        update_clock();
+        run_timers();
+    }
+    return NULL;
+}
+
+/**
+ * read the clocks and start the thread that ticks the wheel
+ */
+void timer_init(void) {
+    pthread_t tid;
+    update_clock();
+    wheel_tick = coarse_msec() / TIMER_TICK_MS;
+    Sem_init(&wheel_lock, 0, 1);
+    Pthread_create(&tid, NULL, tick_thread, NULL);
+}
+
+/**
+ * prepare a timer, before it is added
+ * @param t
+ * @param fn: run by the wheel's thread when the timer fires
+ * @param arg: for fn
+ */
+void timer_setup(struct timer* t, void (*fn)(void* arg), void* arg) {
+    t->expires = 0;
+    t->fn = fn;
+    t->arg = arg;
+    t->next = NULL;
+    t->pprev = NULL;
+}
+
+/**
+ * (re)arm a timer to fire once after some time
+ * @param t
+ * @param ms: from now, rounded up to whole ticks
+ */
+void timer_add(struct timer* t, long ms) {
+    P(&wheel_lock);
+    if (t->pprev)
+        unlink_timer(t);
+    t->expires = wheel_tick + (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    insert_timer(t);
+    V(&wheel_lock);
+}
+
+/**
+ * disarm a timer; its function may still be running
+ * @param t
+ * @return 1 if it was pending, 0 if it fired or was not added
+ */
+int timer_cancel(struct timer* t) {
+    P(&wheel_lock);
+    int pending = t->pprev != NULL;
+    if (pending)
+        unlink_timer(t);
+    V(&wheel_lock);
+    return pending;
+}
+
+/**
+ * disarm a timer and wait until its function is done running,
+ * after which t may be freed
+ * notice: must not be called from t's function, or holding a lock
+ *         that function takes
+ * @param t
+ */
+void timer_cancel_sync(struct timer* t) {
+    P(&wheel_lock);
+    // the function may add the timer again
+    while (t->pprev || running == t) {
+        if (t->pprev)
+            unlink_timer(t);
+        if (running == t) {
+            V(&wheel_lock);
+            usleep(TIMER_TICK_MS * 100);
+            P(&wheel_lock);
+        }
+    }
+    V(&wheel_lock);
+}
+
+/**
+ * shut a connection down unless it made progress
+ * the wheel's thread runs this when the watchdog's timer fires
+ */
+static void watchdog_fire(void* arg) {
+    struct watchdog* wd = (struct watchdog*) arg;
+    int i;
+    if (wd->active) {
+        wd->active = 0;
+        timer_add(&wd->timer, wd->ms);
+        return;
+    }
+    // the blocked read or write returns, and the thread gives up
+    P(&wd->lock);
+    wd->fired = 1;
+    for (i = 0; i < 2; i++)
+        if (wd->fds[i] >= 0)
+            shutdown(wd->fds[i], SHUT_RDWR);
+    V(&wd->lock);
+}
+
+/**
+ * start watching a connection
+ * it is shut down after between ms and twice ms without progress
+ * @param wd
+ * @param fd: the client, or -1
+ * @param ms: 0 for no timeout
+ */
+void watchdog_start(struct watchdog* wd, int fd, long ms) {
+    Sem_init(&wd->lock, 0, 1);
+    wd->fds[0] = fd;
+    wd->fds[1] = -1;
+    wd->active = 0;
+    wd->fired = 0;
+    timer_setup(&wd->timer, watchdog_fire, wd);
+    watchdog_set(wd, ms);
+}
+
+/**
+ * change the timeout, counting from now
+ * @param wd: may be NULL
+ * @param ms: 0 for no timeout
+ */
+void watchdog_set(struct watchdog* wd, long ms) {
+    if (!wd)
+        return;
+    wd->ms = ms;
+    wd->active = 0;
+    if (ms > 0)
+        timer_add(&wd->timer, ms);
+    else
+        timer_cancel(&wd->timer);
+}
+
+/**
+ * watch the connection to a server as well, until it is replaced
+ * notice: call with -1 before closing the server's fd
+ * @param wd: may be NULL
+ * @param fd: the server, or -1
+ */
+void watchdog_watch(struct watchdog* wd, int fd) {
+    if (!wd)
+        return;
+    P(&wd->lock);
+    wd->fds[1] = fd;
+    V(&wd->lock);
+}
+
+/**
+ * note progress on a connection
+ * @param wd: may be NULL
+ */
+void watchdog_kick(struct watchdog* wd) {
+    if (wd)
+        wd->active = 1;
+}
+
+/**
+ * stop watching a connection, after which wd may be freed
+ * @param wd
+ * @return whether the connection timed out
+ */
+int watchdog_stop(struct watchdog* wd) {
+    timer_cancel_sync(&wd->timer);
+    return wd->fired;
+}
@@ -0,0 +1,55 @@
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+#include <time.h>
+#include "csapp.h"
+
+/* resolution of the wheel and of the coarse clock, in ms */
+#define TIMER_TICK_MS 10
+/* slots of the first level of the wheel, and of each of the levels
+   above it, which cover 2^32 ticks together; later timers are clamped */
+#define WHEEL_BITS 8
+#define LEVEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define LEVEL_SLOTS (1 << LEVEL_BITS)
+#define WHEEL_LEVELS 4
+
+/* a one-shot timer, embedded in the object it is for */
+struct timer {
+    // tick of the wheel at which it fires
+    unsigned long expires;
+    void (*fn)(void* arg);
+    void* arg;
+    // slot list; pprev is NULL when the timer is not pending
+    struct timer* next;
+    struct timer** pprev;
+};
+
+/* shuts down a connection that made no progress for a while,
+   without taking the time on every read or write */
+struct watchdog {
+    struct timer timer;
+    // protects fds against being closed while they are shut down
+    sem_t lock;
+    // the client, and the server being talked to, -1 if none
+    int fds[2];
+    long ms;
+    // progress since the timer was armed
+    volatile int active;
+    int fired;
+};
+
+void timer_init(void);
+long coarse_msec(void);
+time_t coarse_time(void);
+void timer_setup(struct timer* t, void (*fn)(void* arg), void* arg);
+void timer_add(struct timer* t, long ms);
+int timer_cancel(struct timer* t);
+void timer_cancel_sync(struct timer* t);
+void watchdog_start(struct watchdog* wd, int fd, long ms);
+void watchdog_set(struct watchdog* wd, long ms);
+void watchdog_watch(struct watchdog* wd, int fd);
+void watchdog_kick(struct watchdog* wd);
+int watchdog_stop(struct watchdog* wd);
+
+#endif /* __TIMER_H__ */
@@ -0,0 +1,215 @@
+#include <poll.h>
+#include "tunnel.h"
+#include "relay.h"
+#include "net.h"
+#include "stats.h"
+
+#ifndef SPLICE_F_MOVE
+#define SPLICE_F_MOVE 1
+#endif
+#ifndef SPLICE_F_NONBLOCK
+#define SPLICE_F_NONBLOCK 2
+#endif
+
+/*
+ * CONNECT host:port turns the client's connection into a tunnel to
+ * the server, for HTTPS. Both sockets are made non-blocking and each
+ * direction moves its bytes socket -> pipe -> socket with splice(),
+ * so they never come to user space. The thread waits in poll() on
+ * the two sockets for whatever direction can move next.
+ *
+ * A direction that reaches EOF shuts down the write side of the
+ * other socket once its pipe is empty; the tunnel ends when both
+ * did, on an error, or when the watchdog shuts both sockets down
+ * after the tunnel timeout without traffic.
+ */
+
+/* one direction of a tunnel */
+struct flow {
+    int from;
+    int to;
+    int pipe[2];
+    // bytes in the pipe
+    long pending;
+    long bytes;
+    // from reached EOF, and to was shut down for writing
+    int eof;
+    int shut;
+};
+
+/**
+ * move what can be moved without blocking
+ * @param f
+ * @param readable: poll() saw f->from ready
+ * @param writable: poll() saw f->to ready
+ * @return bytes read and written, -1 on error
+ */
+static long pump(struct flow* f, int readable, int writable) {
+    ssize_t n;
+    long moved = 0;
+    if (readable && !f->eof && f->pending == 0) {
+        n = syscall(SYS_splice, f->from, NULL, f->pipe[1], NULL,
+                    RELAY_PIPE_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n == 0)
+            f->eof = 1;
+        else if (n > 0) {
+            f->pending += n;
+            moved += n;
+            // try to pass it on right away
+            writable = 1;
+        }
+        else if (errno != EAGAIN && errno != EINTR)
+            return -1;
+    }
+    if (writable && f->pending > 0) {
+        n = syscall(SYS_splice, f->pipe[0], NULL, f->to, NULL, f->pending,
+                    SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            f->pending -= n;
+            f->bytes += n;
+            moved += n;
+        }
+        else if (n < 0 && errno != EAGAIN && errno != EINTR)
+            return -1;
+    }
+    if (f->eof && f->pending == 0 && !f->shut) {
+        shutdown(f->to, SHUT_WR);
+        f->shut = 1;
+    }
+    return moved;
+}
+
+/**
+ * the poll() events a direction waits for
+ */
+static void want(struct flow* f, short* from_events, short* to_events) {
+    if (!f->eof && f->pending == 0)
+        *from_events |= POLLIN;
+    if (f->pending > 0)
+        *to_events |= POLLOUT;
+}
+
+/**
+ * give a pipe back, or close it if bytes are left in it
+ */
+static void release_pipe(struct flow* f) {
+    if (f->pending == 0)
+        put_relay_pipe(f->pipe);
+    else {
+        close(f->pipe[0]);
+        close(f->pipe[1]);
+    }
+}
+
+/**
+ * split an authority, host:port or [v6]:port, in place
+ * @return 0, -1 if it is empty
+ */
+static int split_authority(char* authority, char** host, char** port) {
+    char* colon = strrchr(authority, ':');
+    *port = TUNNEL_DEFAULT_PORT;
+    if (colon && !strchr(colon, ']')) {
+        *colon = '\0';
+        *port = colon + 1;
+    }
+    *host = authority;
+    if (**host == '[') {
+        (*host)++;
+        char* end = strchr(*host, ']');
+        if (end)
+            *end = '\0';
+    }
+    return **host && **port ? 0 : -1;
+}
+
+/**
+ * answer a CONNECT request with a tunnel to the server
+ * @param fd: client, its connection ends with the tunnel
+ * @param rio: client, the request line was read
+ * @param authority: host:port from the request line
+ * @param wd: watchdog of the connection
+ */
+void serve_tunnel(int fd, rio_t* rio, char* authority, struct watchdog* wd) {
+    static const char ok[] = "HTTP/1.1 200 Connection Established\r\n\r\n";
+    static const char bad[] = "HTTP/1.1 502 Bad Gateway\r\n"
+                              "Content-Length: 0\r\n\r\n";
+    char *line, *host, *port;
+    struct flow up, down;
+    int server_fd;
+
+    // the headers are for the proxy, none are passed on
+    while (Rio_nextlineb(rio, &line) > 0 && strcmp(line, "\r\n") != 0)
+        ;
+    watchdog_set(wd, config.tunnel_timeout * 1000L);
+    if (split_authority(authority, &host, &port) < 0 ||
+        (server_fd = connect_server(host, port)) < 0) {
+        Rio_writen(fd, (void*) bad, sizeof(bad) - 1);
+        return;
+    }
+    watchdog_watch(wd, server_fd);
+    if (rio_writen(fd, (void*) ok, sizeof(ok) - 1) < 0 ||
+        get_relay_pipe(up.pipe) < 0) {
+        watchdog_watch(wd, -1);
+        Close(server_fd);
+        return;
+    }
+    if (get_relay_pipe(down.pipe) < 0) {
+        put_relay_pipe(up.pipe);
+        watchdog_watch(wd, -1);
+        Close(server_fd);
+        return;
+    }
+    up.from = down.to = fd;
+    up.to = down.from = server_fd;
+    up.pending = down.pending = up.bytes = down.bytes = 0;
+    up.eof = down.eof = up.shut = down.shut = 0;
+
+    // a client that did not wait for the 200 sent bytes already
+    while (rio->rio_cnt > 0) {
+        ssize_t n = rio_spliceb(rio, server_fd, up.pipe, rio->rio_cnt);
+        if (n <= 0)
+            break;
+        up.bytes += n;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL) | O_NONBLOCK);
+
+    while (!(up.shut && down.shut)) {
+        struct pollfd pfd[2];
+        long moved_up, moved_down;
+        pfd[0].events = pfd[1].events = 0;
+        want(&up, &pfd[0].events, &pfd[1].events);
+        want(&down, &pfd[1].events, &pfd[0].events);
+        // a socket nothing is wanted of would still wake the loop with
+        // POLLHUP or POLLERR, over and over once it hung up
+        pfd[0].fd = pfd[0].events ? fd : -1;
+        pfd[1].fd = pfd[1].events ? server_fd : -1;
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        // errors and hangups show as readable, the splice tells
+        int in0 = pfd[0].revents & (POLLIN | POLLHUP | POLLERR);
+        int in1 = pfd[1].revents & (POLLIN | POLLHUP | POLLERR);
+        int out0 = pfd[0].revents & (POLLOUT | POLLERR);
+        int out1 = pfd[1].revents & (POLLOUT | POLLERR);
+        if ((moved_up = pump(&up, in0, out1)) < 0 ||
+            (moved_down = pump(&down, in1, out0)) < 0)
+            break;
+        if (moved_up + moved_down > 0)
+            watchdog_kick(wd);
+        // a socket that hung up or failed with nothing left to move:
+        // neither direction can go on through it
+        else if ((pfd[0].revents | pfd[1].revents) & (POLLHUP | POLLERR))
+            break;
+    }
+
+    watchdog_watch(wd, -1);
+    Close(server_fd);
+    release_pipe(&up);
+    release_pipe(&down);
+    count_stat(STAT_TUNNELS, 1);
+    count_stat(STAT_TUNNEL_UP, up.bytes);
+    count_stat(STAT_TUNNEL_DOWN, down.bytes);
+}
@@ -0,0 +1,12 @@
+#ifndef __TUNNEL_H__
+#define __TUNNEL_H__
+
+#include "csapp.h"
+#include "timer.h"
+
+/* default port of a CONNECT authority without one */
+#define TUNNEL_DEFAULT_PORT "443"
+
+void serve_tunnel(int fd, rio_t* rio, char* authority, struct watchdog* wd);
+
+#endif /* __TUNNEL_H__ */